@@ -8,6 +8,28 @@
 #include <iostream>
 #include <utility>
 #include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <unordered_set>
+
+#include "misc/thread_pool.h"
+#include "misc/multithreading.h"
+#include "compression_pipeline.h"
+#include "metadata_transaction.h"
+#include "delta.h"
+
+
+namespace {
+    // Modification time of file, in nanoseconds since epoch, 0 if it can't be read
+    int64_t modification_time_of(const std::filesystem::directory_entry& entry) {
+        std::error_code error;
+        auto time = entry.last_write_time(error);
+        if (error) return 0;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    }
+}
 
 
 Archive::Archive() : root_folder(std::make_shared<Folder>())
@@ -27,13 +49,25 @@ void Archive::removeArchive() {
         std::filesystem::remove(load_path);
     }
     root_folder = nullptr;
-    jniLookup = std::unordered_map<int64_t, std::weak_ptr<ArchiveStructure>>();
+    toc = TableOfContents();
+    header_source = &linked_headers;
+    jniLookup.clear();
 }
 
 void Archive::close()
 {
     if (this->archive_file.is_open())
         this->archive_file.close();
+    this->archive_io.close();
+    this->archive_map.close();
+}
+
+
+void Archive::map_archive()
+{
+    assert(this->archive_file.is_open());
+    this->archive_file.flush();
+    this->archive_map.open( this->load_path, MappedFile::view::read_only );
 }
 
 void Archive::removeArchiveStruct(int64_t lookup_id)
@@ -47,42 +81,187 @@ void Archive::removeArchiveStruct(int64_t lookup_id)
 void Archive::removeMultipleArchiveStructs(
         std::vector<int64_t>& targets)
 {
-    std::vector<Folder*> folders;
-    std::vector<File*> files;
-
-    for (std::int64_t target : targets) {
-        std::shared_ptr<ArchiveStructure> currentStructure = jniLookup[target].lock();
+    std::vector<ArchiveStructure*> structures;
+    jniLookup.get_many(targets, structures);
+    std::sort(structures.begin(), structures.end());
+    structures.erase(std::unique(structures.begin(), structures.end()), structures.end());
+
+    // root stays, and whatever is under another target goes along with it
+    std::erase_if(structures, [](ArchiveStructure* s) { return s == nullptr or is_uninitialized(s->parent_ptr); });
+    std::unordered_set<ArchiveStructure*> selected(structures.begin(), structures.end());
+    std::erase_if(structures, [&selected](ArchiveStructure* s) {
+        for (auto folder = s->parent_ptr.lock(); folder != nullptr; folder = folder->parent_ptr.lock())
+            if (selected.contains(folder.get())) return true;
+        return false;
+    });
 
-        if (dynamic_cast<Folder*>(currentStructure.get())) {
-            folders.emplace_back(dynamic_cast<Folder*>(currentStructure.get()));
-            folders[folders.size()-1]->ptr_already_gotten = true;
+    assert(archive_file.is_open());
+    detach_toc();
+
+    // Headers pointing at removed structures are pointed past them, nothing else in the archive moves.
+    // What removed structures took is marked as free, so it can be reused
+    MetadataTransaction transaction;
+    std::vector<std::shared_ptr<ArchiveStructure>> removed;    // alive until their ids are released
+    for (ArchiveStructure* structure : structures) {
+        std::shared_ptr<Folder> parent = structure->parent_ptr.lock();
+
+        if (auto folder = dynamic_cast<Folder*>(structure)) {
+            load_subtree(folder->shared_from_this());
+            if (folder->alreadySaved) {
+                Folder* next = folder->sibling_ptr.get();
+                uint64_t next_location = (next != nullptr and next->alreadySaved) ? next->location : 0;
+                if (Folder* previous = folder->previous_sibling_ptr)   // start of previous folder's sibling_location
+                    transaction.patch(previous->header_field(16), next_location, 8);
+                else    // start of parent's child_dir_location
+                    transaction.patch(parent->header_field(8), next_location, 8);
+            }
+            removed.push_back(parent->remove_child(folder));
         }
-        else if (dynamic_cast<File*>(currentStructure.get())) {
-            files.emplace_back(dynamic_cast<File*>(currentStructure.get()));
-            files[files.size()-1]->ptr_already_gotten = true;
+        else if (auto file = dynamic_cast<File*>(structure)) {
+            if (file->alreadySaved) {
+                File* next = file->sibling_ptr.get();
+                uint64_t next_location = (next != nullptr and next->alreadySaved) ? next->location : 0;
+                if (File* previous = file->previous_sibling_ptr)   // start of previous file's sibling_location
+                    transaction.patch(previous->header_field(8), next_location, 8);
+                else    // start of parent's child_file_location
+                    transaction.patch(parent->header_field(24), next_location, 8);
+            }
+            removed.push_back(parent->remove_child(file));
         }
     }
+    transaction.commit(archive_file);
 
-    for (auto single_folder : folders) single_folder->get_ptrs( folders, files );
-    for (auto single_file   : files  ) single_file->get_ptrs( files );
+    // everything under removed folders is gone too
+    for (auto& structure : removed) release_removed(*structure);
+    trim_free_tail();
 
-    std::filesystem::path temp_path(this->load_path.parent_path() / "tk1999_archive.tmp");
+    // written right away, so an archive left as it is now (the process may be killed any time) loads from it
+    write_toc();
+    map_archive();
+}
 
-    std::fstream dst(temp_path, std::ios::binary | std::ios::out);
-    assert(dst.is_open());
 
-    dst.put(0);  // first bit is always 0x0, to make any location = 0 within the archive invalid, like nullptr or sth
+void Archive::release_removed(ArchiveStructure& structure)
+{
+    this->archive_file.flush();     // bases of deltas are read through archive_io
+    auto release = [this](ArchiveStructure& s, uint64_t end) {
+        if (s.alreadySaved) toc.free_space.add(s.location, end - s.location);
+        ReleaseJniLookupId(&s);
+    };
+    auto release_file = [this, &release](File& file) {
+        if (file.is_delta_base) {   // its data is now the delta's
+            release(file, file.data_location);
+            return;
+        }
+        release(file, file.data_location + file.compressed_size + multithreading::checksum_length(file.flags_value));
 
-    assert(archive_file.is_open());
+        delta::Base base;
+        if (file.alreadySaved and delta::is_delta(file.flags_value)
+                and delta::read_base(this->archive_io, file.data_location, base))
+            toc.free_space.add(base.data_location, base.span());
+    };
+
+    if (auto file = dynamic_cast<File*>(&structure)) {
+        release_file(*file);
+        return;
+    }
+
+    std::vector<Folder*> folders_left = { dynamic_cast<Folder*>(&structure) };
+    while (!folders_left.empty()) {
+        Folder* folder = folders_left.back();
+        folders_left.pop_back();
+
+        release(*folder, folder->location + Folder::base_metadata_size + folder->header_name_length);
+        for (File* file = folder->child_file_ptr.get(); file != nullptr; file = file->sibling_ptr.get())
+            release_file(*file);
+        for (Folder* child = folder->child_dir_ptr.get(); child != nullptr; child = child->sibling_ptr.get())
+            folders_left.push_back(child);
+    }
+}
+
+
+void Archive::trim_free_tail()
+{
+    assert(this->archive_file.is_open());
+    this->archive_file.flush();
+    this->archive_file.clear();
+    this->archive_file.seekp(0, std::ios_base::end);
+    uint64_t archive_end = this->archive_file.tellp();
+
+    uint64_t new_end = this->toc.free_space.trim_tail(archive_end);
+    if (new_end == archive_end) return;
+
+    this->archive_map.close();
+    std::filesystem::resize_file(this->load_path, new_end);
+    this->archive_file.clear();
+    this->archive_file.seekp(0, std::ios_base::end);
+}
 
-    root_folder->copy_to_another_archive(archive_file, dst, 0, 0);
 
-    if (archive_file.is_open()) archive_file.close();
-    if (dst.is_open()) dst.close();
+bool Archive::compact(uint64_t io_budget)
+{
+    assert(this->archive_file.is_open() and this->archive_io.is_open());
+    if (this->toc.free_space.empty()) return false;
+
+    load_subtree(this->root_folder);    // any file may have to be moved
+    detach_toc();
+    this->archive_map.close();
+
+    std::vector<File*> files;
+    std::vector<Folder*> folders_left = { this->root_folder.get() };
+    while (!folders_left.empty()) {
+        Folder* folder = folders_left.back();
+        folders_left.pop_back();
+
+        for (File* file = folder->child_file_ptr.get(); file != nullptr; file = file->sibling_ptr.get())
+            if (file->alreadySaved and file->location != 0) files.push_back(file);
+        for (Folder* child = folder->child_dir_ptr.get(); child != nullptr; child = child->sibling_ptr.get())
+            folders_left.push_back(child);
+    }
+
+    // Files are moved from the end of archive into the lowest free range before them, so free space gathers at
+    // the end, where it's cut off. Data is copied first, and only then headers are pointed at the copy
+    std::sort(files.begin(), files.end(), [](File* a, File* b) { return a->location > b->location; });
+
+    uint64_t moved = 0;
+    bool stopped = false;
+    for (File* file : files) {
+        if (io_budget != 0 and moved >= io_budget) {
+            stopped = true;
+            break;
+        }
+
+        uint64_t header_size = file->data_location - file->location;
+        uint64_t size = header_size + file->compressed_size + multithreading::checksum_length(file->flags_value);
+        uint64_t new_location = 0;
+        if (!this->toc.free_space.take_below(size, file->location, new_location)) continue;
+
+        this->archive_file.flush();
+        if (!this->archive_io.copy_to(this->archive_io, file->location, size, new_location)) {
+            this->toc.free_space.add(new_location, size);
+            break;
+        }
 
-    std::filesystem::copy_file(temp_path, load_path, std::filesystem::copy_options::overwrite_existing);
-    std::filesystem::remove(temp_path);
-    for(auto target : targets) jniLookup.erase(target);
+        // committed right away, later copies have to see these headers as they are now
+        MetadataTransaction transaction;
+        transaction.patch(new_location + 1 + file->header_name_length + 18, new_location + header_size, 8);  // data_location
+        std::shared_ptr<Folder> parent = file->parent_ptr.lock();
+        if (File* previous = file->previous_sibling_ptr)
+            transaction.patch(previous->header_field(8), new_location, 8);
+        else
+            transaction.patch(parent->header_field(24), new_location, 8);
+        transaction.commit(this->archive_file);
+
+        this->toc.free_space.add(file->location, size);
+        file->location = new_location;
+        file->data_location = new_location + header_size;
+        moved += size;
+    }
+
+    trim_free_tail();
+    write_toc();
+    map_archive();
+    return stopped;
 }
 
 void Archive::save(const std::string& path_to_file, bool& aborting_var)
@@ -90,10 +269,304 @@ void Archive::save(const std::string& path_to_file, bool& aborting_var)
     assert(!this->archive_file.is_open());
     this->archive_file.open( path_to_file, std::ios::binary|std::ios::out );
     assert(this->archive_file.is_open());
+    this->archive_io.open( path_to_file, PositionalFile::access::read_write );
 
     char* buffer[1] = {nullptr};
     this->archive_file.write( (char*)buffer, 1 ); // making sure location at byte 0 in file is not valid
-    this->root_folder->write_to_archive( this->archive_file, aborting_var );
+
+    std::vector<File*> order = files_in_write_order(*this->root_folder);
+    mark_direct_io(order);
+    CompressionPipeline pipeline(aborting_var);
+    pipeline.compress_ahead(order);
+    MetadataTransaction transaction;
+    this->root_folder->write_to_archive( this->archive_file, aborting_var, &transaction );
+    transaction.commit(this->archive_file);
+    this->load_path = std::filesystem::path( path_to_file );
+
+    if (!aborting_var) write_toc();
+    map_archive();
+}
+
+
+bool Archive::append_files(const std::vector<std::shared_ptr<File>>& files, bool& aborting_var,
+                           uint32_t* partialProgress, uint32_t* totalProgress)
+{
+    assert(this->archive_file.is_open());
+
+    std::vector<File*> order;
+    for (auto& file : files) order.push_back(file.get());
+    mark_direct_io(order);
+
+    bool successful = true;
+    detach_toc();
+    {
+        CompressionPipeline pipeline(aborting_var);
+        pipeline.compress_ahead(order);
+
+        // headers of all files are linked in together, after the last one is written
+        MetadataTransaction transaction;
+        for (auto& file : files) {
+            if (aborting_var) break;
+            if (file->alreadySaved) continue;
+
+            // size of a file compressed ahead is known before it's written, so it can go into a free range
+            uint64_t free_location = 0;
+            if (!this->toc.free_space.empty() and file->compression_job) {
+                std::shared_ptr<EncodedFile> encoded = pipeline.finish(*file);
+                if (encoded and encoded->successful)
+                    this->toc.free_space.take(File::base_metadata_size + file->name.length() + encoded->data.size(),
+                                              free_location);
+            }
+
+            if (free_location != 0) {
+                this->archive_file.seekp(free_location);
+                successful &= file->write_to_archive(this->archive_file, aborting_var, false,
+                                                     partialProgress, totalProgress, &transaction);
+            }
+            else successful &= file->append_to_archive(this->archive_file, aborting_var, false,
+                                                       partialProgress, totalProgress, &transaction);
+        }
+        successful &= transaction.commit(this->archive_file);
+    }
+    if (!aborting_var) write_toc();
+    map_archive();
+    return successful and !aborting_var;
+}
+
+
+bool Archive::append_folders(const std::vector<Folder*>& folders, bool& aborting_var)
+{
+    assert(this->archive_file.is_open());
+
+    // first new folder of a chain writes the new siblings after it too, with everything under them
+    std::vector<Folder*> first_ones;
+    for (Folder* folder : folders) {
+        if (folder->alreadySaved or is_uninitialized(folder->parent_ptr)) continue;
+        if (!folder->parent_ptr.lock()->alreadySaved) continue;
+        if (folder->previous_sibling_ptr != nullptr and !folder->previous_sibling_ptr->alreadySaved) continue;
+        first_ones.push_back(folder);
+    }
+    if (first_ones.empty()) return true;
+
+    std::vector<File*> order;
+    for (Folder* folder : first_ones) {
+        std::vector<File*> files = files_in_write_order(*folder);
+        order.insert(order.end(), files.begin(), files.end());
+    }
+    mark_direct_io(order);
+
+    detach_toc();
+    {
+        CompressionPipeline pipeline(aborting_var);
+        pipeline.compress_ahead(order);
+
+        MetadataTransaction transaction;
+        for (Folder* folder : first_ones) {
+            if (aborting_var) break;
+            folder->append_to_archive(this->archive_file, aborting_var, &transaction);
+        }
+        transaction.commit(this->archive_file);
+    }
+    if (!aborting_var) write_toc();
+    map_archive();
+    return !aborting_var;
+}
+
+
+bool Archive::is_unchanged(const File& file, const std::filesystem::directory_entry& source, bool verify_checksum,
+                           bool& aborting_var)
+{
+    if (!file.alreadySaved or file.modification_time == 0) return false;
+
+    std::error_code error;
+    uint64_t size = source.file_size(error);
+    if (error or size != file.original_size) return false;
+    if (modification_time_of(source) != file.modification_time) return false;
+
+    // checksum of the original is stored right after file's data
+    uint8_t checksum_length = multithreading::checksum_length(file.flags_value);
+    if (!verify_checksum or checksum_length == 0) return true;
+
+    std::string stored(checksum_length, 0x00);
+    this->archive_file.flush();
+    if (this->archive_io.read_at(stored.data(), checksum_length, file.data_location + file.compressed_size)
+            != checksum_length)
+        return false;
+    return multithreading::file_checksum(source.path().string(), file.flags_value, aborting_var) == stored;
+}
+
+
+bool Archive::update_from(const std::filesystem::path& source_directory, uint16_t flags, bool& aborting_var,
+                          bool verify_checksums, UpdateSummary* summary,
+                          uint32_t* partialProgress, uint32_t* totalProgress)
+{
+    assert(this->archive_file.is_open());
+    load_subtree(this->root_folder);
+
+    UpdateSummary counts;
+    std::unordered_set<ArchiveStructure*> kept = { this->root_folder.get() };
+    std::vector<Folder*> new_folders;
+    // new and changed files are added only after the whole scan, old versions are removed once new ones are appended
+    std::vector<std::pair<std::shared_ptr<Folder>, std::filesystem::path>> to_compress;
+    std::vector<std::pair<File*, std::filesystem::path>> changed;  // old versions, which may become bases of deltas
+
+    std::vector<std::pair<std::shared_ptr<Folder>, std::filesystem::path>> folders_left = {
+            { this->root_folder, source_directory } };
+    while (!folders_left.empty() and !aborting_var) {
+        auto [folder, directory] = std::move(folders_left.back());
+        folders_left.pop_back();
+
+        for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+            std::string name = entry.path().filename().string();
+
+            if (entry.is_directory()) {
+                auto it = folder->child_dirs_by_name.find(name);
+                std::shared_ptr<Folder> child;
+                if (it != folder->child_dirs_by_name.end()) child = it->second->shared_from_this();
+                else {
+                    child = *add_folder_to_model(folder, name);
+                    new_folders.push_back(child.get());
+                }
+                kept.insert(child.get());
+                folders_left.emplace_back(child, entry.path());
+            }
+            else if (entry.is_regular_file()) {
+                auto it = folder->child_files_by_name.find(name);
+                if (it != folder->child_files_by_name.end()
+                        and is_unchanged(*it->second, entry, verify_checksums, aborting_var)) {
+                    kept.insert(it->second);
+                    counts.unchanged++;
+                }
+                else {
+                    if (it != folder->child_files_by_name.end()) changed.emplace_back(it->second, entry.path());
+                    to_compress.emplace_back(folder, entry.path());
+                }
+            }
+        }
+    }
+
+    // anything that wasn't kept changed, or its source is gone
+    std::vector<int64_t> outdated;
+    std::vector<Folder*> left = { this->root_folder.get() };
+    while (!left.empty()) {
+        Folder* folder = left.back();
+        left.pop_back();
+
+        for (File* file = folder->child_file_ptr.get(); file != nullptr; file = file->sibling_ptr.get())
+            if (!kept.contains(file)) outdated.push_back(file->lookup_id);
+        for (Folder* child = folder->child_dir_ptr.get(); child != nullptr; child = child->sibling_ptr.get()) {
+            if (kept.contains(child)) left.push_back(child);
+            else outdated.push_back(child->lookup_id);
+        }
+    }
+
+    if (aborting_var) {     // folders added to the model on the way aren't in archive, so they can't stay
+        std::vector<int64_t> added;
+        for (Folder* folder : new_folders) added.push_back(folder->lookup_id);
+        removeMultipleArchiveStructs(added);
+        return false;
+    }
+
+    // deltas are made while old versions are still in the model, their data stays after they're removed
+    std::unordered_map<std::string, std::shared_ptr<PendingDelta>> deltas;
+    if (this->delta_min_size != 0) {
+        this->archive_file.flush();
+        for (auto& [old_version, path] : changed) {
+            std::error_code error;
+            uint64_t size = std::filesystem::file_size(path, error);
+            if (error or size < this->delta_min_size or !old_version->alreadySaved or old_version->original_size == 0
+                    or delta::is_delta(old_version->flags_value) or ((old_version->flags_value >> 6) & 1u))
+                continue;
+
+            auto pending = std::make_shared<PendingDelta>();
+            pending->base = delta::base_of(*old_version);
+            if (!delta::encode(this->archive_io, pending->base, path, pending->stream, aborting_var)) continue;
+            old_version->is_delta_base = true;
+            deltas[path.string()] = pending;
+        }
+    }
+
+    // old versions stay in archive until their new ones are appended, meanwhile new ones are found by their names
+    for (auto& [old_version, path] : changed)
+        old_version->parent_ptr.lock()->child_files_by_name.erase(old_version->name);
+
+    std::vector<std::shared_ptr<File>> added_files, in_archived_folders;
+    for (auto& [folder, path] : to_compress) {
+        auto it = deltas.find(path.string());
+        auto file = add_file_to_archive_model(folder, path.string(),
+                                              it == deltas.end() ? flags : flags | (1u << delta::flag));
+        if (it != deltas.end()) file->pending_delta = it->second;
+        added_files.push_back(file);
+        if (folder->alreadySaved) in_archived_folders.push_back(file);
+    }
+
+    // what's appended is either in ranges free now, or past the current end
+    FreeSpaceMap free_before = this->toc.free_space;
+    this->archive_file.seekp(0, std::ios_base::end);
+    uint64_t end_before = this->toc.location != 0 ? this->toc.location : (uint64_t)this->archive_file.tellp();
+
+    bool successful = true;
+    if (!in_archived_folders.empty())
+        successful &= append_files(in_archived_folders, aborting_var, partialProgress, totalProgress);
+    successful &= append_folders(new_folders, aborting_var);
+
+    if (!successful or aborting_var) {
+        // everything added goes, and removing new versions indexes old ones by name again. Files cut short
+        // don't know how much they took, so free space is put back as it was, and archive ends where it did
+        std::vector<int64_t> added;
+        for (auto& file : added_files) added.push_back(file->lookup_id);
+        for (Folder* folder : new_folders) added.push_back(folder->lookup_id);
+        for (auto& [old_version, path] : changed) old_version->is_delta_base = false;
+        this->toc.free_space.clear();
+        removeMultipleArchiveStructs(added);
+
+        this->toc.free_space = std::move(free_before);
+        detach_toc();
+        this->archive_file.seekp(0, std::ios_base::end);
+        uint64_t end = this->archive_file.tellp();
+        if (end > end_before) this->toc.free_space.add(end_before, end - end_before);
+        trim_free_tail();
+        write_toc();
+        map_archive();
+        return false;
+    }
+
+    if (!outdated.empty()) removeMultipleArchiveStructs(outdated);
+    counts.removed = outdated.size();
+    counts.compressed = to_compress.size();
+    if (summary != nullptr) *summary = counts;
+    return true;
+}
+
+
+std::vector<File*> Archive::files_in_write_order(Folder& folder)
+{
+    // Folder::write_to_archive goes: its sibling (with everything under it), its files, its first subfolder
+    std::vector<File*> files;
+    std::vector<std::pair<Folder*, bool>> left = { { &folder, false } };   // (folder, only its files)
+    while (!left.empty()) {
+        auto [current, only_files] = left.back();
+        left.pop_back();
+
+        if (only_files) {
+            for (File* file = current->child_file_ptr.get(); file != nullptr; file = file->sibling_ptr.get())
+                files.push_back(file);
+            continue;
+        }
+        if (current->child_dir_ptr) left.emplace_back(current->child_dir_ptr.get(), false);
+        left.emplace_back(current, true);
+        if (current->sibling_ptr) left.emplace_back(current->sibling_ptr.get(), false);
+    }
+    return files;
+}
+
+
+void Archive::mark_direct_io(const std::vector<File*>& files)
+{
+    for (File* file : files) {
+        bool direct = this->direct_io_threshold != 0 and file->original_size >= this->direct_io_threshold;
+        file->direct_io_archive = direct ? &this->archive_io : nullptr;
+    }
 }
 
 
@@ -103,18 +576,84 @@ void Archive::load(const std::string& path_to_file )
 
     this->archive_file.open( path_to_file, std::ios::binary | std::ios::in | std::ios::out );
     assert(this->archive_file.is_open());
+    this->archive_io.open( path_to_file, PositionalFile::access::read_write );
+    map_archive();
 
     std::weak_ptr<Folder> emptyPtr{};
 
-    this->archive_file.seekg( 1 );
-    this->root_folder->parse(this->archive_file, 1, emptyPtr, this->root_folder);
-    recursiveAddFolderToLookup(root_folder);
+    // without valid table of contents, the linked headers have to be followed
+    if (this->toc.load(this->archive_file, &this->archive_map)) this->header_source = &this->toc;
+    else this->header_source = &this->mapped_headers;
+
+    // anything loaded before is replaced by the parsed model
+    this->jniLookup.clear();
+    AssignJniLookupId(this->root_folder);
+
+    // only root's direct children are parsed now, the rest is parsed when it's accessed
+    this->root_folder->parse(*this->header_source, 1, emptyPtr);
+    load_children(root_folder);
+
+    // Root is shown under the file's name, but its header keeps the name it was saved with, and headers are patched
+    // by that one. Table of contents has root's name from whenever it was written, so it's read from root's header
+    HeaderRecord root_header;
+    this->mapped_headers.read(1, HeaderRecord::kind::folder, root_header);
+    this->root_folder->header_name_length = root_header.name.length();
 
     this->root_folder->name = std::filesystem::path(path_to_file).filename();
     this->root_folder->name_length = this->root_folder->name.length();
 }
 
 
+void Archive::load_children(const std::shared_ptr<Folder>& folder)
+{
+    if (folder->children_loaded) return;
+
+    std::shared_ptr<Folder> shared_folder = folder;
+    folder->load_children(*this->header_source, shared_folder);
+
+    for (auto child = folder->child_dir_ptr; child != nullptr; child = child->sibling_ptr)
+        AssignJniLookupId(child);
+    for (auto file = folder->child_file_ptr; file != nullptr; file = file->sibling_ptr)
+        AssignJniLookupId(file);
+}
+
+
+void Archive::load_subtree(const std::shared_ptr<Folder>& folder)
+{
+    std::vector<std::shared_ptr<Folder>> folders_left = { folder };
+    while (!folders_left.empty()) {
+        std::shared_ptr<Folder> current = folders_left.back();
+        folders_left.pop_back();
+
+        load_children(current);
+        for (auto child = current->child_dir_ptr; child != nullptr; child = child->sibling_ptr)
+            folders_left.push_back(child);
+    }
+}
+
+
+void Archive::write_toc()
+{
+    assert(this->archive_file.is_open());
+    detach_toc();
+    this->toc.write(this->archive_file, *this->root_folder, this->header_source);
+}
+
+
+void Archive::detach_toc()
+{
+    if (this->toc.location == 0) return;
+    assert(this->archive_file.is_open());
+
+    this->archive_file.flush();
+    this->archive_map.close();
+    std::filesystem::resize_file(this->load_path, this->toc.location);
+    this->archive_file.clear();
+    this->archive_file.seekp(0, std::ios_base::end);
+    this->toc.location = 0;
+}
+
+
 void Archive::build_empty_archive() const
 {
     this->root_folder->name = "new_archive" + this->extension;
@@ -131,32 +670,33 @@ void Archive::build_empty_archive(std::string archive_name)
 }
 
 
-std::shared_ptr<File>* find_file_in_archive( Folder* parent, File* wanted_file ) {
-    if ( parent->child_file_ptr.get() == wanted_file ) return &(parent->child_file_ptr);
-
-    std::shared_ptr<File>* tempfile_ptr = &(parent->child_file_ptr);
-    while( tempfile_ptr->get() != wanted_file and tempfile_ptr->get() != nullptr ) {
-        tempfile_ptr = &(tempfile_ptr->get()->sibling_ptr);
-    }
-    if ( tempfile_ptr->get() == wanted_file ) return tempfile_ptr;
+File* Archive::find_file_in_archive(const std::filesystem::path& path_in_archive)
+{
+    Folder* parent = find_folder_in_archive(path_in_archive.parent_path());
+    if (parent == nullptr) return nullptr;
 
-    return nullptr;
+    load_children(parent->shared_from_this());
+    auto it = parent->child_files_by_name.find(path_in_archive.filename().string());
+    return it == parent->child_files_by_name.end() ? nullptr : it->second;
 }
 
 
-std::shared_ptr<Folder>* find_folder_in_archive( Folder* parent, Folder* wanted_folder ) {
-    if ( parent->child_dir_ptr.get() == wanted_folder ) return &(parent->child_dir_ptr);
-
-    std::shared_ptr<Folder>* tempfolder_ptr = &(parent->child_dir_ptr);
-    while( tempfolder_ptr->get() != wanted_folder and tempfolder_ptr->get() != nullptr ) {
-        tempfolder_ptr = &(tempfolder_ptr->get()->sibling_ptr);
+Folder* Archive::find_folder_in_archive(const std::filesystem::path& path_in_archive)
+{
+    Folder* folder = root_folder.get();
+    for (const auto& component : path_in_archive.relative_path()) {
+        if (component.empty() or component == ".") continue;
+
+        load_children(folder->shared_from_this());
+        auto it = folder->child_dirs_by_name.find(component.string());
+        if (it == folder->child_dirs_by_name.end()) return nullptr;
+        folder = it->second;
     }
-    if ( tempfolder_ptr->get() == wanted_folder ) return tempfolder_ptr;
-    return nullptr;
+    return folder;
 }
 
 
-void Archive::unpack_whole_archive( const std::string& path_to_directory, std::fstream &os, bool& aborting_var )
+void Archive::unpack_whole_archive( const std::string& path_to_directory, [[maybe_unused]] std::fstream &os, bool& aborting_var )
 {
     std::filesystem::path path(path_to_directory);
     if (!std::filesystem::exists(path))
@@ -164,59 +704,153 @@ void Archive::unpack_whole_archive( const std::string& path_to_directory, std::f
 
     assert(this->archive_file.is_open());
 
-    this->root_folder->unpack( path, os, aborting_var, true );
-
+    unpack_folder(root_folder, path, aborting_var);
 }
 
 
-std::shared_ptr<Folder>* Archive::add_folder_to_model( std::shared_ptr<Folder> &parent_dir, const std::string& folder_name )
+bool Archive::unpack_folder(const std::shared_ptr<Folder>& folder, const std::filesystem::path& destination,
+                            bool& aborting_var, uint32_t* partialProgress, uint32_t* totalProgress)
 {
-    std::shared_ptr<Folder> *pointer_to_be_returned = nullptr;
-    if (parent_dir->child_dir_ptr == nullptr) {
-        parent_dir->child_dir_ptr = std::make_shared<Folder>( parent_dir, folder_name );
-        pointer_to_be_returned = &(parent_dir->child_dir_ptr);
+    assert(this->archive_file.is_open() and this->archive_io.is_open());
+    this->archive_file.flush();     // files are read through archive_io and archive_map
+    load_subtree(folder);
+
+    // directory skeleton is made once, up front, and every file remembers where it goes
+    std::vector<std::pair<File*, std::filesystem::path>> files;
+    std::vector<std::pair<Folder*, std::filesystem::path>> folders_left = { { folder.get(), destination } };
+    while (!folders_left.empty()) {
+        auto [current, parent_path] = folders_left.back();
+        folders_left.pop_back();
+
+        std::filesystem::path folder_path = parent_path;
+        if (is_uninitialized(current->parent_ptr)) folder_path /= std::filesystem::path(current->name).stem();
+        else folder_path /= current->name;
+        std::filesystem::create_directories(folder_path);
+
+        for (File* file = current->child_file_ptr.get(); file != nullptr; file = file->sibling_ptr.get())
+            files.emplace_back(file, folder_path);
+        for (Folder* child = current->child_dir_ptr.get(); child != nullptr; child = child->sibling_ptr.get())
+            folders_left.emplace_back(child, folder_path);
     }
-    else {
-        Folder* previous_folder = parent_dir->child_dir_ptr.get();
-        while( previous_folder->sibling_ptr != nullptr )
-        {
-            previous_folder = previous_folder->sibling_ptr.get();
+
+    // archive is read front to back
+    std::sort(files.begin(), files.end(),
+              [](const auto& a, const auto& b) { return a.first->data_location < b.first->data_location; });
+
+    // Single block files are unpacked on the pool, many at once. Every task takes a run of neighbouring files,
+    // and reads them through archive_io, so at most (pool size) files are open and decoded at a time.
+    // Bigger files go through processing_foreman one by one, since it already splits them between all cores
+    std::vector<std::pair<File*, std::filesystem::path>*> big_files;
+    std::atomic<bool> successful = true;
+    std::mutex progress_mutex;
+    {
+        ThreadPool pool;
+        const uint64_t files_per_task = 32;
+
+        std::vector<std::pair<File*, std::filesystem::path>*> run;
+        auto submit_run = [&]() {
+            if (run.empty()) return;
+            pool.submit([&, run]() {
+                for (auto entry : run) {
+                    if (aborting_var) return;
+                    if (!entry->first->unpack_serial(this->archive_io, entry->second, aborting_var, true,
+                                                     &this->archive_map))
+                        successful = false;
+
+                    std::lock_guard<std::mutex> lock(progress_mutex);
+                    if (totalProgress != nullptr) (*totalProgress)++;
+                }
+            });
+            run.clear();
+        };
+
+        for (auto& entry : files) {
+            // deltas decode blocks of their base on all cores as well
+            if (BlockIndex::block_count(entry.first->flags_value, entry.first->original_size) > 1 or
+                delta::is_delta(entry.first->flags_value)) {
+                big_files.push_back(&entry);
+                continue;
+            }
+            run.push_back(&entry);
+            if (run.size() == files_per_task) submit_run();
         }
-        previous_folder->sibling_ptr = std::make_shared<Folder>( parent_dir, folder_name );
-        pointer_to_be_returned = &(previous_folder->sibling_ptr);
+        submit_run();
+
+        for (auto entry : big_files) {
+            if (aborting_var) break;
+            mark_direct_io({ entry->first });
+            if (!entry->first->process_the_file(this->archive_file, entry->second.string(), false, aborting_var, true,
+                                                partialProgress, nullptr, &this->archive_io, &this->archive_map))
+                successful = false;
+
+            std::lock_guard<std::mutex> lock(progress_mutex);
+            if (totalProgress != nullptr) (*totalProgress)++;
+        }
+        pool.wait();
     }
 
-    return pointer_to_be_returned;
+    return successful and !aborting_var;
 }
 
 
-Folder* Archive::add_folder_to_model(std::weak_ptr<Folder> parent_dir, std::string folder_name)
+uint64_t Archive::unlock_folder(const std::shared_ptr<Folder>& folder, std::string& pw, bool& aborting_var)
 {
-    assert(not is_uninitialized(parent_dir));
-    auto locked_parent = parent_dir.lock();
-    std::shared_ptr<Folder> *pointer_to_be_returned = nullptr;
-    if (locked_parent->child_dir_ptr == nullptr) {
-        locked_parent->child_dir_ptr = std::make_shared<Folder>( parent_dir, folder_name );
-        AssignJniLookupId(locked_parent->child_dir_ptr);
-        pointer_to_be_returned = &(locked_parent->child_dir_ptr);
+    assert(this->archive_file.is_open() and this->archive_io.is_open());
+    this->archive_file.flush();     // metadata is read through archive_io
+    load_subtree(folder);
+
+    // metadata of every locked file is read first, so keys of all its salts can be derived at once
+    std::vector<File*> locked;
+    std::vector<std::basic_string<uint8_t>> metadata;
+    std::vector<KeySession::Params> params;
+    for (File* file : files_in_write_order(*folder)) {
+        if (!file->is_locked()) continue;
+        std::basic_string<uint8_t> file_metadata(crypto::AES128::metadata_size, 0x00);
+        if (archive_io.read_at(file_metadata.data(), file_metadata.size(), file->data_location) != file_metadata.size())
+            continue;
+
+        KeySession::Params file_params{};
+        std::copy(file_metadata.begin(), file_metadata.begin() + file_params.salt.size(), file_params.salt.begin());
+        file_params.iterations = crypto::AES128::iterations_of(file_metadata.data(), file_metadata.size());
+        locked.push_back(file);
+        metadata.push_back(std::move(file_metadata));
+        params.push_back(file_params);
     }
-    else {
-        Folder* previous_folder = locked_parent->child_dir_ptr.get();
-        while( previous_folder->sibling_ptr != nullptr )
-        {
-            previous_folder = previous_folder->sibling_ptr.get();
-        }
-        previous_folder->sibling_ptr = std::make_shared<Folder>( parent_dir, folder_name );
-        AssignJniLookupId(locked_parent->sibling_ptr);
-        pointer_to_be_returned = &(previous_folder->sibling_ptr);
+    keys.derive_all(pw, params, aborting_var);
+
+    uint64_t unlocked = 0;
+    uint8_t pwkey[KeySession::key_size];
+    for (uint64_t i=0; i < locked.size() and !aborting_var; ++i) {
+        if (!keys.derive(pw, params[i], pwkey, aborting_var)) break;
+        if (locked[i]->unlock(metadata[i], pwkey, aborting_var)) unlocked++;
     }
+    std::fill(std::begin(pwkey), std::end(pwkey), 0);
+    return unlocked;
+}
+
 
-    return pointer_to_be_returned->get();
+std::shared_ptr<Folder>* Archive::add_folder_to_model( std::shared_ptr<Folder> &parent_dir, const std::string& folder_name )
+{
+    load_children(parent_dir);
+
+    std::shared_ptr<Folder>& new_folder = parent_dir->append_child(std::make_shared<Folder>( parent_dir, folder_name ));
+    AssignJniLookupId(new_folder);
+    return &new_folder;
+}
+
+
+Folder* Archive::add_folder_to_model(std::weak_ptr<Folder> parent_dir, std::string folder_name)
+{
+    assert(not is_uninitialized(parent_dir));
+    auto locked_parent = parent_dir.lock();
+    return add_folder_to_model(locked_parent, folder_name)->get();
 }
 
 
 std::shared_ptr<File> Archive::add_file_to_archive_model(std::shared_ptr<Folder>& parent_dir, const std::string& path_to_file, const uint16_t& flags)
 {
+    load_children(parent_dir);
+
     std::filesystem::path std_path(path_to_file);
     std::shared_ptr<File> new_file = std::make_shared<File>();
 
@@ -230,40 +864,21 @@ std::shared_ptr<File> Archive::add_file_to_archive_model(std::shared_ptr<Folder>
     ptr_new_file->parent_ptr = parent_dir;            // ptr to parent folder in memory
     ptr_new_file->sibling_ptr=nullptr;                      // ptr to next sibling file in memory
 
-    if (parent_dir->child_file_ptr != nullptr)
-    {
-        File* file_ptr = parent_dir->child_file_ptr.get();  // file_ptr points to previous file
-        while( file_ptr->sibling_ptr != nullptr )
-        {
-            file_ptr = file_ptr->sibling_ptr.get();
-        }
-        file_ptr->sibling_ptr.swap(new_file);
-        AssignJniLookupId(file_ptr->sibling_ptr);
-        new_file = file_ptr->sibling_ptr;
-    }
-    else {
-        parent_dir->child_file_ptr.swap(new_file);
-        AssignJniLookupId(parent_dir->child_file_ptr);
-        new_file = parent_dir->child_file_ptr;
-    }
-
-    correct_duplicate_names(ptr_new_file, parent_dir.get());
+    correct_duplicate_names(ptr_new_file, parent_dir.get());   // name has to be final before it's indexed
 
     ptr_new_file->flags_value = flags;              // 16 flags represented as 16-bit int
     ptr_new_file->data_location = 0;                // location of data in archive (in bytes) will be added to model right before writing the data
     ptr_new_file->original_size = std::filesystem::file_size( std_path );
     ptr_new_file->compressed_size=0;                // will be determined after compression
+    ptr_new_file->modification_time = modification_time_of(std::filesystem::directory_entry(std_path));
 
+    AssignJniLookupId(parent_dir->append_child(new_file));
     return new_file;
 }
 
 void Archive::recursiveAddFolderToLookup(std::shared_ptr<Folder>& folder_ptr) {
     // check if already added or partialy added
-    if (folder_ptr->lookup_id == 0) {
-        AssignJniLookupId(folder_ptr);
-    } else if (jniLookup.find(folder_ptr->lookup_id) == jniLookup.end()) {
-        jniLookup[currentLookupId++] = folder_ptr;
-    }
+    if (jniLookup.get(folder_ptr->lookup_id) != folder_ptr.get()) AssignJniLookupId(folder_ptr);
 
     if (folder_ptr->child_dir_ptr) recursiveAddFolderToLookup(folder_ptr->child_dir_ptr);
     if (folder_ptr->sibling_ptr) recursiveAddFolderToLookup(folder_ptr->sibling_ptr);
@@ -273,11 +888,7 @@ void Archive::recursiveAddFolderToLookup(std::shared_ptr<Folder>& folder_ptr) {
 
 void Archive::recursiveAddFileToLookup(std::shared_ptr<File>& file_ptr) {
     // check if already added or partialy added
-    if (file_ptr->lookup_id == 0) {
-        AssignJniLookupId(file_ptr);
-    } else if (jniLookup.find(file_ptr->lookup_id) == jniLookup.end()) {
-        jniLookup[currentLookupId++] = file_ptr;
-    }
+    if (jniLookup.get(file_ptr->lookup_id) != file_ptr.get()) AssignJniLookupId(file_ptr);
 
     if (file_ptr->sibling_ptr) recursiveAddFileToLookup(file_ptr->sibling_ptr);
 }
@@ -319,12 +930,14 @@ File* Archive::add_file_to_archive_model(Folder &parent_dir, const std::string&
 }*/
 
 
-void Archive::recursive_print() const {
+void Archive::recursive_print() {
+    load_subtree(root_folder);
     root_folder->recursive_print( std::cout );
     std::cout << std::endl;
 }
 
-std::string Archive::recursive_string() const {
+std::string Archive::recursive_string() {
+    load_subtree(root_folder);
     std::stringstream ss;
     root_folder->recursive_print(ss);
     return ss.str();
@@ -332,62 +945,29 @@ std::string Archive::recursive_string() const {
 
 void Archive::AssignJniLookupId(const std::shared_ptr<ArchiveStructure>& structure)
 {
-    structure->lookup_id = currentLookupId;
-    jniLookup[currentLookupId++] = structure;
+    structure->lookup_id = jniLookup.insert(structure.get());
+}
+
+void Archive::ReleaseJniLookupId(ArchiveStructure* structure)
+{
+    jniLookup.erase(structure->lookup_id);
+    structure->lookup_id = 0;
 }
 
 void Archive::correct_duplicate_names(File* target_file, Folder* parent_folder)
 {
-    std::vector<std::string> name_list;
-    if (parent_folder->child_file_ptr == nullptr) return;
-    else {
-        File* file_in_dir = parent_folder->child_file_ptr.get();
-        name_list.push_back(file_in_dir->name);
+    // target_file isn't a child of parent_folder yet, so any file with the same name is a duplicate
+    auto& files_by_name = parent_folder->child_files_by_name;
+    if (files_by_name.find(target_file->name) == files_by_name.end()) return;
 
-        while (file_in_dir->sibling_ptr != nullptr)
-        {
-            file_in_dir = file_in_dir->sibling_ptr.get();
-            name_list.push_back(file_in_dir->name);
-        }
-        std::string new_name = std::filesystem::path(target_file->name).stem().string() + " (";
-        std::string extension = std::filesystem::path(target_file->name).extension().string();
-        uint64_t duplicate_counter = 0;
-        bool unique_name = false;
-
-        while( !unique_name ) {
-            bool found = false;
-            uint64_t names_like_current = 0;
-            for (auto current_name : name_list)
-            {
-                if (duplicate_counter == 0)
-                {
-                    if (target_file->name == current_name)
-                    {
-                        names_like_current++;
-                        if (names_like_current > 1) {
-                            duplicate_counter++;
-                            found = true;
-                            break;
-                        }
-                    }
-                }
-                else
-                {
-                    if(new_name + std::to_string(duplicate_counter) + ")" + extension == current_name)
-                    {
-                        duplicate_counter++;
-                        found = true;
-                        break;
-                    }
-                }
-            }
-            if (!found) unique_name = true;
-        }
+    std::string new_name = std::filesystem::path(target_file->name).stem().string() + " (";
+    std::string extension = std::filesystem::path(target_file->name).extension().string();
 
-        if (duplicate_counter > 0)
-        {
-            target_file->name = new_name + std::to_string(duplicate_counter) + ")" + extension;
-            target_file->name_length = target_file->name.length();
-        }
-    }
-}
\ No newline at end of file
+    // numbers below the remembered one were already taken, so they're not checked again
+    uint64_t& duplicate_counter = parent_folder->next_duplicate_number.try_emplace(target_file->name, 1).first->second;
+    while (files_by_name.find(new_name + std::to_string(duplicate_counter) + ")" + extension) != files_by_name.end())
+        duplicate_counter++;
+
+    target_file->name = new_name + std::to_string(duplicate_counter++) + ")" + extension;
+    target_file->name_length = target_file->name.length();
+}
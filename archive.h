@@ -2,7 +2,10 @@
 #define ARCHIVE_H
 
 #include "archive_structures.h"
-#include <unordered_map>
+#include "key_session.h"
+#include "misc/slot_map.h"
+#include "misc/positional_file.h"
+#include "misc/mapped_file.h"
 
 
 class Archive
@@ -10,10 +13,23 @@ class Archive
 public:
     Archive();
     ~Archive();
-    std::unordered_map<int64_t, std::weak_ptr<ArchiveStructure>> jniLookup;
+    // Structures by their lookup_id. Ids are handed to Java, so ids of removed structures have to stop resolving
+    SlotMap<ArchiveStructure> jniLookup;
     // Size of buffer used while reading/writing files
     uint32_t buffer_size = 8 * 1024;
 
+    // Files at least this big are compressed and unpacked with direct I/O, so they don't push everything else out of
+    // page cache. 0 turns it off
+    uint64_t direct_io_threshold = 0;
+
+    // Changed files at least this big are stored by update_from as deltas of their previous versions (when that makes
+    // them at least half smaller), so only what changed takes new space. 0 turns it off
+    uint64_t delta_min_size = 0;
+
+    // Keys derived from passwords so far, so the same password unlocks (and encrypts) any number of files with
+    // PBKDF2 running once per salt. Cleared (and zeroed) when archive is destroyed
+    KeySession keys;
+
     // Extension of created archives
     std::string extension = ".tk2k";
 
@@ -26,52 +42,146 @@ public:
     // Stream for creating/loading archive
     std::fstream archive_file;
 
-    // 0 is forbidden, since it's used as nullptr
-    int64_t currentLookupId = 1;
+    // Same archive, read at explicit offsets, so many threads can read it at once without moving archive_file around.
+    // Everything written through archive_file has to be flushed before it's read through this
+    PositionalFile archive_io;
+
+    // Read-only view of the archive as it was when it was last mapped (see map_archive). Headers and blocks within it
+    // are decoded straight from it, anything past its end is read through archive_io or archive_file instead
+    MappedFile archive_map;
+
+    // Contiguous copy of all headers, written at the end of archive so it can be loaded with a single read
+    TableOfContents toc;
+
+    // Headers read straight from archive_file, for archives without table of contents
+    StreamHeaderSource linked_headers{archive_file};
+
+    // Same headers, decoded from archive_map where it covers them
+    MappedHeaderSource mapped_headers{archive_map, linked_headers};
 
-    // Closes archive_file if open
+    // Where children of not yet loaded folders are parsed from (toc or mapped_headers)
+    HeaderSource* header_source = &linked_headers;
+
+    // Closes archive_file (and archive_io, archive_map) if open
     void close();
 
+    // Maps archive again, so it covers everything written to it so far. Has to be unmapped (archive_map.close())
+    // before archive is cut shorter or replaced, since reading mapped pages past the end of file is fatal
+    void map_archive();
+
     // Saves archive to file
     void save( const std::string& path_to_file, bool& aborting_var );
 
+    // Appends files, which are already in the model, at the end of archive, compressing many of them at once.
+    // Returns false if any of them failed
+    bool append_files(const std::vector<std::shared_ptr<File>>& files, bool& aborting_var,
+                      uint32_t* partialProgress = nullptr, uint32_t* totalProgress = nullptr);
+
+    // Appends folders, which are already in the model (under folders in archive), with everything under them
+    bool append_folders(const std::vector<Folder*>& folders, bool& aborting_var);
+
+    // What update_from did
+    struct UpdateSummary {
+        uint64_t unchanged = 0;                     // files kept as they were, without compressing them again
+        uint64_t compressed = 0;                    // new files, and new versions of changed ones
+        uint64_t removed = 0;                       // old versions of changed files, and structures without source
+    };
+
+    // Makes archive mirror source_directory. Files with the same size and modification time as their entries
+    // (and the same contents as their stored checksums, with verify_checksums) keep their compressed data.
+    // New and changed ones are compressed with flags (changed ones as deltas, see delta_min_size), and entries whose
+    // source is gone are removed, but only after everything new is appended.
+    // Returns false if any file failed or it was aborted, archive is then left as it was
+    bool update_from(const std::filesystem::path& source_directory, uint16_t flags, bool& aborting_var,
+                     bool verify_checksums = false, UpdateSummary* summary = nullptr,
+                     uint32_t* partialProgress = nullptr, uint32_t* totalProgress = nullptr);
+
+    // True if file's entry still matches source, see update_from
+    bool is_unchanged(const File& file, const std::filesystem::directory_entry& source, bool verify_checksum,
+                      bool& aborting_var);
+
+    // Files under folder, in the order Folder::write_to_archive writes them
+    static std::vector<File*> files_in_write_order(Folder& folder);
+
+    // Points files reaching direct_io_threshold at archive_io, so their data goes around page cache
+    void mark_direct_io(const std::vector<File*>& files);
+
     // Loads archive from file
     void load( const std::string& path_to_file );
 
+    // Parses direct children of folder, if they weren't parsed yet, and gives them lookup ids
+    void load_children(const std::shared_ptr<Folder>& folder);
+
+    // Parses everything under folder that wasn't parsed yet
+    void load_subtree(const std::shared_ptr<Folder>& folder);
+
+    // Writes table of contents of the whole model at the end of archive_file, replacing the old one
+    void write_toc();
+
+    // Cuts table of contents off the end of archive_file, so new structures can be appended in its place
+    void detach_toc();
+
     // Creates empty archive, needs to happen before adding files
     void build_empty_archive() const;                       // default archive name
     void build_empty_archive( std::string archive_name );   // custom archive name
 
     void removeArchive();
     void removeArchiveStruct(int64_t lookup_id);
+
+    // Removes structures in place: headers pointing at them are pointed past them, and the space they took is added
+    // to the free space map (kept in table of contents), to be reused by appended files. Only free space at the end
+    // of archive is given back right away, see compact() for the rest.
+    // Model is updated along with the archive, lookup ids of everything else stay valid. Only removed subtrees are
+    // loaded, table of contents (with the free space map) is written again once the whole batch is removed
     void removeMultipleArchiveStructs(std::vector<std::int64_t>& targets);
 
-    // Finds and returns pointer to shared_ptr to file
-    std::shared_ptr<File>* find_file_in_archive(std::weak_ptr<Folder> parent, File* wanted_file );
+    // Releases lookup ids of structure (with everything under it), which was just unlinked, and frees its space
+    void release_removed(ArchiveStructure& structure);
+
+    // Cuts free space off the end of archive, if there's any
+    void trim_free_tail();
+
+    // Moves files from the end of archive into free ranges before them, and cuts the free space it gathers at the end.
+    // Stops after io_budget bytes were copied (0 means no limit), returns true if it did, so there may be more to do.
+    // Folders' headers stay where they are
+    bool compact(uint64_t io_budget = 0);
 
-    // Finds and returns pointer to shared_ptr to folder
-    std::shared_ptr<Folder>* find_folder_in_archive(std::weak_ptr<Folder> parent, Folder* wanted_folder );
+    // Finds file by its path inside archive (starting at root's children, like "folder/file.txt"), nullptr if there's none
+    File* find_file_in_archive(const std::filesystem::path& path_in_archive);
+
+    // Finds folder by its path inside archive, empty path means root, nullptr if there's none
+    Folder* find_folder_in_archive(const std::filesystem::path& path_in_archive);
 
     // Unpacks whole archive to path_to_dir
     void unpack_whole_archive( const std::string& path_to_directory, std::fstream &os, bool& aborting_var );
 
+    // Unpacks folder, with everything under it, into destination. Many files are unpacked at once.
+    // Returns false if any of them failed
+    bool unpack_folder(const std::shared_ptr<Folder>& folder, const std::filesystem::path& destination, bool& aborting_var,
+                       uint32_t* partialProgress = nullptr, uint32_t* totalProgress = nullptr);
+
+    // Unlocks every locked file under folder with pw. Keys of all their salts are derived at once, on all cores,
+    // and kept in keys. Returns number of files unlocked, files pw doesn't match stay locked
+    uint64_t unlock_folder(const std::shared_ptr<Folder>& folder, std::string& pw, bool& aborting_var);
+
     // Adds information about file to archive's model, needs to happen for compression to be possible
     std::shared_ptr<File> add_file_to_archive_model(std::shared_ptr<Folder>& parent_dir, const std::string& path_to_file, const uint16_t &flags );
     File* add_file_to_archive_model(Folder& parent_dir, const std::string& path_to_file, const uint16_t& flags );
 
     // Adds folder to archive's model, and returns pointer to unique pointer to it for future use
-    static std::shared_ptr<Folder>* add_folder_to_model(std::shared_ptr<Folder>& parent_dir, const std::string& folder_name );
+    std::shared_ptr<Folder>* add_folder_to_model(std::shared_ptr<Folder>& parent_dir, const std::string& folder_name );
     Folder* add_folder_to_model(std::weak_ptr<Folder> parent_dir, std::string folder_name);
 
     // Prints whole archive's useful data onto console
-    void recursive_print() const;
+    void recursive_print();
 
     void AssignJniLookupId(const std::shared_ptr<ArchiveStructure>& structure);
+    void ReleaseJniLookupId(ArchiveStructure* structure);
     void recursiveAddFolderToLookup(std::shared_ptr<Folder>& folder_ptr);
     void recursiveAddFileToLookup(std::shared_ptr<File>& file_ptr);
     void correct_duplicate_names(File* target_file, Folder* parent_folder);
 
-    std::string recursive_string() const;
+    std::string recursive_string();
 };
 
 #endif // ARCHIVE_H
@@ -0,0 +1,139 @@
+#include "archive_reader.h"
+
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+
+BlockCache::BlockCache(uint64_t capacity) : max_usage(capacity) {}
+
+
+BlockCache::block_ptr BlockCache::find(uint64_t data_location, uint32_t block) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = by_key.find({ data_location, block });
+    if (it == by_key.end()) {
+        miss_count++;
+        return nullptr;
+    }
+    hit_count++;
+    entries.splice(entries.begin(), entries, it->second);
+    return it->second->second;
+}
+
+
+BlockCache::block_ptr BlockCache::insert(uint64_t data_location, uint32_t block, block_ptr decoded) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    Key key{ data_location, block };
+    auto it = by_key.find(key);
+    if (it != by_key.end()) return it->second->second;
+
+    entries.emplace_front(key, decoded);
+    by_key.emplace(key, entries.begin());
+    used += decoded->size();
+    evict();
+    return decoded;
+}
+
+
+void BlockCache::evict() {
+    // the newest block stays even if it's bigger than the whole cache, it's about to be used
+    while (used > max_usage and entries.size() > 1) {
+        auto& [key, decoded] = entries.back();
+        used -= decoded->size();
+        by_key.erase(key);
+        entries.pop_back();
+    }
+}
+
+
+void BlockCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();
+    by_key.clear();
+    used = 0;
+}
+
+
+uint64_t BlockCache::capacity() const {
+    return max_usage;
+}
+
+
+uint64_t BlockCache::usage() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return used;
+}
+
+
+uint64_t BlockCache::hits() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hit_count;
+}
+
+
+uint64_t BlockCache::misses() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return miss_count;
+}
+
+
+ArchiveReader::ArchiveReader(const std::filesystem::path& archive_path, uint64_t cache_capacity) :
+        cache(cache_capacity),
+        archive_io(archive_path, PositionalFile::access::read)
+{
+    assert(archive_io.is_open());
+}
+
+
+BlockCache::block_ptr ArchiveReader::get_block(File& file, uint32_t block) {
+    BlockCache::block_ptr decoded = cache.find(file.data_location, block);
+    if (decoded) return decoded;
+
+    // blocks are read at their own offsets, so threads don't wait for each other here
+    bool aborting_var = false;
+    Compression comp(aborting_var);
+    if (!file.load_block(archive_io, block, comp) or !file.decode_block(block, comp, aborting_var)) return nullptr;
+
+    decoded = std::make_shared<const std::basic_string<uint8_t>>(comp.text, comp.size);
+    return cache.insert(file.data_location, block, decoded);
+}
+
+
+uint64_t ArchiveReader::pread(File& file, uint64_t offset, uint64_t length, uint8_t* buffer) {
+    if (offset >= file.original_size or length == 0) return 0;
+    if (length > file.original_size - offset) length = file.original_size - offset;
+
+    if (delta::is_delta(file.flags_value)) {
+        std::lock_guard<std::mutex> lock(delta_mutex);
+        bool aborting_var = false;
+        std::shared_ptr<DeltaReader>& reader = deltas[file.data_location];
+        if (!reader) {
+            auto loaded = std::make_shared<DeltaReader>(archive_io, file);
+            if (!loaded->load(aborting_var)) {
+                deltas.erase(file.data_location);
+                return 0;
+            }
+            reader = loaded;
+        }
+        return reader->read(offset, length, buffer, aborting_var);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(index_mutex);
+        if (!file.load_block_index(archive_io)) return 0;
+    }
+
+    uint64_t copied = 0;
+    for (uint32_t block = file.blocks.find(offset); copied < length; ++block) {
+        BlockCache::block_ptr decoded = get_block(file, block);
+        if (!decoded) break;
+
+        uint64_t offset_in_block = offset + copied - file.blocks.blocks[block].original_offset;
+        uint64_t to_copy = std::min<uint64_t>(length - copied, decoded->size() - offset_in_block);
+        std::memcpy(buffer + copied, decoded->data() + offset_in_block, to_copy);
+        copied += to_copy;
+    }
+    return copied;
+}
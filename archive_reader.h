@@ -0,0 +1,85 @@
+#ifndef ARCHIVE_READER_H
+#define ARCHIVE_READER_H
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <filesystem>
+#include <unordered_map>
+
+#include "archive_structures.h"
+#include "delta.h"
+#include "misc/positional_file.h"
+
+
+// Decoded blocks of archived files, least recently used ones are dropped once capacity (in bytes) is exceeded.
+// Safe to use from many threads at once
+class BlockCache {
+public:
+    typedef std::shared_ptr<const std::basic_string<uint8_t>> block_ptr;
+
+    explicit BlockCache(uint64_t capacity);
+
+    // Cached block, or nullptr. Found block becomes the most recently used one
+    block_ptr find(uint64_t data_location, uint32_t block);
+
+    // Caches block, unless another thread already did (then the cached one is returned)
+    block_ptr insert(uint64_t data_location, uint32_t block, block_ptr decoded);
+
+    void clear();
+
+    uint64_t capacity() const;
+    uint64_t usage();
+    uint64_t hits();
+    uint64_t misses();
+
+private:
+    // blocks are told apart by their file's data_location, which is unique within the archive
+    struct Key {
+        uint64_t data_location;
+        uint32_t block;
+        bool operator==(const Key& other) const { return data_location == other.data_location and block == other.block; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const { return std::hash<uint64_t>()(key.data_location * 0x9E3779B97F4A7C15ull ^ key.block); }
+    };
+    typedef std::list<std::pair<Key, block_ptr>> lru_list;
+
+    std::mutex mutex;
+    lru_list entries;                               // most recently used first
+    std::unordered_map<Key, lru_list::iterator, KeyHash> by_key;
+    const uint64_t max_usage;
+    uint64_t used = 0;
+    uint64_t hit_count = 0;
+    uint64_t miss_count = 0;
+
+    void evict();
+};
+
+
+// Reads parts of archived files straight into memory, decoding only the blocks that hold them.
+// Reads through its own PositionalFile, so it doesn't move Archive's archive_file around, and can be used from
+// many threads at once, even while files are being appended to the archive
+class ArchiveReader {
+public:
+    static const uint64_t default_cache_capacity = 64ull << 20;    // 64 MiB
+
+    explicit ArchiveReader(const std::filesystem::path& archive_path, uint64_t cache_capacity = default_cache_capacity);
+
+    // Copies up to length bytes of file's contents, starting at offset, into buffer.
+    // Returns number of bytes copied, which is less than length only at the end of file, or if the archive is broken
+    uint64_t pread(File& file, uint64_t offset, uint64_t length, uint8_t* buffer);
+
+    BlockCache cache;
+
+private:
+    std::mutex index_mutex;                         // guards index loading of files read through this
+    PositionalFile archive_io;
+    std::mutex delta_mutex;                         // files stored as delta are read one at a time
+    std::unordered_map<uint64_t, std::shared_ptr<DeltaReader>> deltas;  // by data_location, loaded once
+
+    // Decoded block, from cache if possible
+    BlockCache::block_ptr get_block(File& file, uint32_t block);
+};
+
+#endif // ARCHIVE_READER_H
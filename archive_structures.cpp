@@ -1,11 +1,18 @@
 #include "archive_structures.h"
 
 #include <iostream>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
 #include <bitset>
 
 
 #include "misc/multithreading.h"
+#include "compression_pipeline.h"
+#include "metadata_transaction.h"
 #include "cryptography.h"
+#include "delta.h"
+#include "key_session.h"
 
 File::File()
 : ArchiveStructure(""){}
@@ -26,15 +33,49 @@ bool File::process_the_file(std::fstream &archive_stream,
                             bool& aborting_var,
                             bool validate_integrity,
                             uint32_t* partialProgress,
-                            uint32_t* totalProgress)
+                            uint32_t* totalProgress,
+                            const PositionalFile* archive_io,
+                            const MappedFile* archive_map)
 {
     assert(archive_stream.is_open());
 
     bool successful = false;
     std::bitset<16> flags_bin(this->flags_value);
 
-    if (encode)
+    // file may have been compressed ahead, by CompressionPipeline
+    std::shared_ptr<EncodedFile> encoded = nullptr;
+    if (encode and this->compression_job) {
+        encoded = this->compression_job->take();
+        this->compression_job = nullptr;
+    }
+
+    if (encode and this->pending_delta)
+    {
+        // delta's checksum is the one of the new version, which is only read from the source file
+        std::string checksum = multithreading::file_checksum(this->path, flags_value, aborting_var);
+        successful = delta::write(archive_stream, pending_delta->base, pending_delta->stream, flags_value, checksum,
+                                  this->compressed_size, aborting_var);
+        this->pending_delta = nullptr;
+        this->blocks = BlockIndex();
+        if (totalProgress != nullptr) (*totalProgress)++;
+    }
+    else if (encoded and encoded->successful)
+    {
+        archive_stream.write(encoded->data.data(), encoded->data.size());
+        this->compressed_size = encoded->compressed_size;
+        this->blocks = encoded->blocks;
+        successful = (bool)archive_stream;
+        if (totalProgress != nullptr) (*totalProgress)++;
+    }
+    else if (encode and this->encrypted and (this->key.empty() or this->encryption_metadata.empty()))
+    {
+        successful = false;     // prepare_for_encryption wasn't called
+    }
+    else if (encode)
     {
+        // encryption metadata goes first, blocks are located after it
+        if (this->encrypted) archive_stream.write((char*)encryption_metadata.data(), encryption_metadata.size());
+        uint8_t* block_key = this->encrypted ? this->key.data() : nullptr;
 
         successful = multithreading::processing_foreman(
                 archive_stream,
@@ -46,11 +87,37 @@ bool File::process_the_file(std::fstream &archive_stream,
                 aborting_var,
                 validate_integrity,
                 partialProgress,
-                totalProgress);
+                totalProgress,
+                &this->blocks,
+                &block_key,
+                this->encrypted ? this->encryption_metadata.data() : nullptr,
+                this->encryption_metadata.size(),
+                this->direct_io_archive,
+                nullptr,
+                this->direct_io_archive != nullptr);
+
+        if (this->encrypted) {
+            this->compressed_size += encryption_metadata.size();
+            for (auto& block : this->blocks.blocks) block.location += encryption_metadata.size();
+        }
+    }
+    else if (delta::is_delta(flags_value))
+    {
+        DeltaReader reader = archive_io != nullptr ? DeltaReader(*archive_io, *this) : DeltaReader(archive_stream, *this);
+        successful = reader.load(aborting_var) and
+                     reader.unpack(path_to_destination + '/' + this->name, validate_integrity, aborting_var);
+        if (totalProgress != nullptr) (*totalProgress)++;
+    }
+    else if (this->locked)
+    {
+        successful = false;
     }
     else
     {
-        archive_stream.seekg(this->data_location);
+        // without index, blocks are read one after another, starting right after encryption metadata
+        if (!load_block_index(archive_stream)) archive_stream.seekg(this->data_location + BlockIndex::blocks_start(flags_value));
+        else archive_stream.seekg(this->data_location);
+        uint8_t* block_key = this->encrypted ? this->key.data() : nullptr;
             successful = multithreading::processing_foreman(
                     archive_stream,
                     path_to_destination + '/' + this->name,
@@ -61,12 +128,96 @@ bool File::process_the_file(std::fstream &archive_stream,
                     aborting_var,
                     validate_integrity,
                     partialProgress,
-                    totalProgress);
+                    totalProgress,
+                    &this->blocks,
+                    &block_key,
+                    this->encrypted ? this->encryption_metadata.data() : nullptr,
+                    this->encryption_metadata.size(),
+                    archive_io,
+                    archive_map,
+                    this->direct_io_archive != nullptr);
     }
     return successful;
 }
 
 
+bool File::load_block_index(std::fstream& archive_stream) {
+    if (!blocks.empty()) return true;
+    if (data_location == 0) return false;   // not in archive yet
+    return blocks.scan(archive_stream, data_location, compressed_size, flags_value, original_size);
+}
+
+
+bool File::load_block_index(const PositionalFile& archive_io) {
+    if (!blocks.empty()) return true;
+    if (data_location == 0) return false;   // not in archive yet
+    return blocks.scan(archive_io, data_location, compressed_size, flags_value, original_size);
+}
+
+
+bool File::load_block(std::fstream& archive_stream, uint32_t block, Compression& comp) {
+    if (!load_block_index(archive_stream) or block >= blocks.blocks.size()) return false;
+
+    archive_stream.seekg(data_location + blocks.blocks[block].location);
+    comp.part_id = block;
+    comp.load_text(archive_stream, blocks.blocks[block].stored_size);
+    if (!archive_stream) {
+        archive_stream.clear();
+        return false;
+    }
+    return true;
+}
+
+
+bool File::load_block(const PositionalFile& archive_io, uint32_t block, Compression& comp,
+                      const MappedFile* archive_map) const {
+    if (block >= blocks.blocks.size()) return false;
+
+    comp.part_id = block;
+    uint64_t block_location = data_location + blocks.blocks[block].location;
+    if (archive_map != nullptr and archive_map->contains(block_location, blocks.blocks[block].stored_size)) {
+        comp.borrow_text(archive_map->data() + block_location, blocks.blocks[block].stored_size);
+        return true;
+    }
+    return comp.load_text(archive_io, block_location, blocks.blocks[block].stored_size);
+}
+
+
+bool File::decode_block(uint32_t block, Compression& comp, bool& aborting_var) const {
+    if (locked) return false;
+    bool finished = false;
+    uint8_t* block_key = encrypted ? const_cast<uint8_t*>(key.data()) : nullptr;   // it's only read
+    uint8_t* metadata = encrypted ? const_cast<uint8_t*>(encryption_metadata.data()) : nullptr;
+    uint32_t metadata_size = encryption_metadata.size();
+    multithreading::processing_worker(multithreading::mode::decompress, &comp, flags_value, aborting_var,
+                                      &finished, block_key, metadata, metadata_size);
+    return !aborting_var and !comp.rejected and comp.size == blocks.original_block_size(block, original_size);
+}
+
+
+uint64_t File::read(std::fstream& archive_stream, uint64_t offset, uint64_t length, uint8_t* buffer, bool& aborting_var) {
+    if (offset >= original_size or length == 0) return 0;
+    if (length > original_size - offset) length = original_size - offset;
+    if (delta::is_delta(flags_value)) {
+        DeltaReader reader(archive_stream, *this);
+        return reader.load(aborting_var) ? reader.read(offset, length, buffer, aborting_var) : 0;
+    }
+    if (!load_block_index(archive_stream)) return 0;
+
+    uint64_t copied = 0;
+    for (uint32_t block = blocks.find(offset); copied < length; ++block) {
+        Compression comp(aborting_var);
+        if (!load_block(archive_stream, block, comp) or !decode_block(block, comp, aborting_var)) break;
+
+        uint64_t offset_in_block = offset + copied - blocks.blocks[block].original_offset;
+        uint64_t to_copy = std::min<uint64_t>(length - copied, comp.size - offset_in_block);
+        std::memcpy(buffer + copied, comp.text + offset_in_block, to_copy);
+        copied += to_copy;
+    }
+    return copied;
+}
+
+
 void File::recursive_print(std::ostream &os) const {
     os << *this << '\n';
     if (sibling_ptr) sibling_ptr->recursive_print( os );
@@ -89,63 +240,40 @@ std::ostream& operator<<(std::ostream &os, const File &f)
 }
 
 
-void File::parse(std::fstream &os, uint64_t pos, std::shared_ptr<Folder>& parent) {
-    uint8_t buffer[8];
-    os.seekg(pos);
+uint64_t File::parse(HeaderSource& source, uint64_t pos, std::shared_ptr<Folder>& parent) {
+    HeaderRecord header;
+    source.read(pos, HeaderRecord::kind::file, header);
 
     this->alreadySaved = true;
     this->location = pos;
-    this->name_length = (uint8_t)os.get();
-
-    this->name = std::string(name_length, ' '); // initialising space-filled name_length-long string
-    os.read( &this->name[0], name_length );
-
+    this->name = header.name;
+    this->name_length = header.name.length();
+    this->header_name_length = this->name_length;
 
-    // Getting location of parent folder in the archive
-    os.read( (char*)buffer, 8 );
-    uint64_t parent_location_test = ((uint64_t)buffer[0]) | ((uint64_t)buffer[1]<<8u) | ((uint64_t)buffer[2]<<16u) | ((uint64_t)buffer[3]<<24u) | ((uint64_t)buffer[4]<<32u) | ((uint64_t)buffer[5]<<40u) | ((uint64_t)buffer[6]<<48u) | ((uint64_t)buffer[7]<<56u);
+    if (header.parent_location != 0) this->parent_ptr = parent;
 
-
-    if (parent_location_test !=0) this->parent_ptr = parent;
-
-
-    // Getting location of sibling file in the archive
-    os.read( (char*)buffer, 8 );
-    uint64_t sibling_location_pos = ((uint64_t)buffer[0]) | ((uint64_t)buffer[1]<<8u) | ((uint64_t)buffer[2]<<16u) | ((uint64_t)buffer[3]<<24u) | ((uint64_t)buffer[4]<<32u) | ((uint64_t)buffer[5]<<40u) | ((uint64_t)buffer[6]<<48u) | ((uint64_t)buffer[7]<<56u);
-
-
-    // Getting flags for this file from the archive
-    os.read( (char*)buffer, 2 );
-    this->flags_value = ((uint64_t)buffer[0]) | ((uint64_t)buffer[1]<<8u);
+    this->flags_value = header.flags_value;
 
     std::bitset<16> bin_flags(flags_value);
     if (bin_flags[6]) { // checking if the file is encrypted
         this->encrypted = true;
+        this->encryption = AES_128;
         this->locked = true;
     }
 
+    this->data_location = header.data_location;
+    this->compressed_size = header.compressed_size;
+    this->original_size = header.original_size;
 
-    // Getting location of compressed data for this file from the archive
-    os.read( (char*)buffer, 8 );
-    this->data_location = ((uint64_t)buffer[0]) | ((uint64_t)buffer[1]<<8u) | ((uint64_t)buffer[2]<<16u) | ((uint64_t)buffer[3]<<24u) | ((uint64_t)buffer[4]<<32u) | ((uint64_t)buffer[5]<<40u) | ((uint64_t)buffer[6]<<48u) | ((uint64_t)buffer[7]<<56u);
-
-
-    // Getting size of compressed data of this file from the archive (in   B I T S)
-    os.read( (char*)buffer, 8 );
-    this->compressed_size = ((uint64_t)buffer[0]) | ((uint64_t)buffer[1]<<8u) | ((uint64_t)buffer[2]<<16u) | ((uint64_t)buffer[3]<<24u) | ((uint64_t)buffer[4]<<32u) | ((uint64_t)buffer[5]<<40u) | ((uint64_t)buffer[6]<<48u) | ((uint64_t)buffer[7]<<56u);
+    // table of contents may know where the blocks are, otherwise they're found when they're needed
+    std::string_view block_index = record_extension::find(header.extension, record_extension::tag::block_index);
+    if (block_index.empty() or !this->blocks.decode(block_index, flags_value, original_size)) this->blocks = BlockIndex();
 
+    // only table of contents keeps it, it's used to tell whether the source file changed since
+    std::string_view modified = record_extension::find(header.extension, record_extension::tag::modification_time);
+    this->modification_time = modified.size() == 8 ? (int64_t)little_endian::load((const uint8_t*)modified.data(), 8) : 0;
 
-    // Getting size of uncompressed data of this file from the archive
-    os.read((char*)buffer, 8);
-    this->original_size = ((uint64_t)buffer[0]) | ((uint64_t)buffer[1]<<8u) | ((uint64_t)buffer[2]<<16u) | ((uint64_t)buffer[3]<<24u) | ((uint64_t)buffer[4]<<32u) | ((uint64_t)buffer[5]<<40u) | ((uint64_t)buffer[6]<<48u) | ((uint64_t)buffer[7]<<56u);
-
-
-    if (sibling_location_pos != 0) {  // if there's another file in this dir, parse it too
-        this->sibling_ptr = std::make_shared<File>();
-        uint64_t backup_g = os.tellg();
-        this->sibling_ptr->parse(os, sibling_location_pos, parent);
-        os.seekg(backup_g);
-    }
+    return header.sibling_location;
 }
 
 
@@ -153,8 +281,12 @@ bool File::write_to_archive(std::fstream &archive_file,
                             bool& aborting_var,
                             bool write_siblings,
                             uint32_t* partialProgress,
-                            uint32_t* totalProgress)
+                            uint32_t* totalProgress,
+                            MetadataTransaction* transaction)
 {
+    MetadataTransaction own_transaction;
+    if (transaction == nullptr) transaction = &own_transaction;
+
     bool successful = false;
     if (!this->alreadySaved and !aborting_var) {
         this->alreadySaved = true;
@@ -164,46 +296,19 @@ bool File::write_to_archive(std::fstream &archive_file,
         {
             std::shared_ptr<Folder> locked_parent = parent_ptr.lock();
             if (locked_parent->child_file_ptr.get() == this) {
-
-                uint64_t backup_p = archive_file.tellp();
-
-                archive_file.seekp(locked_parent->location + 1 + locked_parent->name_length + 24); // seekp( start of child_file_location in archive file )
-                auto buffer = new uint8_t[8];
-
-                for (uint8_t i=0; i < 8; i++)
-                    buffer[i] = (location >> (i*8u)) & 0xFFu;
-
-                archive_file.write((char*)buffer, 8);
-                delete[] buffer;
-
-                archive_file.seekp(backup_p);
-
+                // start of parent's child_file_location
+                transaction->patch(locked_parent->header_field(24), location, 8);
             }
             else {
-                File* file_ptr = locked_parent->child_file_ptr.get(); // location of previous file in the same dir
-                while( file_ptr->sibling_ptr != nullptr )
-                {
-                    if (this != file_ptr->sibling_ptr.get())
-                        file_ptr = file_ptr->sibling_ptr.get();
-                    else
-                        break;
-                }
-
-
-                uint64_t backup_p = archive_file.tellp();
-                archive_file.seekp( file_ptr->location + 1 + file_ptr->name_length + 8 ); // seekp( start of sibling_location in archive file )
-                auto buffer = new uint8_t[8];
-
-                for (uint8_t i=0; i < 8; i++)
-                    buffer[i] = ( location >> (i*8u)) & 0xFFu;
-
-                archive_file.write((char*)buffer, 8);
-                delete[] buffer;
-                archive_file.seekp( backup_p );
+                File* file_ptr = previous_sibling_ptr;  // previous file in the same dir
+                assert(file_ptr != nullptr and file_ptr->sibling_ptr.get() == this);
+                // start of previous file's sibling_location
+                transaction->patch(file_ptr->header_field(8), location, 8);
             }
         }
 
         name_length = name.length();
+        header_name_length = name_length;
         uint32_t buffer_size = base_metadata_size + name_length;
         auto buffer = new uint8_t[buffer_size];
         uint32_t bi=0; //buffer index
@@ -235,6 +340,8 @@ bool File::write_to_archive(std::fstream &archive_file,
             buffer[bi+i] = ((unsigned)flags_value >> (i * 8u)) & 0xFFu;
         bi+=2;
 
+        data_location = location + buffer_size;     // data goes right after the header
+
         for (uint8_t i=0; i < 8; i++)
             buffer[bi+i] = (data_location >> (i * 8u)) & 0xFFu;
         bi+=8;
@@ -249,13 +356,9 @@ bool File::write_to_archive(std::fstream &archive_file,
 
         assert( bi == buffer_size );
         archive_file.write((char*)buffer, buffer_size);
-        archive_file.flush();
         delete[] buffer;
 
-
-        auto backup_end_of_metadata = archive_file.tellp(); // position in file right after the end of metadata
-
-        data_location = backup_end_of_metadata;
+        assert( (uint64_t)archive_file.tellp() == data_location );
 
         // encoding
         successful = process_the_file(archive_file,
@@ -266,27 +369,16 @@ bool File::write_to_archive(std::fstream &archive_file,
                                       partialProgress,
                                       totalProgress);
 
-        auto backup_p = archive_file.tellp();
-
-        archive_file.seekp( data_location - 24 );
-
-        auto buffer2 = new uint8_t[16];
-
-        for (uint8_t i=0; i < 8; i++)
-            buffer2[i] = (data_location >> (i*8u)) & 0xFFu;
-        for (uint8_t i=0; i < 8; i++)
-            buffer2[i+8] = (compressed_size >> (i*8u)) & 0xFFu;
-
-        assert(archive_file.is_open());
-        archive_file.write((char*)buffer2, 16);
-        delete[] buffer2;
-
-        archive_file.seekp( backup_p );
+        // compressed_size is known only now, it's right before original_size
+        transaction->patch(data_location - 16, compressed_size, 8);
     }
 
     if (sibling_ptr and write_siblings and !aborting_var) {
-        sibling_ptr->write_to_archive(archive_file, aborting_var, write_siblings, partialProgress, totalProgress);
+        sibling_ptr->write_to_archive(archive_file, aborting_var, write_siblings, partialProgress, totalProgress, transaction);
     }
+
+    if (transaction == &own_transaction and !own_transaction.empty() and !own_transaction.commit(archive_file))
+        successful = false;
     return successful;
 }
 
@@ -309,6 +401,42 @@ bool File::unpack(const std::string& path_to_destination, std::fstream &os, bool
 }
 
 
+bool File::unpack_serial(const PositionalFile& archive_io,
+                         const std::filesystem::path& destination_folder,
+                         bool& aborting_var,
+                         bool validate_integrity,
+                         const MappedFile* archive_map)
+{
+    if (delta::is_delta(flags_value)) {
+        DeltaReader reader(archive_io, *this);
+        return reader.load(aborting_var) and reader.unpack(destination_folder / this->name, validate_integrity, aborting_var);
+    }
+    if (!load_block_index(archive_io)) return false;
+
+    std::fstream output(destination_folder / this->name, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    if (!output.is_open()) return false;
+
+    for (uint32_t block=0; block < blocks.blocks.size(); ++block) {
+        if (aborting_var) return false;
+
+        Compression comp(aborting_var);
+        if (!load_block(archive_io, block, comp, archive_map) or !decode_block(block, comp, aborting_var)) return false;
+        output.write((char*)comp.text, comp.size);
+    }
+
+    uint8_t checksum_length = multithreading::checksum_length(flags_value);
+    if (!validate_integrity or checksum_length == 0) return true;
+
+    std::string checksum(checksum_length, 0x00);
+    // checksum is right after the last block
+    if (archive_io.read_at(checksum.data(), checksum_length, data_location + blocks.end()) != checksum_length)
+        return false;
+
+    output.flush();
+    return multithreading::stream_checksum(output, flags_value, original_size, aborting_var) == checksum;
+}
+
+
 std::string File::get_compressed_filesize_str(bool scaled) {
     std::string units[5] = {"B","KB","MB","GB","TB"};
 
@@ -390,10 +518,11 @@ bool File::append_to_archive(
         bool& aborting_var,
         bool write_siblings,
         uint32_t* partialProgress,
-        uint32_t* totalProgress)
+        uint32_t* totalProgress,
+        MetadataTransaction* transaction)
 {
     archive_file.seekp(0, std::ios_base::end);
-    return this->write_to_archive( archive_file, aborting_var, write_siblings, partialProgress, totalProgress);
+    return this->write_to_archive( archive_file, aborting_var, write_siblings, partialProgress, totalProgress, transaction);
 }
 
 
@@ -414,131 +543,232 @@ void File::set_path( std::filesystem::path extraction_path, bool set_all_paths )
 }
 
 
-void File::copy_to_another_archive( std::fstream& src, std::fstream& dst, uint64_t parent_location, uint64_t previous_sibling_location, uint16_t previous_name_length )
-{
-    if (!this->ptr_already_gotten) {    // if ptr_already_gotten, don't copy this
+bool File::is_locked() const {
+    return locked;
+}
 
-        assert(parent_location != 0);
 
-        dst.seekp(0, std::ios_base::end);
-        uint64_t dst_location = dst.tellp();
+bool File::is_encrypted() const {
+    return encrypted;
+}
 
-        src.seekg(this->location);
 
-        if (previous_sibling_location == 0)
-        {
-            dst.seekp( parent_location + 1 + parent_ptr.lock()->name_length + 24 ); // seekp( start of child_file_location in archive file )
-            dst.write((char*)&dst_location, 8);
+void File::prepare_for_encryption(std::string& pw, bool& aborting_var, encryption_types cipher, KeySession* session) {
+    assert(!this->alreadySaved);
+    assert(cipher == AES_128 or cipher == ChaCha20_Poly1305);
+    // key and salt come straight from the OS, iv (which isn't secret) from a generator it seeds
+    std::random_device device;
+    std::seed_seq seed = { device(), device(), device(), device() };
+    std::mt19937 gen(seed);
+
+    KeySession::Params params{};
+    uint8_t random_key[crypto::AES128::key_size];
+    if (session != nullptr) params = session->encryption_params();
+    else {
+        for (auto& byte : params.salt) byte = device() & 0xFF;
+        params.iterations = (uint32_t)crypto::PBKDF2::iteration_count::medium;
+    }
+    for (auto& byte : random_key) byte = device() & 0xFF;
+
+    uint8_t pwkey[KeySession::key_size] = {};
+    bool derived_pwkey;
+    if (session != nullptr) derived_pwkey = session->derive(pw, params, pwkey, aborting_var);
+    else {
+        std::string derived = crypto::PBKDF2::HMAC_SHA256(pw, params.salt.data(), params.salt.size(),
+                                                          params.iterations, sizeof(pwkey), aborting_var);
+        std::copy(derived.begin(), derived.end(), pwkey);
+        std::fill(derived.begin(), derived.end(), 0);
+        derived_pwkey = !aborting_var;
+    }
+    if (!derived_pwkey) {   // file stays unencrypted, rather than locked with a key of zeros
+        std::fill(std::begin(pwkey), std::end(pwkey), 0);
+        std::fill(std::begin(random_key), std::end(random_key), 0);
+        return;
+    }
 
-        }
-        else
-        {
-            assert(previous_name_length != 0 and previous_name_length < 256);
-            dst.seekp( previous_sibling_location + 1 + previous_name_length + 8 ); // seekp( start of sibling_location in archive file )
-            dst.write((char*)&dst_location, 8);
-        }
+    uint8_t* metadata = nullptr;
+    uint32_t metadata_size = 0;
+    crypto::AES128::generate_metadata(pwkey, sizeof(pwkey), params.salt.data(), params.salt.size(), params.iterations,
+                                      random_key, sizeof(random_key), metadata, metadata_size, gen, aborting_var,
+                                      (crypto::cipher)cipher);
+    this->encryption_metadata.assign(metadata, metadata_size);
+    if (cipher == ChaCha20_Poly1305) {
+        this->key.assign(crypto::ChaCha20Poly1305::key_size, 0x00);
+        crypto::ChaCha20Poly1305::derive_key(random_key, sizeof(random_key), this->key.data(), aborting_var);
+    }
+    else this->key.assign(random_key, sizeof(random_key));
+    delete[] metadata;
+    std::fill(std::begin(pwkey), std::end(pwkey), 0);
+    std::fill(std::begin(random_key), std::end(random_key), 0);
+    if (aborting_var) {     // metadata's MAC (or ChaCha20's key) may be missing
+        this->encryption_metadata.clear();
+        std::fill(this->key.begin(), this->key.end(), 0);
+        this->key.clear();
+        return;
+    }
 
-        dst.seekp(0, std::ios_base::end);
+    this->encrypted = true;
+    this->encryption = cipher;
+    this->locked = false;
+    this->flags_value |= 1u << 6;
+}
 
-        uint32_t buffer_size = base_metadata_size+name_length;
-        auto buffer = new uint8_t[buffer_size];
-        uint32_t bi=0; //buffer index
 
-        // (name length)
-        buffer[bi] = name_length;
-        bi++;
+bool File::unlock(std::string& pw, std::fstream& archive_stream, bool& aborting_var, KeySession* session) {
+    if (!this->locked) return true;
 
-        // (file name)
-        for (uint16_t i=0; i < name_length; i++)
-            buffer[bi+i] = name[i];
-        bi += name_length;
+    // metadata is at the start of file's data
+    std::basic_string<uint8_t> metadata(crypto::AES128::metadata_size, 0x00);
+    archive_stream.seekg(this->data_location);
+    archive_stream.read((char*)metadata.data(), metadata.size());
+    if (!archive_stream) {
+        archive_stream.clear();
+        return false;
+    }
 
-        // (parent_ptr)
-        for (uint8_t i = 0; i < 8; i++)
-            buffer[bi + i] = (parent_location >> (i * 8u)) & 0xFFu;
-        bi += 8;
+    KeySession::Params params{};
+    std::copy(metadata.begin(), metadata.begin() + params.salt.size(), params.salt.begin());
+    params.iterations = crypto::AES128::iterations_of(metadata.data(), metadata.size());
 
-        // (sibling_ptr)
-        for (uint8_t i = 0; i < 8; i++)
-            buffer[bi + i] = 0;
-        bi+=8;
+    uint8_t pwkey[KeySession::key_size];
+    if (session != nullptr) {
+        if (!session->derive(pw, params, pwkey, aborting_var)) return false;
+    }
+    else {
+        std::string derived = crypto::PBKDF2::HMAC_SHA256(pw, params.salt.data(), params.salt.size(),
+                                                          params.iterations, sizeof(pwkey), aborting_var);
+        if (aborting_var) return false;
+        std::copy(derived.begin(), derived.end(), pwkey);
+        std::fill(derived.begin(), derived.end(), 0);
+    }
 
-        // (flags)
-        for (uint8_t i=0; i < 2; i++)
-            buffer[bi+i] = ((unsigned)flags_value >> (i * 8u)) & 0xFFu;
-        bi+=2;
+    bool unlocked = unlock(metadata, pwkey, aborting_var);
+    std::fill(std::begin(pwkey), std::end(pwkey), 0);
+    return unlocked;
+}
 
-        // (location of data)
-        for (uint8_t i=0; i < 8; i++)
-            buffer[bi+i] = ( (dst_location - this->location + this->data_location) >> (i * 8u)) & 0xFFu;    // potentially broken
-        bi+=8;
 
-        // (compressed size)
-        for (uint8_t i=0; i < 8; i++)
-            buffer[bi+i] = (compressed_size >> (i * 8u)) & 0xFFu;
-        bi+=8;
+bool File::unlock(const std::basic_string<uint8_t>& metadata, const uint8_t pwkey[], bool& aborting_var) {
+    if (!this->locked) return true;
 
-        // (original size)
-        for (uint8_t i=0; i < 8; i++)
-            buffer[bi+i] = (original_size >> (i * 8u)) & 0xFFu;
-        bi+=8;
+    std::basic_string<uint8_t> random_key(crypto::AES128::key_size, 0x00);
+    bool matches = crypto::AES128::extract_random_key(const_cast<uint8_t*>(pwkey), KeySession::key_size,
+                                                      const_cast<uint8_t*>(metadata.data()), metadata.size(),
+                                                      random_key.data(), aborting_var);
+    if (!matches) return false;
 
+    // cipher is only known once metadata is read, till then it's assumed to be AES_128
+    this->encryption = crypto::AES128::cipher_of(metadata.data(), metadata.size());
+    if (this->encryption == ChaCha20_Poly1305) {
+        this->key.assign(crypto::ChaCha20Poly1305::key_size, 0x00);
+        crypto::ChaCha20Poly1305::derive_key(random_key.data(), random_key.size(), this->key.data(), aborting_var);
+    }
+    else this->key = random_key;
+    std::fill(random_key.begin(), random_key.end(), 0);
+    this->encryption_metadata = metadata;
+    this->locked = false;
+    return true;
+}
 
-        assert( bi == buffer_size );
-        dst.write((char*)buffer, buffer_size);
-        delete[] buffer;
 
-        assert( dst.tellp() == dst_location - this->location + this->data_location );
+// Folder methods below
 
-        assert(this->data_location != 0);
-        src.seekg(this->data_location);
+Folder::Folder() : ArchiveStructure("") {}
 
-        // copying encoded data + checksum
 
-        uint64_t total_data_size = this->compressed_size;
-        if ((this->flags_value & (1<<15))>>15) // if it's got SHA-1 appended
-        {
-            total_data_size += 40;  // length of SHA-1 in my file (bytes)
-        }
-        else if ((this->flags_value & (1<<14))>>14) // if it's got CRC-32 appended
-        {
-            total_data_size += 10;  // length of CRC-32 in my file (bytes)
-        }
+Folder::Folder(std::shared_ptr<Folder>& parent, std::string folder_name ) :
+    ArchiveStructure(std::move(folder_name), folder_name.length(), parent) {}
 
-        uint32_t output_buffer_size = 4*8*1024;
-        auto output_buffer = new uint8_t[output_buffer_size];
+Folder::Folder(std::weak_ptr<Folder> parent, std::string folder_name ) :
+        ArchiveStructure(std::move(folder_name), folder_name.length(), parent) {}
 
-        while ( total_data_size > output_buffer_size )
-        {
-            src.read( (char*)output_buffer, output_buffer_size );
-            total_data_size -= output_buffer_size;
-            dst.write( (char*)output_buffer, output_buffer_size );
-        }
 
-        src.read( (char*)output_buffer, total_data_size );
-        dst.write( (char*)output_buffer, total_data_size );
+Folder::~Folder() {
+    clear_children();
+}
 
-        delete[] output_buffer;
 
+std::shared_ptr<Folder>& Folder::append_child(std::shared_ptr<Folder> child) {
+    std::shared_ptr<Folder>& slot = last_child_dir ? last_child_dir->sibling_ptr : child_dir_ptr;
+    assert(slot == nullptr);
 
-        if (sibling_ptr) sibling_ptr->copy_to_another_archive(src, dst, parent_location, dst_location, this->name_length);
-    }
-    else if (sibling_ptr){
-        assert(previous_sibling_location < UINT32_MAX);
-        sibling_ptr->copy_to_another_archive(src, dst, parent_location, previous_sibling_location, previous_name_length);
+    slot = std::move(child);
+    slot->previous_sibling_ptr = last_child_dir;
+    last_child_dir = slot.get();
+    child_dirs_by_name.emplace(slot->name, slot.get());
+    return slot;
+}
+
+
+std::shared_ptr<File>& Folder::append_child(std::shared_ptr<File> child) {
+    std::shared_ptr<File>& slot = last_child_file ? last_child_file->sibling_ptr : child_file_ptr;
+    assert(slot == nullptr);
+
+    slot = std::move(child);
+    slot->previous_sibling_ptr = last_child_file;
+    last_child_file = slot.get();
+    child_files_by_name.emplace(slot->name, slot.get());
+    return slot;
+}
+
+
+namespace {
+    // Same for subfolders and files, they're linked the same way
+    template <typename T>
+    std::shared_ptr<T> unlink_child(T* child, std::shared_ptr<T>& first_child, T*& last_child,
+                                    std::unordered_map<std::string_view, T*>& by_name) {
+        std::shared_ptr<T>& slot = child->previous_sibling_ptr ? child->previous_sibling_ptr->sibling_ptr : first_child;
+        assert(slot.get() == child);
+
+        std::shared_ptr<T> removed = std::move(slot);
+        slot = std::move(removed->sibling_ptr);
+        if (slot) slot->previous_sibling_ptr = removed->previous_sibling_ptr;
+        if (last_child == child) last_child = removed->previous_sibling_ptr;
+        removed->previous_sibling_ptr = nullptr;
+
+        // name may repeat, index keeps the first one of them
+        auto it = by_name.find(removed->name);
+        if (it != by_name.end() and it->second == child) {
+            by_name.erase(it);
+            for (T* other = first_child.get(); other != nullptr; other = other->sibling_ptr.get()) {
+                if (other->name != removed->name) continue;
+                by_name.emplace(other->name, other);
+                break;
+            }
+        }
+        return removed;
     }
 }
 
-// Folder methods below
 
-Folder::Folder() : ArchiveStructure("") {}
+std::shared_ptr<Folder> Folder::remove_child(Folder* child) {
+    return unlink_child(child, child_dir_ptr, last_child_dir, child_dirs_by_name);
+}
 
 
-Folder::Folder(std::shared_ptr<Folder>& parent, std::string folder_name ) :
-    ArchiveStructure(std::move(folder_name), folder_name.length(), parent) {}
+std::shared_ptr<File> Folder::remove_child(File* child) {
+    return unlink_child(child, child_file_ptr, last_child_file, child_files_by_name);
+}
 
-Folder::Folder(std::weak_ptr<Folder> parent, std::string folder_name ) :
-        ArchiveStructure(std::move(folder_name), folder_name.length(), parent) {}
+
+void Folder::clear_children() {
+    child_dirs_by_name.clear();
+    child_files_by_name.clear();
+    next_duplicate_number.clear();
+    last_child_dir = nullptr;
+    last_child_file = nullptr;
+
+    // chains are released one link at a time, destroying a long chain recursively could overflow the stack
+    while (child_file_ptr and child_file_ptr.use_count() == 1)
+        child_file_ptr = std::move(child_file_ptr->sibling_ptr);
+    while (child_dir_ptr and child_dir_ptr.use_count() == 1)
+        child_dir_ptr = std::move(child_dir_ptr->sibling_ptr);
+    // whatever is still shared elsewhere outlives the links released above
+    if (child_file_ptr) child_file_ptr->previous_sibling_ptr = nullptr;
+    if (child_dir_ptr) child_dir_ptr->previous_sibling_ptr = nullptr;
+    child_file_ptr = nullptr;
+    child_dir_ptr = nullptr;
+}
 
 void Folder::recursive_print(std::ostream &os) const {
     os << *this << '\n';
@@ -565,68 +795,58 @@ std::ostream& operator<<(std::ostream& os, const Folder& f){
 }
 
 
-void Folder::parse(std::fstream &os, uint64_t pos, std::weak_ptr<Folder>& parent, std::shared_ptr<Folder>& shared_this)
+uint64_t Folder::parse(HeaderSource& source, uint64_t pos, std::weak_ptr<Folder>& parent)
 {
-    uint8_t buffer[8];
-    os.seekg( pos );
+    HeaderRecord header;
+    source.read(pos, HeaderRecord::kind::folder, header);
 
     this->alreadySaved = true;
     this->location = pos;
-    this->name_length = (uint8_t)os.get();
+    this->name = header.name;
+    this->name_length = header.name.length();
+    this->header_name_length = this->name_length;
 
-    this->name = std::string(name_length, ' '); // initialising empty string name_length-long
-    os.read( &this->name[0], name_length );
+    if (header.parent_location != 0) this->parent_ptr = parent;
 
-    os.read( (char*)buffer, 8 );
-    uint64_t parent_pos_in_file = ((uint64_t)buffer[0]) | ((uint64_t)buffer[1]<<8u) | ((uint64_t)buffer[2]<<16u) | ((uint64_t)buffer[3]<<24u) | ((uint64_t)buffer[4]<<32u) | ((uint64_t)buffer[5]<<40u) | ((uint64_t)buffer[6]<<48u) | ((uint64_t)buffer[7]<<56u);
+    clear_children();
+    this->child_dir_location = header.child_dir_location;
+    this->child_file_location = header.child_file_location;
+    this->children_loaded = (child_dir_location == 0 and child_file_location == 0);
 
-    if (parent_pos_in_file !=0) this->parent_ptr = parent;
-
-
-    os.read( (char*)buffer, 8 );
-    uint64_t child_dir_pos_in_file = ((uint64_t)buffer[0]) | ((uint64_t)buffer[1]<<8u) | ((uint64_t)buffer[2]<<16u) | ((uint64_t)buffer[3]<<24u) | ((uint64_t)buffer[4]<<32u) | ((uint64_t)buffer[5]<<40u) | ((uint64_t)buffer[6]<<48u) | ((uint64_t)buffer[7]<<56u);
+    return header.sibling_location;
+}
 
 
+void Folder::load_children(HeaderSource& source, std::shared_ptr<Folder>& shared_this)
+{
+    if (children_loaded) return;
+    std::weak_ptr<Folder> weak_this(shared_this);
 
-    if (child_dir_pos_in_file !=0) {
-        this->child_dir_ptr = std::make_shared<Folder>();
-        uint64_t backup_g = os.tellg();
-        std::weak_ptr<Folder> weak_this(shared_this);
-        this->child_dir_ptr->parse(os, child_dir_pos_in_file, weak_this, child_dir_ptr );
-        os.seekg( backup_g );
+    for (uint64_t pos = child_dir_location; pos != 0; ) {
+        auto child = std::make_shared<Folder>();
+        pos = child->parse(source, pos, weak_this);
+        append_child(std::move(child));
     }
 
-
-    os.read( (char*)buffer, 8 );
-    uint64_t sibling_pos_in_file = ((uint64_t)buffer[0]) | ((uint64_t)buffer[1]<<8u) | ((uint64_t)buffer[2]<<16u) | ((uint64_t)buffer[3]<<24u) | ((uint64_t)buffer[4]<<32u) | ((uint64_t)buffer[5]<<40u) | ((uint64_t)buffer[6]<<48u) | ((uint64_t)buffer[7]<<56u);
-
-    if (sibling_pos_in_file != 0) {
-        this->sibling_ptr = std::make_shared<Folder>();
-        uint64_t backup_g = os.tellg();
-        this->sibling_ptr->parse(os, sibling_pos_in_file, parent, sibling_ptr);
-        os.seekg( backup_g );
+    for (uint64_t pos = child_file_location; pos != 0; ) {
+        auto file = std::make_shared<File>();
+        pos = file->parse(source, pos, shared_this);
+        append_child(std::move(file));
     }
 
-
-    os.read( (char*)buffer, 8 );
-    uint64_t child_file_pos_in_file = ((uint64_t)buffer[0]) | ((uint64_t)buffer[1]<<8u) | ((uint64_t)buffer[2]<<16u) | ((uint64_t)buffer[3]<<24u) | ((uint64_t)buffer[4]<<32u) | ((uint64_t)buffer[5]<<40u) | ((uint64_t)buffer[6]<<48u) | ((uint64_t)buffer[7]<<56u);
-
-    if (child_file_pos_in_file != 0) {
-        this->child_file_ptr = std::make_shared<File>();
-        uint64_t backup_g = os.tellg();
-        this->child_file_ptr->parse(os, child_file_pos_in_file, shared_this);
-        os.seekg( backup_g );
-    }
+    children_loaded = true;
 }
 
 
-void Folder::append_to_archive( std::fstream& archive_file, bool& aborting_var ) {
+void Folder::append_to_archive( std::fstream& archive_file, bool& aborting_var, MetadataTransaction* transaction ) {
     archive_file.seekp(0, std::ios_base::end);
-    this->write_to_archive( archive_file, aborting_var );
+    this->write_to_archive( archive_file, aborting_var, transaction );
 }
 
 
-void Folder::write_to_archive( std::fstream &archive_file, bool& aborting_var ) {
+void Folder::write_to_archive( std::fstream &archive_file, bool& aborting_var, MetadataTransaction* transaction ) {
+    MetadataTransaction own_transaction;
+    if (transaction == nullptr) transaction = &own_transaction;
 
     if (!this->alreadySaved) {
         this->alreadySaved = true;
@@ -635,45 +855,19 @@ void Folder::write_to_archive( std::fstream &archive_file, bool& aborting_var )
         if (not is_uninitialized(parent_ptr)) { // correcting current dir's location in model, and in file
             std::shared_ptr<Folder> locked_parent = parent_ptr.lock();
             if ( locked_parent->child_dir_ptr.get() == this ) {
-                // updating parent's knowledge of it's firstborn's location in file
-                uint64_t backup_p = archive_file.tellp();
-
-                archive_file.seekp( locked_parent->location + 1 + locked_parent->name_length + 8 ); // seekp( start of child_dir_location in archive file )
-                auto buffer = new uint8_t[8];
-
-                for (uint8_t i=0; i < 8; i++)
-                    buffer[i] = ( location >> (i*8u)) & 0xFFu;
-
-                archive_file.write((char*)buffer, 8);
-                delete[] buffer;
-
-                archive_file.seekp( backup_p );
+                // updating parent's knowledge of it's firstborn's location in file (start of child_dir_location)
+                transaction->patch(locked_parent->header_field(8), location, 8);
             }
             else {
-                Folder* previous_folder = locked_parent->child_dir_ptr.get();
-                while( previous_folder->sibling_ptr != nullptr )
-                {
-                    if (this != previous_folder->sibling_ptr.get())
-                        previous_folder = previous_folder->sibling_ptr.get();
-                    else
-                        break;
-                }
-
-                uint64_t backup_p = archive_file.tellp();
-                archive_file.seekp( previous_folder->location + 1 + previous_folder->name_length + 16 ); // seekp( start of sibling_location in archive file )
-                auto buffer = new uint8_t[8];
-
-                for (uint8_t i=0; i < 8; i++)
-                    buffer[i] = ( location >> (i*8u)) & 0xFFu;
-
-                archive_file.write((char*)buffer, 8);
-                delete[] buffer;
-
-                archive_file.seekp( backup_p );
+                Folder* previous_folder = previous_sibling_ptr;
+                assert(previous_folder != nullptr and previous_folder->sibling_ptr.get() == this);
+                // start of previous folder's sibling_location
+                transaction->patch(previous_folder->header_field(16), location, 8);
             }
         }
 
         name_length = name.length();
+        header_name_length = name_length;
         uint32_t buffer_size = base_metadata_size+name_length;
         auto buffer = new uint8_t[buffer_size];
         uint32_t bi=0; //buffer index
@@ -725,14 +919,16 @@ void Folder::write_to_archive( std::fstream &archive_file, bool& aborting_var )
     }
 
     if (sibling_ptr)
-        sibling_ptr->write_to_archive( archive_file, aborting_var );
+        sibling_ptr->write_to_archive( archive_file, aborting_var, transaction );
 
     if (child_file_ptr)
-        child_file_ptr->write_to_archive( archive_file, aborting_var );
+        child_file_ptr->write_to_archive( archive_file, aborting_var, true, nullptr, nullptr, transaction );
 
     if (child_dir_ptr)
-        child_dir_ptr->write_to_archive( archive_file, aborting_var );
+        child_dir_ptr->write_to_archive( archive_file, aborting_var, transaction );
 
+    if (transaction == &own_transaction and !own_transaction.empty())
+        own_transaction.commit(archive_file);
 }
 
 
@@ -788,108 +984,3 @@ void Folder::set_path( std::filesystem::path extraction_path, bool set_all_paths
     if (this->child_dir_ptr.get()  != nullptr and set_all_paths) this->child_dir_ptr->set_path( folder_path, set_all_paths );
     if (this->child_file_ptr.get() != nullptr and set_all_paths) this->child_file_ptr->set_path( folder_path, set_all_paths );
 }
-
-
-void Folder::copy_to_another_archive( std::fstream& src, std::fstream& dst, uint64_t parent_location, uint64_t previous_sibling_location )
-{
-    if (!this->ptr_already_gotten) {    // if ptr_already_gotten, don't copy this
-        src.seekg(this->location);
-        uint64_t dst_location = dst.tellp();
-
-        if (parent_location != 0)
-        {
-            auto locked_parent = parent_ptr.lock();
-            if ( locked_parent->child_dir_ptr.get() == this ) {
-                assert(previous_sibling_location == 0);
-
-                // update parent's knowledge of it's firstborn's location in file
-
-                uint64_t backup_p = dst.tellp();
-
-                dst.seekp( parent_location + 1 + locked_parent->name_length + 8 ); // seekp( start of child_dir_location in the new archive )
-                auto buffer = new uint8_t[8];
-
-                for (uint8_t i=0; i < 8; i++)
-                    buffer[i] = ( dst_location >> (i*8u)) & 0xFFu;
-
-                dst.write((char*)buffer, 8);
-                delete[] buffer;
-
-                dst.seekp( backup_p );
-            }
-            else {
-                assert(previous_sibling_location != 0);
-                // update previous sibling's knowledge of it's next sibling's location
-                Folder* previous_folder = locked_parent->child_dir_ptr.get();
-                while( previous_folder->sibling_ptr != nullptr )
-                {
-                    if (this != previous_folder->sibling_ptr.get())
-                        previous_folder = previous_folder->sibling_ptr.get();
-                    else
-                        break;
-                }
-
-                uint64_t backup_p = dst.tellp();
-                dst.seekp( previous_sibling_location + 1 + previous_folder->name_length + 16 ); // seekp( start of sibling_location in archive file )
-                auto buffer = new uint8_t[8];
-
-                for (uint8_t i=0; i < 8; i++)
-                    buffer[i] = ( dst_location >> (i*8u)) & 0xFFu;
-
-                dst.write((char*)buffer, 8);
-                delete[] buffer;
-
-                dst.seekp( backup_p );
-            }
-        }
-
-        dst.seekp(0, std::ios_base::end);
-
-        uint32_t buffer_size = base_metadata_size+name_length;
-        auto buffer = new uint8_t[buffer_size];
-        uint32_t bi=0; //buffer index
-
-        // (name length)
-        buffer[bi] = this->name_length;
-        bi++;
-
-        // (file name)
-        for (uint16_t i=0; i < name_length; i++)
-            buffer[bi+i] = name[i];
-        bi += name_length;
-
-        // (parent location)
-        for (uint8_t i = 0; i < 8; i++)
-            buffer[bi + i] = (parent_location >> (i * 8u)) & 0xFFu;
-        bi += 8;
-
-        // (child_dir_ptr)
-        for (uint8_t i = 0; i < 8; i++)
-            buffer[bi + i] = 0;
-        bi+=8;
-
-        // (sibling_ptr) {
-        for (uint8_t i = 0; i < 8; i++)
-            buffer[bi + i] = 0;
-        bi += 8;
-
-
-        // (child_file_ptr)
-        for (uint8_t i=0; i < 8; i++)
-            buffer[bi+i] = 0;
-        bi += 8;
-
-        assert( bi == buffer_size );
-
-        dst.write((char*)buffer, buffer_size);
-        delete[] buffer;
-
-        if (sibling_ptr) sibling_ptr->copy_to_another_archive(src, dst, parent_location, dst_location);
-        if (child_file_ptr) child_file_ptr->copy_to_another_archive(src, dst, dst_location, 0, 0);
-        if (child_dir_ptr) child_dir_ptr->copy_to_another_archive(src, dst, dst_location, 0);
-    }
-    else
-    {
-        if (sibling_ptr) sibling_ptr->copy_to_another_archive(src, dst, parent_location, previous_sibling_location);
-    }
-}
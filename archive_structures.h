@@ -6,9 +6,15 @@
 #include <filesystem>
 #include <thread>
 #include <vector>
+#include <memory>
+#include <string_view>
+#include <unordered_map>
 
 #include "compression.h"
 #include "integrity_validation.h"
+#include "block_index.h"
+#include "table_of_contents.h"
+#include "misc/mapped_file.h"
 #include "misc/project_exceptions.h"
 
 template <typename T>
@@ -26,6 +32,8 @@ public:
     std::weak_ptr<Folder> parent_ptr{};                   // ptr to parent folder in memory
     uint64_t location=0;                            // absolute location of this file in archive (starts at name_length)
     uint8_t name_length=0;                          // length of file name (in bytes)
+    uint8_t header_name_length=0;                   // length of name in its header in archive, which stays as it was
+                                                    // when name changes in memory (root's does, on Archive::load)
     bool ptr_already_gotten = false;                // true - method get_ptrs was already used on it, so it's in the vector
     bool alreadySaved = false;                      // true - Object has already been saved to archive, false - it's only in the model
     int64_t lookup_id = 0;                          // id in Archive's lookup table, for easier navigation from JNI
@@ -49,35 +57,69 @@ public:
             lookup_id(lookup_id) {}
 
             virtual ~ArchiveStructure(){};
+
+    // Location of the field which is offset bytes past the name, in this structure's header in archive
+    uint64_t header_field(uint8_t offset) const { return location + 1 + header_name_length + offset; }
 };
 
 struct File;
+struct CompressionJob;
+struct PendingDelta;
+class MetadataTransaction;
+class KeySession;
 
-struct Folder : ArchiveStructure
+struct Folder : ArchiveStructure, std::enable_shared_from_this<Folder>
 {
 public:
     static const uint8_t base_metadata_size = 33;   // base metadata size (excluding name_size) (in bytes)
     std::shared_ptr<Folder> child_dir_ptr=nullptr;  // ptr to first subfolder in memory
     std::shared_ptr<Folder> sibling_ptr=nullptr;    // ptr to next sibling folder in memory
+    Folder* previous_sibling_ptr = nullptr;         // previous sibling folder in memory, kept by append_child
     std::shared_ptr<File> child_file_ptr=nullptr;   // ptr to first file in memory
 
+    bool children_loaded = true;                    // false - folder was parsed, but its children are still only in the archive
+    uint64_t child_dir_location = 0;                // location of first subfolder in archive, used until children are loaded
+    uint64_t child_file_location = 0;               // location of first file in archive, used until children are loaded
+
+    Folder* last_child_dir = nullptr;               // last subfolder in memory, so new ones are appended without walking the chain
+    File* last_child_file = nullptr;                // last file in memory, same as above
+    std::unordered_map<std::string_view, Folder*> child_dirs_by_name;  // direct subfolders by name (first one, if names repeat)
+    std::unordered_map<std::string_view, File*> child_files_by_name;   // direct files by name
+    std::unordered_map<std::string, uint64_t> next_duplicate_number;   // next "name (k)" worth trying, by original file name
+
     Folder();
     Folder(std::shared_ptr<Folder>& parent, std::string folder_name);
     Folder(std::weak_ptr<Folder> parent, std::string folder_name);
+    ~Folder();
+
+    // Links child at the end of subfolders (or files), and adds it to the name index. Child's name must be final
+    std::shared_ptr<Folder>& append_child(std::shared_ptr<Folder> child);
+    std::shared_ptr<File>& append_child(std::shared_ptr<File> child);
+
+    // Unlinks child from subfolders (or files), and from the name index. Returns the child, so it can outlive this
+    std::shared_ptr<Folder> remove_child(Folder* child);
+    std::shared_ptr<File> remove_child(File* child);
+
+    // Forgets all children in memory
+    void clear_children();
 
     void recursive_print(std::ostream &os) const;
 
     friend std::ostream& operator<<(std::ostream& os, const Folder& f);
 
-    void parse(std::fstream &os, uint64_t pos, std::weak_ptr<Folder>& parent, std::shared_ptr<Folder>& shared_this);
+    // Parses only this folder's header, returns location of its next sibling (0 if there's none)
+    uint64_t parse(HeaderSource& source, uint64_t pos, std::weak_ptr<Folder>& parent);
 
-    void append_to_archive( std::fstream& archive_file, bool& aborting_var );
+    // Parses direct children of this folder, if they haven't been parsed yet
+    void load_children(HeaderSource& source, std::shared_ptr<Folder>& shared_this);
 
-    void write_to_archive( std::fstream& archive_file, bool& aborting_var );
+    void append_to_archive( std::fstream& archive_file, bool& aborting_var, MetadataTransaction* transaction = nullptr );
 
-    void unpack( const std::filesystem::path& target_path, std::fstream &os, bool& aborting_var, bool unpack_all ) const;
+    // Headers pointing at the ones being written are patched through transaction. Without one,
+    // a transaction of its own is committed before returning
+    void write_to_archive( std::fstream& archive_file, bool& aborting_var, MetadataTransaction* transaction = nullptr );
 
-    void copy_to_another_archive( std::fstream& source, std::fstream& destination, uint64_t parent_location, uint64_t previous_sibling_location );
+    void unpack( const std::filesystem::path& target_path, std::fstream &os, bool& aborting_var, bool unpack_all ) const;
 
     void get_ptrs( std::vector<Folder*>& folders, std::vector<File*>& files );
 
@@ -98,46 +140,79 @@ private:
 
 
 public:
-    enum encryption_types {None, AES_128};          // enum for int encryption
+    enum encryption_types {None, AES_128, ChaCha20_Poly1305};   // enum for int encryption, same values as crypto::cipher
     static const uint8_t base_metadata_size = 43;   // base metadata size (excluding name_size) (in bytes)
     bool alreadyExtracted = false;                  // true - file has already been extracted
 
 
     std::shared_ptr<File> sibling_ptr=nullptr;      // ptr to next sibling file in memory
+    File* previous_sibling_ptr = nullptr;           // previous sibling file in memory, kept by Folder::append_child
 
     uint16_t flags_value=0;                         // 16 flags represented as 16-bit int
 
     uint64_t data_location=0;                       // location of data in archive (in bytes)
     uint64_t compressed_size=0;                     // size of compressed data (in bytes)
     uint64_t original_size=0;                       // size of data before compression (in bytes)
+    BlockIndex blocks;                              // where blocks of compressed data are, empty until it's known
+    int64_t modification_time = 0;                  // of the source file when it was added (ns since epoch), 0 if unknown
+    std::shared_ptr<CompressionJob> compression_job;    // set if file is being compressed ahead of writing, see CompressionPipeline
+    const PositionalFile* direct_io_archive = nullptr;  // set if file's data skips page cache, see Archive::direct_io_threshold
+    std::shared_ptr<PendingDelta> pending_delta;    // set if file is going to be written as delta of its previous version
+    bool is_delta_base = false;                     // data is kept after removal, a delta of the next version points at it
     File();
     ~File();
 
+    // When decoding, blocks are taken from archive_map, or read ahead through archive_io (if they're given),
+    // instead of archive_stream. With direct_io_archive set, file's data goes around page cache either way
     bool process_the_file(std::fstream &archive_stream,
                           const std::string& path_to_destination,
                           bool decode,
                           bool& aborting_var,
                           bool validate_integrity = true,
                           uint32_t* partialProgress = nullptr,
-                          uint32_t* totalProgress  = nullptr);
+                          uint32_t* totalProgress  = nullptr,
+                          const PositionalFile* archive_io = nullptr,
+                          const MappedFile* archive_map = nullptr);
+
+    // Makes sure blocks are known, scanning block headers in archive if table of contents didn't have them
+    bool load_block_index(std::fstream& archive_stream);
+    bool load_block_index(const PositionalFile& archive_io);
+
+    // Reads a single (still encoded) block of file's data into comp.
+    // Through a PositionalFile, many threads can load blocks at once, as long as the index is already loaded.
+    // Blocks which archive_map covers aren't read at all, comp borrows them from the mapping
+    bool load_block(std::fstream& archive_stream, uint32_t block, Compression& comp);
+    bool load_block(const PositionalFile& archive_io, uint32_t block, Compression& comp,
+                    const MappedFile* archive_map = nullptr) const;
+
+    // Decodes block loaded into comp by load_block, doesn't touch the archive
+    bool decode_block(uint32_t block, Compression& comp, bool& aborting_var) const;
+
+    // Copies up to length bytes of file's contents, starting at offset, into buffer.
+    // Only blocks which hold them are decoded. Returns number of bytes copied
+    uint64_t read(std::fstream& archive_stream, uint64_t offset, uint64_t length, uint8_t* buffer, bool& aborting_var);
 
     void recursive_print(std::ostream &os) const;
 
     friend std::ostream& operator<<(std::ostream &os, const File &f);
 
-    void parse(std::fstream &os, uint64_t pos, std::shared_ptr<Folder>& parent);
+    // Parses only this file's header, returns location of its next sibling (0 if there's none)
+    uint64_t parse(HeaderSource& source, uint64_t pos, std::shared_ptr<Folder>& parent);
 
     bool append_to_archive(std::fstream& archive_file,
                            bool& aborting_var,
                            bool write_siblings = true,
                            uint32_t* partialProgress = nullptr,
-                           uint32_t* totalProgress  = nullptr);
+                           uint32_t* totalProgress  = nullptr,
+                           MetadataTransaction* transaction = nullptr);
 
+    // Same as Folder::write_to_archive, headers pointing at this one are patched through transaction
     bool write_to_archive(std::fstream& archive_file,
                           bool& aborting_var,
                           bool write_siblings = true,
                           uint32_t* partialProgress = nullptr,
-                          uint32_t* totalProgress  = nullptr);
+                          uint32_t* totalProgress  = nullptr,
+                          MetadataTransaction* transaction = nullptr);
 
     bool unpack(const std::string& path,
                 std::fstream &os,
@@ -148,12 +223,18 @@ public:
                 uint32_t* totalProgress  = nullptr);
     // returns bool which indicates whether decompression was successful
 
+    // Unpacks only this file into destination_folder, decoding its blocks one after another on the calling thread.
+    // Meant for many small files unpacked at once, where threads of processing_foreman would only get in the way
+    bool unpack_serial(const PositionalFile& archive_io,
+                       const std::filesystem::path& destination_folder,
+                       bool& aborting_var,
+                       bool validate_integrity = true,
+                       const MappedFile* archive_map = nullptr);
+
     std::string get_compressed_filesize_str(bool scaled);
 
     std::string get_uncompressed_filesize_str(bool scaled);
 
-    void copy_to_another_archive(std::fstream& source, std::fstream& destination, uint64_t parent_location, uint64_t previous_sibling_location, uint16_t previous_name_length);
-
     void get_ptrs(std::vector<File*>& files, bool get_siblings_too = false);
 
     void set_path(std::filesystem::path extraction_path, bool set_all_paths);
@@ -162,9 +243,18 @@ public:
 
     bool is_encrypted() const;
 
-    void prepare_for_encryption(std::string& pw, bool& aborting_var);
+    // Makes file (which isn't in archive yet) get encrypted with a random key, which is stored in encryption metadata,
+    // encrypted with key derived from pw. With ChaCha20_Poly1305 every block is authenticated too.
+    // Files encrypted with the same session share pw's key, so it's derived only once. If deriving it is aborted,
+    // file is left as it was
+    void prepare_for_encryption(std::string& pw, bool& aborting_var, encryption_types cipher = AES_128,
+                                KeySession* session = nullptr);
+
+    // true = unlocked. With session, pw's key is derived only if session doesn't have it yet
+    bool unlock(std::string& pw, std::fstream& archive_stream, bool& aborting_var, KeySession* session = nullptr);
 
-    bool unlock(std::string& pw, std::fstream& archive_stream, bool& aborting_var);    // true = unlocked
+    // Unlocks file with its metadata (as it's in archive), and key already derived from password (see KeySession)
+    bool unlock(const std::basic_string<uint8_t>& metadata, const uint8_t pwkey[], bool& aborting_var);
 };
 
 #endif //EXPERIMENTAL_ARCHIVE_STRUCTURES_H
@@ -0,0 +1,491 @@
+#include "blake3.h"
+
+#include <array>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+
+namespace blake3 {
+
+    namespace {
+        const uint32_t IV[8] = { 0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19 };
+
+        // flags of compressed blocks
+        const uint32_t chunk_start = 1, chunk_end = 2, parent = 4, root = 8;
+
+        // Message words of every round, permuted from the previous one's
+        const uint8_t schedule[7][16] = {
+                { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+                { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+                { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+                { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+                { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+                { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+                { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 } };
+
+        uint32_t load_little_endian32(const uint8_t buffer[]) {
+            return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+        }
+
+        void store_little_endian32(uint8_t buffer[], uint32_t value) {
+            for (uint32_t i=0; i < 4; ++i) buffer[i] = (value >> (i * 8u)) & 0xFFu;
+        }
+
+        void load_words(const uint8_t block[], uint32_t words[]) {
+            for (uint32_t i=0; i < 16; ++i) words[i] = load_little_endian32(block + 4*i);
+        }
+
+// Every kernel defines ADD, XOR and ROTATE (right) for whatever its words are
+#define BLAKE3_G(a, b, c, d, x, y) \
+        a = ADD(ADD(a, b), x); d = ROTATE(XOR(d, a), 16); \
+        c = ADD(c, d); b = ROTATE(XOR(b, c), 12); \
+        a = ADD(ADD(a, b), y); d = ROTATE(XOR(d, a), 8); \
+        c = ADD(c, d); b = ROTATE(XOR(b, c), 7);
+
+#define BLAKE3_ROUND(v, m, s) \
+        BLAKE3_G(v[0], v[4], v[8], v[12], m[s[0]], m[s[1]]) \
+        BLAKE3_G(v[1], v[5], v[9], v[13], m[s[2]], m[s[3]]) \
+        BLAKE3_G(v[2], v[6], v[10], v[14], m[s[4]], m[s[5]]) \
+        BLAKE3_G(v[3], v[7], v[11], v[15], m[s[6]], m[s[7]]) \
+        BLAKE3_G(v[0], v[5], v[10], v[15], m[s[8]], m[s[9]]) \
+        BLAKE3_G(v[1], v[6], v[11], v[12], m[s[10]], m[s[11]]) \
+        BLAKE3_G(v[2], v[7], v[8], v[13], m[s[12]], m[s[13]]) \
+        BLAKE3_G(v[3], v[4], v[9], v[14], m[s[14]], m[s[15]])
+
+#define ADD(a, b) ((a) + (b))
+#define XOR(a, b) ((a) ^ (b))
+#define ROTATE(v, n) (((v) >> (n)) | ((v) << (32 - (n))))
+        // All 16 words of state after 7 rounds, the first 8 of them are the chaining value
+        void compress(const uint32_t cv[], const uint32_t block_words[], uint64_t counter, uint32_t block_length,
+                      uint32_t flags, uint32_t state[]) {
+            uint32_t v[16] = { cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+                               IV[0], IV[1], IV[2], IV[3],
+                               (uint32_t)counter, (uint32_t)(counter >> 32), block_length, flags };
+            for (const auto& s : schedule) { BLAKE3_ROUND(v, block_words, s) }
+            for (uint32_t i=0; i < 8; ++i) {
+                state[i] = v[i] ^ v[i + 8];
+                state[i + 8] = v[i + 8] ^ cv[i];
+            }
+        }
+#undef ADD
+#undef XOR
+#undef ROTATE
+
+        void chunk_cv_portable(const uint8_t chunk[], uint64_t counter, uint32_t cv[]) {
+            uint32_t words[16];
+            uint32_t state[16];
+            std::memcpy(cv, IV, sizeof(IV));
+            for (uint32_t block=0; block < chunk_size / 64; ++block) {
+                uint32_t flags = (block == 0 ? chunk_start : 0) | (block == chunk_size / 64 - 1 ? chunk_end : 0);
+                load_words(chunk + 64*block, words);
+                compress(cv, words, counter, 64, flags, state);
+                std::memcpy(cv, state, 8 * sizeof(uint32_t));
+            }
+        }
+
+        Output parent_output(const uint32_t left_cv[], const uint32_t right_cv[]) {
+            Output output{};
+            std::memcpy(output.input_cv, IV, sizeof(IV));
+            std::memcpy(output.block_words, left_cv, 8 * sizeof(uint32_t));
+            std::memcpy(output.block_words + 8, right_cv, 8 * sizeof(uint32_t));
+            output.counter = 0;
+            output.block_length = 64;
+            output.flags = parent;
+            return output;
+        }
+
+        // Kernels below hash as many whole groups of chunks as there are, starting at counter, and return number of
+        // chunks they did. Words are kept across chunks: lane i of every vector belongs to chunk i
+
+#if defined(__x86_64__) || defined(__i386__)
+        __attribute__((target("sse2"), always_inline))
+        inline void transpose_sse2(__m128i v[]) {
+            __m128i low01 = _mm_unpacklo_epi32(v[0], v[1]);
+            __m128i low23 = _mm_unpacklo_epi32(v[2], v[3]);
+            __m128i high01 = _mm_unpackhi_epi32(v[0], v[1]);
+            __m128i high23 = _mm_unpackhi_epi32(v[2], v[3]);
+            v[0] = _mm_unpacklo_epi64(low01, low23);
+            v[1] = _mm_unpackhi_epi64(low01, low23);
+            v[2] = _mm_unpacklo_epi64(high01, high23);
+            v[3] = _mm_unpackhi_epi64(high01, high23);
+        }
+
+        // 16 bytes of 4 chunks, at offset, as 4 words across them
+        __attribute__((target("sse2"), always_inline))
+        inline void load_transposed_sse2(const uint8_t input[], uint64_t offset, __m128i words[]) {
+            for (uint32_t lane=0; lane < 4; ++lane)
+                words[lane] = _mm_loadu_si128((const __m128i*)(input + lane * chunk_size + offset));
+            transpose_sse2(words);
+        }
+
+        template <int n> __attribute__((target("sse2"), always_inline))
+        inline __m128i rotate_sse2(__m128i v) {
+            if constexpr (n == 16) return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+            else return _mm_or_si128(_mm_srli_epi32(v, n), _mm_slli_epi32(v, 32 - n));
+        }
+
+#define ADD(a, b) _mm_add_epi32(a, b)
+#define XOR(a, b) _mm_xor_si128(a, b)
+#define ROTATE(v, n) rotate_sse2<n>(v)
+        __attribute__((target("sse2")))
+        uint64_t hash_chunks_sse2(const uint8_t input[], uint64_t chunks, uint64_t counter, uint32_t cvs[][8]) {
+            uint64_t done = 0;
+            for (; chunks - done >= 4; done += 4) {
+                const uint8_t* group = input + done * chunk_size;
+                uint64_t first = counter + done;
+                const __m128i counter_low = _mm_set_epi32((int)(uint32_t)(first + 3), (int)(uint32_t)(first + 2),
+                                                          (int)(uint32_t)(first + 1), (int)(uint32_t)first);
+                const __m128i counter_high = _mm_set_epi32((int)((first + 3) >> 32), (int)((first + 2) >> 32),
+                                                           (int)((first + 1) >> 32), (int)(first >> 32));
+                __m128i h[8];
+                for (uint32_t i=0; i < 8; ++i) h[i] = _mm_set1_epi32((int)IV[i]);
+
+                for (uint32_t block=0; block < chunk_size / 64; ++block) {
+                    __m128i m[16];
+                    for (uint32_t quarter=0; quarter < 4; ++quarter)
+                        load_transposed_sse2(group, 64*block + 16*quarter, m + 4*quarter);
+
+                    uint32_t flags = (block == 0 ? chunk_start : 0) | (block == chunk_size / 64 - 1 ? chunk_end : 0);
+                    __m128i v[16] = { h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+                                      _mm_set1_epi32((int)IV[0]), _mm_set1_epi32((int)IV[1]),
+                                      _mm_set1_epi32((int)IV[2]), _mm_set1_epi32((int)IV[3]),
+                                      counter_low, counter_high, _mm_set1_epi32(64), _mm_set1_epi32((int)flags) };
+                    for (const auto& s : schedule) { BLAKE3_ROUND(v, m, s) }
+                    for (uint32_t i=0; i < 8; ++i) h[i] = _mm_xor_si128(v[i], v[i + 8]);
+                }
+
+                // transposed back, words 0-3 of every chunk, then 4-7
+                transpose_sse2(h);
+                transpose_sse2(h + 4);
+                for (uint32_t lane=0; lane < 4; ++lane) {
+                    _mm_storeu_si128((__m128i*)cvs[done + lane], h[lane]);
+                    _mm_storeu_si128((__m128i*)(cvs[done + lane] + 4), h[4 + lane]);
+                }
+            }
+            return done;
+        }
+#undef ADD
+#undef XOR
+#undef ROTATE
+
+        template <int n> __attribute__((target("avx2"), always_inline))
+        inline __m256i rotate_avx2(__m256i v) {
+            if constexpr (n == 16) {
+                const __m256i bytes = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                                      13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+                return _mm256_shuffle_epi8(v, bytes);
+            }
+            else if constexpr (n == 8) {
+                const __m256i bytes = _mm256_set_epi8(12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1,
+                                                      12, 15, 14, 13, 8, 11, 10, 9, 4, 7, 6, 5, 0, 3, 2, 1);
+                return _mm256_shuffle_epi8(v, bytes);
+            }
+            else return _mm256_or_si256(_mm256_srli_epi32(v, n), _mm256_slli_epi32(v, 32 - n));
+        }
+
+#define ADD(a, b) _mm256_add_epi32(a, b)
+#define XOR(a, b) _mm256_xor_si256(a, b)
+#define ROTATE(v, n) rotate_avx2<n>(v)
+        __attribute__((target("avx2")))
+        uint64_t hash_chunks_avx2(const uint8_t input[], uint64_t chunks, uint64_t counter, uint32_t cvs[][8]) {
+            uint64_t done = 0;
+            for (; chunks - done >= 8; done += 8) {
+                const uint8_t* group = input + done * chunk_size;
+                uint32_t low[8];
+                uint32_t high[8];
+                for (uint32_t lane=0; lane < 8; ++lane) {
+                    low[lane] = (uint32_t)(counter + done + lane);
+                    high[lane] = (uint32_t)((counter + done + lane) >> 32);
+                }
+                const __m256i counter_low = _mm256_loadu_si256((const __m256i*)low);
+                const __m256i counter_high = _mm256_loadu_si256((const __m256i*)high);
+                __m256i h[8];
+                for (uint32_t i=0; i < 8; ++i) h[i] = _mm256_set1_epi32((int)IV[i]);
+
+                for (uint32_t block=0; block < chunk_size / 64; ++block) {
+                    // chunks 0-3 go into lower halves, 4-7 into upper ones
+                    __m256i m[16];
+                    for (uint32_t quarter=0; quarter < 4; ++quarter) {
+                        __m128i lower[4];
+                        __m128i upper[4];
+                        load_transposed_sse2(group, 64*block + 16*quarter, lower);
+                        load_transposed_sse2(group + 4 * chunk_size, 64*block + 16*quarter, upper);
+                        for (uint32_t i=0; i < 4; ++i)
+                            m[4*quarter + i] = _mm256_inserti128_si256(_mm256_castsi128_si256(lower[i]), upper[i], 1);
+                    }
+
+                    uint32_t flags = (block == 0 ? chunk_start : 0) | (block == chunk_size / 64 - 1 ? chunk_end : 0);
+                    __m256i v[16] = { h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+                                      _mm256_set1_epi32((int)IV[0]), _mm256_set1_epi32((int)IV[1]),
+                                      _mm256_set1_epi32((int)IV[2]), _mm256_set1_epi32((int)IV[3]),
+                                      counter_low, counter_high, _mm256_set1_epi32(64), _mm256_set1_epi32((int)flags) };
+                    for (const auto& s : schedule) { BLAKE3_ROUND(v, m, s) }
+                    for (uint32_t i=0; i < 8; ++i) h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+                }
+
+                for (uint32_t half=0; half < 2; ++half) {
+                    __m128i words[8];
+                    for (uint32_t i=0; i < 8; ++i)
+                        words[i] = half == 0 ? _mm256_castsi256_si128(h[i]) : _mm256_extracti128_si256(h[i], 1);
+                    transpose_sse2(words);
+                    transpose_sse2(words + 4);
+                    for (uint32_t lane=0; lane < 4; ++lane) {
+                        _mm_storeu_si128((__m128i*)cvs[done + 4*half + lane], words[lane]);
+                        _mm_storeu_si128((__m128i*)(cvs[done + 4*half + lane] + 4), words[4 + lane]);
+                    }
+                }
+            }
+            return done;
+        }
+#undef ADD
+#undef XOR
+#undef ROTATE
+
+        uint64_t hash_chunks_simd(const uint8_t input[], uint64_t chunks, uint64_t counter, uint32_t cvs[][8]) {
+            static const bool has_avx2 = __builtin_cpu_supports("avx2");
+            uint64_t done = has_avx2 ? hash_chunks_avx2(input, chunks, counter, cvs) : 0;
+            return done + hash_chunks_sse2(input + done * chunk_size, chunks - done, counter + done, cvs + done);
+        }
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+        inline void transpose_neon(uint32x4_t v[]) {
+            uint32x4x2_t pairs01 = vtrnq_u32(v[0], v[1]);
+            uint32x4x2_t pairs23 = vtrnq_u32(v[2], v[3]);
+            v[0] = vcombine_u32(vget_low_u32(pairs01.val[0]), vget_low_u32(pairs23.val[0]));
+            v[1] = vcombine_u32(vget_low_u32(pairs01.val[1]), vget_low_u32(pairs23.val[1]));
+            v[2] = vcombine_u32(vget_high_u32(pairs01.val[0]), vget_high_u32(pairs23.val[0]));
+            v[3] = vcombine_u32(vget_high_u32(pairs01.val[1]), vget_high_u32(pairs23.val[1]));
+        }
+
+        template <int n>
+        inline uint32x4_t rotate_neon(uint32x4_t v) {
+            if constexpr (n == 16) return vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(v)));
+            else return vsriq_n_u32(vshlq_n_u32(v, 32 - n), v, n);
+        }
+
+#define ADD(a, b) vaddq_u32(a, b)
+#define XOR(a, b) veorq_u32(a, b)
+#define ROTATE(v, n) rotate_neon<n>(v)
+        uint64_t hash_chunks_simd(const uint8_t input[], uint64_t chunks, uint64_t counter, uint32_t cvs[][8]) {
+            uint64_t done = 0;
+            for (; chunks - done >= 4; done += 4) {
+                const uint8_t* group = input + done * chunk_size;
+                uint32_t low[4];
+                uint32_t high[4];
+                for (uint32_t lane=0; lane < 4; ++lane) {
+                    low[lane] = (uint32_t)(counter + done + lane);
+                    high[lane] = (uint32_t)((counter + done + lane) >> 32);
+                }
+                const uint32x4_t counter_low = vld1q_u32(low);
+                const uint32x4_t counter_high = vld1q_u32(high);
+                uint32x4_t h[8];
+                for (uint32_t i=0; i < 8; ++i) h[i] = vdupq_n_u32(IV[i]);
+
+                for (uint32_t block=0; block < chunk_size / 64; ++block) {
+                    uint32x4_t m[16];
+                    for (uint32_t quarter=0; quarter < 4; ++quarter) {
+                        for (uint32_t lane=0; lane < 4; ++lane)
+                            m[4*quarter + lane] = vreinterpretq_u32_u8(vld1q_u8(group + lane * chunk_size + 64*block + 16*quarter));
+                        transpose_neon(m + 4*quarter);
+                    }
+
+                    uint32_t flags = (block == 0 ? chunk_start : 0) | (block == chunk_size / 64 - 1 ? chunk_end : 0);
+                    uint32x4_t v[16] = { h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+                                         vdupq_n_u32(IV[0]), vdupq_n_u32(IV[1]), vdupq_n_u32(IV[2]), vdupq_n_u32(IV[3]),
+                                         counter_low, counter_high, vdupq_n_u32(64), vdupq_n_u32(flags) };
+                    for (const auto& s : schedule) { BLAKE3_ROUND(v, m, s) }
+                    for (uint32_t i=0; i < 8; ++i) h[i] = veorq_u32(v[i], v[i + 8]);
+                }
+
+                // transposed back, words 0-3 of every chunk, then 4-7
+                transpose_neon(h);
+                transpose_neon(h + 4);
+                for (uint32_t lane=0; lane < 4; ++lane) {
+                    vst1q_u32(cvs[done + lane], h[lane]);
+                    vst1q_u32(cvs[done + lane] + 4, h[4 + lane]);
+                }
+            }
+            return done;
+        }
+#undef ADD
+#undef XOR
+#undef ROTATE
+#else
+        uint64_t hash_chunks_simd(const uint8_t[], uint64_t, uint64_t, uint32_t[][8]) {
+            return 0;
+        }
+#endif
+#undef BLAKE3_G
+#undef BLAKE3_ROUND
+
+        // Chaining values of whole chunks, which aren't the root
+        void hash_chunks(const uint8_t input[], uint64_t chunks, uint64_t counter, uint32_t cvs[][8]) {
+            uint64_t done = hash_chunks_simd(input, chunks, counter, cvs);
+            for (; done < chunks; ++done) chunk_cv_portable(input + done * chunk_size, counter + done, cvs[done]);
+        }
+    }
+
+
+    void Output::chaining_value(uint32_t cv[]) const {
+        uint32_t state[16];
+        compress(input_cv, block_words, counter, block_length, flags, state);
+        std::memcpy(cv, state, 8 * sizeof(uint32_t));
+    }
+
+
+    void Output::root_hash(uint8_t hash[]) const {
+        uint32_t state[16];
+        compress(input_cv, block_words, 0, block_length, flags | root, state);
+        for (uint32_t i=0; i < hash_size / 4; ++i) store_little_endian32(hash + 4*i, state[i]);
+    }
+
+
+    Hasher::Hasher(uint64_t first_chunk) : first_chunk(first_chunk) {
+        start_chunk(first_chunk);
+    }
+
+
+    void Hasher::update(const uint8_t input[], uint64_t size) {
+        while (size > 0) {
+            // chunk is finished only once there's more input, since the last one is hashed differently
+            if (blocks_compressed * 64 + block_length == chunk_size) {
+                Output output = chunk_output();
+                uint32_t cv[8];
+                output.chaining_value(cv);
+                add_chunk_cv(cv, chunk_counter - first_chunk + 1);
+                start_chunk(chunk_counter + 1);
+            }
+
+            // whole chunks (but the last one), many at a time
+            if (blocks_compressed == 0 and block_length == 0 and size > chunk_size) {
+                uint32_t cvs[64][8];
+                uint64_t chunks = std::min<uint64_t>((size - 1) / chunk_size, 64);
+                hash_chunks(input, chunks, chunk_counter, cvs);
+                for (uint64_t i=0; i < chunks; ++i) add_chunk_cv(cvs[i], chunk_counter - first_chunk + i + 1);
+                start_chunk(chunk_counter + chunks);
+                input += chunks * chunk_size;
+                size -= chunks * chunk_size;
+                continue;
+            }
+
+            if (block_length == 64) {
+                uint32_t words[16];
+                uint32_t state[16];
+                load_words(block, words);
+                compress(chunk_cv, words, chunk_counter, 64, blocks_compressed == 0 ? chunk_start : 0, state);
+                std::memcpy(chunk_cv, state, sizeof(chunk_cv));
+                blocks_compressed++;
+                block_length = 0;
+            }
+            uint32_t taken = std::min<uint64_t>(64 - block_length, size);
+            std::memcpy(block + block_length, input, taken);
+            block_length += taken;
+            input += taken;
+            size -= taken;
+        }
+    }
+
+
+    Output Hasher::output() const {
+        Output output = chunk_output();
+        for (uint32_t i = stack_size; i > 0; --i) {
+            uint32_t cv[8];
+            output.chaining_value(cv);
+            output = parent_output(cv_stack[i - 1], cv);
+        }
+        return output;
+    }
+
+
+    std::string Hasher::hex_digest() const {
+        uint8_t hash[hash_size];
+        output().root_hash(hash);
+        return to_hex(hash);
+    }
+
+
+    void Hasher::add_chunk_cv(uint32_t cv[], uint64_t total_chunks) {
+        // every trailing 0 bit of total_chunks is a pair of subtrees, which is complete now
+        uint32_t merged[8];
+        std::memcpy(merged, cv, sizeof(merged));
+        for (; (total_chunks & 1) == 0; total_chunks >>= 1) {
+            assert(stack_size > 0);
+            parent_output(cv_stack[--stack_size], merged).chaining_value(merged);
+        }
+        assert(stack_size < max_depth);
+        std::memcpy(cv_stack[stack_size++], merged, sizeof(merged));
+    }
+
+
+    void Hasher::start_chunk(uint64_t counter) {
+        std::memcpy(chunk_cv, IV, sizeof(IV));
+        chunk_counter = counter;
+        std::memset(block, 0, sizeof(block));
+        block_length = 0;
+        blocks_compressed = 0;
+    }
+
+
+    Output Hasher::chunk_output() const {
+        Output output{};
+        std::memcpy(output.input_cv, chunk_cv, sizeof(chunk_cv));
+        uint8_t padded[64] = {};
+        std::memcpy(padded, block, block_length);
+        load_words(padded, output.block_words);
+        output.counter = chunk_counter;
+        output.block_length = block_length;
+        output.flags = (blocks_compressed == 0 ? chunk_start : 0) | chunk_end;
+        return output;
+    }
+
+
+    Output subtree(const uint8_t input[], uint64_t size, uint64_t first_chunk) {
+        Hasher hasher(first_chunk);
+        hasher.update(input, size);
+        return hasher.output();
+    }
+
+
+    std::string join(const std::vector<Output>& subtrees) {
+        assert(!subtrees.empty());
+        // subtrees are as big as each other, so they're merged just like chunks are
+        std::vector<std::array<uint32_t, 8>> stack;
+        for (uint64_t i=0; i + 1 < subtrees.size(); ++i) {
+            std::array<uint32_t, 8> cv{};
+            subtrees[i].chaining_value(cv.data());
+            for (uint64_t total = i + 1; (total & 1) == 0; total >>= 1) {
+                parent_output(stack.back().data(), cv.data()).chaining_value(cv.data());
+                stack.pop_back();
+            }
+            stack.push_back(cv);
+        }
+
+        Output output = subtrees.back();
+        for (auto it = stack.rbegin(); it != stack.rend(); ++it) {
+            uint32_t cv[8];
+            output.chaining_value(cv);
+            output = parent_output(it->data(), cv);
+        }
+        uint8_t hash[hash_size];
+        output.root_hash(hash);
+        return to_hex(hash);
+    }
+
+
+    std::string to_hex(const uint8_t hash[]) {
+        const char digits[] = "0123456789abcdef";
+        std::string hex(2 * hash_size, '0');
+        for (uint32_t i=0; i < hash_size; ++i) {
+            hex[2*i] = digits[hash[i] >> 4];
+            hex[2*i + 1] = digits[hash[i] & 0xF];
+        }
+        return hex;
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef BLAKE3_H
+#define BLAKE3_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+
+// BLAKE3 hash (https://github.com/BLAKE3-team/BLAKE3-specs), default mode only.
+// Input is cut into 1 KiB chunks, which are leaves of a binary tree. Any aligned run of chunks is a subtree of it,
+// which can be hashed without the rest of input, so blocks of a file can be hashed by all workers at once,
+// and only their top nodes are joined at the end
+namespace blake3 {
+    constexpr uint32_t chunk_size = 1024;
+    constexpr uint32_t hash_size = 32;
+
+    // Node of the tree, before it's known whether it's the root (which is hashed differently)
+    struct Output {
+        uint32_t input_cv[8];
+        uint32_t block_words[16];
+        uint64_t counter;
+        uint32_t block_length;
+        uint32_t flags;
+
+        void chaining_value(uint32_t cv[]) const;
+        void root_hash(uint8_t hash[]) const;   // hash_size bytes
+    };
+
+    // Whole chunks are hashed many at a time, 8 of them with AVX2, 4 with SSE2 or NEON
+    class Hasher {
+    public:
+        // first_chunk is where in the whole input a subtree starts
+        explicit Hasher(uint64_t first_chunk = 0);
+
+        void update(const uint8_t input[], uint64_t size);
+
+        // Top node of everything hashed so far
+        Output output() const;
+
+        std::string hex_digest() const;
+
+    private:
+        static const uint32_t max_depth = 54;      // 2^54 chunks is 2^64 bytes
+
+        uint64_t first_chunk;
+        uint32_t cv_stack[max_depth][8];            // subtrees that don't have their right sibling yet
+        uint32_t stack_size = 0;
+
+        // chunk being hashed
+        uint32_t chunk_cv[8];
+        uint64_t chunk_counter;
+        uint8_t block[64] = {};
+        uint32_t block_length = 0;
+        uint32_t blocks_compressed = 0;
+
+        void add_chunk_cv(uint32_t cv[], uint64_t total_chunks);
+        void start_chunk(uint64_t counter);
+        Output chunk_output() const;
+    };
+
+    // Top node of size bytes of input, which start at chunk first_chunk. first_chunk has to be a multiple of
+    // the smallest power of 2 that's at least as many chunks as size has (blocks of a file always are)
+    Output subtree(const uint8_t input[], uint64_t size, uint64_t first_chunk);
+
+    // Hex hash of input, out of top nodes of its subtrees, in order. All but the last have to be the same
+    // number of chunks, and a power of 2 of them
+    std::string join(const std::vector<Output>& subtrees);
+
+    std::string to_hex(const uint8_t hash[]);
+}
+
+#endif // BLAKE3_H
@@ -0,0 +1,144 @@
+#include "block_index.h"
+
+#include <cassert>
+#include <algorithm>
+#include <bitset>
+
+#include "header_record.h"
+#include "cryptography.h"
+
+
+uint32_t BlockIndex::block_size(uint16_t flags, uint64_t original_size) {
+    std::bitset<16> bin_flags = flags;
+    uint32_t size = 1 << 24;  // 2^24 Bytes = 16 MiB, default block size
+
+    if (bin_flags[9]) size >>= 1;
+    if (bin_flags[10]) size >>= 2;
+    if (bin_flags[11]) size >>= 4;
+    if (bin_flags[12]) size >>= 8;
+
+    if (original_size <= size) return original_size;  // single block, as big as the file
+    return size;
+}
+
+
+uint32_t BlockIndex::block_count(uint16_t flags, uint64_t original_size) {
+    uint32_t size = block_size(flags, original_size);
+    if (size == 0) return 1;    // empty file still has a single (empty) block
+    return (original_size + size - 1) / size;
+}
+
+
+uint32_t BlockIndex::blocks_start(uint16_t flags) {
+    std::bitset<16> bin_flags = flags;
+    return bin_flags[6] ? crypto::AES128::metadata_size : 0;
+}
+
+
+bool BlockIndex::empty() const {
+    return blocks.empty();
+}
+
+
+void BlockIndex::add(uint64_t location, uint32_t stored_size, uint16_t flags, uint64_t original_size) {
+    uint64_t original_offset = (uint64_t)blocks.size() * block_size(flags, original_size);
+    blocks.push_back({ location, stored_size, original_offset });
+}
+
+
+uint64_t BlockIndex::original_block_size(uint32_t block, uint64_t original_size) const {
+    assert(block < blocks.size());
+    if (block + 1 == blocks.size()) return original_size - blocks[block].original_offset;
+    return blocks[block + 1].original_offset - blocks[block].original_offset;
+}
+
+
+uint32_t BlockIndex::find(uint64_t original_offset) const {
+    assert(!blocks.empty());
+    auto it = std::upper_bound(blocks.begin(), blocks.end(), original_offset,
+                               [](uint64_t offset, const Entry& entry) { return offset < entry.original_offset; });
+    return (it - blocks.begin()) - 1;
+}
+
+
+uint64_t BlockIndex::end() const {
+    if (blocks.empty()) return 0;
+    return blocks.back().location + blocks.back().stored_size;
+}
+
+
+// read_header(location, 8 byte buffer) reads a single block header, returns false if it couldn't
+template <typename Reader>
+static bool scan_headers(BlockIndex& index, Reader read_header, uint64_t data_location, uint64_t compressed_size,
+                         uint16_t flags, uint64_t original_size) {
+    auto& blocks = index.blocks;
+    blocks.clear();
+    uint32_t count = BlockIndex::block_count(flags, original_size);
+    if (compressed_size / 8 < count) return false;
+    blocks.reserve(count);
+
+    uint64_t pos = BlockIndex::blocks_start(flags);    // relative to data_location
+    for (uint32_t i=0; i < count; ++i) {
+        uint8_t block_header[8];
+        bool header_read = read_header(data_location + pos, block_header);
+        uint32_t part_id = little_endian::load(block_header, 4);
+        uint32_t stored_size = little_endian::load(block_header + 4, 4);
+
+        if (!header_read or part_id != i or pos + 8 + stored_size > compressed_size) {
+            blocks.clear();
+            return false;
+        }
+        index.add(pos + 8, stored_size, flags, original_size);
+        pos += 8 + stored_size;
+    }
+    return true;
+}
+
+
+bool BlockIndex::scan(std::fstream& archive_stream, uint64_t data_location, uint64_t compressed_size,
+                      uint16_t flags, uint64_t original_size) {
+    auto read_header = [&archive_stream](uint64_t location, uint8_t* block_header) {
+        archive_stream.seekg(location);
+        archive_stream.read((char*)block_header, 8);
+        if (archive_stream) return true;
+        archive_stream.clear();
+        return false;
+    };
+    return scan_headers(*this, read_header, data_location, compressed_size, flags, original_size);
+}
+
+
+bool BlockIndex::scan(const PositionalFile& archive_io, uint64_t data_location, uint64_t compressed_size,
+                      uint16_t flags, uint64_t original_size) {
+    auto read_header = [&archive_io](uint64_t location, uint8_t* block_header) {
+        return archive_io.read_at(block_header, 8, location) == 8;
+    };
+    return scan_headers(*this, read_header, data_location, compressed_size, flags, original_size);
+}
+
+
+std::string BlockIndex::encode() const {
+    std::string payload;
+    payload.reserve(4 + blocks.size() * 12);
+    little_endian::append(payload, blocks.size(), 4);
+    for (const Entry& entry : blocks) {
+        little_endian::append(payload, entry.location, 8);
+        little_endian::append(payload, entry.stored_size, 4);
+    }
+    return payload;
+}
+
+
+bool BlockIndex::decode(std::string_view payload, uint16_t flags, uint64_t original_size) {
+    blocks.clear();
+    auto buffer = (const uint8_t*)payload.data();
+    if (payload.size() < 4) return false;
+
+    uint32_t count = little_endian::load(buffer, 4);
+    if (count != block_count(flags, original_size) or payload.size() != 4 + (uint64_t)count * 12) return false;
+
+    blocks.reserve(count);
+    for (uint32_t i=0; i < count; ++i)
+        add(little_endian::load(buffer + 4 + i*12, 8), little_endian::load(buffer + 4 + i*12 + 8, 4), flags, original_size);
+    return true;
+}
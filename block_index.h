@@ -0,0 +1,59 @@
+#ifndef BLOCK_INDEX_H
+#define BLOCK_INDEX_H
+
+#include <string>
+#include <string_view>
+#include <fstream>
+#include <vector>
+
+#include "misc/positional_file.h"
+
+
+// Where every block of a file's compressed data is, so any of them can be read without reading the ones before it.
+// File's data is [part_id 4B][size 4B][payload] for every block (after encryption metadata, if it's encrypted),
+// followed by the checksum.
+struct BlockIndex {
+    struct Entry {
+        uint64_t location;                          // location of block's payload, relative to file's data_location
+        uint32_t stored_size;                       // size of the payload
+        uint64_t original_offset;                   // offset of block's first byte in the original file
+    };
+
+    std::vector<Entry> blocks;                      // empty if the index isn't known yet
+
+    // Size of blocks file's data was split into, with given flags and size
+    static uint32_t block_size(uint16_t flags, uint64_t original_size);
+
+    // Number of blocks file's data was split into, with given flags and size
+    static uint32_t block_count(uint16_t flags, uint64_t original_size);
+
+    // Location of the first block, relative to data_location. Data of encrypted files starts with encryption metadata
+    static uint32_t blocks_start(uint16_t flags);
+
+    bool empty() const;
+
+    // Adds next block, which payload starts at location (relative to data_location)
+    void add(uint64_t location, uint32_t stored_size, uint16_t flags, uint64_t original_size);
+
+    // Original size of given block
+    uint64_t original_block_size(uint32_t block, uint64_t original_size) const;
+
+    // Index of the block containing byte at original_offset
+    uint32_t find(uint64_t original_offset) const;
+
+    // Location of checksum, right after the last block, relative to data_location
+    uint64_t end() const;
+
+    // Builds index by walking block headers of file's data, without reading payloads.
+    // Returns false (and leaves index empty) if headers don't add up to compressed_size
+    bool scan(std::fstream& archive_stream, uint64_t data_location, uint64_t compressed_size,
+              uint16_t flags, uint64_t original_size);
+    bool scan(const PositionalFile& archive_io, uint64_t data_location, uint64_t compressed_size,
+              uint16_t flags, uint64_t original_size);
+
+    // Payload of table of contents extension: [block_count 4B] and [location 8B][stored_size 4B] for every block
+    std::string encode() const;
+    bool decode(std::string_view payload, uint16_t flags, uint64_t original_size);
+};
+
+#endif // BLOCK_INDEX_H
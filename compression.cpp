@@ -6,6 +6,7 @@
 #include <cassert>
 #include <vector>
 #include <bitset>
+#include <cstring>
 
 #include "cryptography.h"
 #include "misc/bitbuffer.h"
@@ -19,7 +20,31 @@ Compression::Compression( bool& aborting_variable ) :
 
 
 Compression::~Compression() {
-    delete[] text;
+    release_text();
+}
+
+
+void Compression::borrow_text(uint8_t* data, uint32_t text_size)
+{
+    release_text();
+    this->text = data;
+    this->size = text_size;
+    this->text_borrowed = true;
+}
+
+
+void Compression::replace_text(uint8_t* new_text)
+{
+    release_text();
+    this->text = new_text;
+}
+
+
+void Compression::release_text()
+{
+    if (!text_borrowed) delete[] text;
+    text = nullptr;
+    text_borrowed = false;
 }
 
 
@@ -27,17 +52,39 @@ void Compression::load_text(std::fstream &input, uint64_t text_size)
 {
     if (*aborting_var) return;
 
-    delete[] this->text;
+    release_text();
     this->size = text_size;
     this->text = new uint8_t [this->size];
     input.read( (char*)this->text, this->size );
 }
 
 
+void Compression::load_text(const uint8_t* input, uint64_t text_size)
+{
+    if (*aborting_var) return;
+
+    release_text();
+    this->size = text_size;
+    this->text = new uint8_t [this->size];
+    std::memcpy(this->text, input, this->size);
+}
+
+
+bool Compression::load_text(const PositionalFile &input, uint64_t offset, uint64_t text_size)
+{
+    if (*aborting_var) return false;
+
+    release_text();
+    this->size = text_size;
+    this->text = new uint8_t [this->size];
+    return input.read_at(this->text, this->size, offset) == this->size;
+}
+
+
 void Compression::load_part(std::fstream &input, uint64_t text_size, uint32_t part_num, uint32_t block_size) {
     if (*aborting_var) return;
 
-    delete[] this->text;
+    release_text();
     assert( block_size * part_num <= text_size ); // part_size * part_num == starting position
 
     if (block_size * (part_num+1) < text_size ) this->size = block_size;
@@ -53,11 +100,8 @@ void Compression::load_part(std::fstream &input, uint64_t text_size, uint32_t pa
 }
 
 
-void Compression::save_text(std::fstream &output) {
-    if (!*aborting_var) {
-        output.write((char*)(this->text), this->size);
-        output.flush();
-    }
+void Compression::save_text(BufferedWriter &output) {
+    if (!*aborting_var) output.write((char*)(this->text), this->size);
 }
 
 
@@ -103,8 +147,7 @@ void Compression::BWT_make()    // DC3
         encoded[n+1+index] = ( original_message_index >> (index*8u)) & 0xFFu;
 
     // replacing this->text with encoded text
-    std::swap(this->text, encoded);
-    delete[] encoded;
+    replace_text(encoded);
     this->size = n+5;
 }
 
@@ -177,8 +220,7 @@ void Compression::BWT_reverse()
     }
 
     // replacing encoded text with decoded
-    std::swap(this->text, decoded);
-    delete[] decoded;
+    replace_text(decoded);
     this->size = decoded_length;
 }
 
@@ -257,9 +299,8 @@ void Compression::MTF_make()
         return;
     }
 
-    std::swap(text, output);
+    replace_text(output);
     this->size = textlength+32;
-    delete[] output;
 }
 
 
@@ -304,10 +345,8 @@ void Compression::MTF_reverse()
         return;
     }
 
-    std::swap(text, output);
+    replace_text(output);
     this->size = textlength;
-
-    delete[] output;
 }
 
 
@@ -344,7 +383,7 @@ void Compression::RLE_make()
             output += counter;
         }
 
-        delete[] text;
+        release_text();
         text = new uint8_t [output.length()];
         for (uint32_t i=0; i < output.length() and !*aborting_var; ++i) {
             text[i] = output[i];
@@ -358,8 +397,7 @@ void Compression::RLE_make()
         for (uint32_t i=0; i < size and !*aborting_var; ++i) {
             temp[i+1] = text[i];
         }
-        std::swap(text, temp);
-        delete[] temp;
+        replace_text(temp);
         size++;
     }
 }
@@ -380,7 +418,7 @@ void Compression::RLE_reverse()
 
         if (*aborting_var) return;
 
-        delete[] text;
+        release_text();
         text = new uint8_t [output.length()];
         for (uint32_t i=0; i<output.length() and !*aborting_var; ++i)
             text[i] = output[i];
@@ -398,9 +436,7 @@ void Compression::RLE_reverse()
             return;
         }
 
-        std::swap(temp, text);
-
-        delete[] temp;
+        replace_text(temp);
         size--;
 
     }
@@ -412,8 +448,6 @@ void Compression::RLE_makeV2()
 {
     if (*aborting_var) return;
 
-    uint32_t textlength = 1 + size; // first byte encodes whether or not RLE was used
-
     std::string output_run_length;
     output_run_length.reserve(size);
 
@@ -424,7 +458,7 @@ void Compression::RLE_makeV2()
     bool RLE_used = true;
 
     uint8_t counter = 0;
-    for (uint32_t i=1; i<textlength; ++i) {
+    for (uint32_t i=1; i<size; ++i) {
         counter++;
         if (text[i-1] != text[i] or counter == 255) {
             output_chars += text[i-1];
@@ -433,18 +467,17 @@ void Compression::RLE_makeV2()
             if (*aborting_var) return;
         }
     }
+    if (size != 0) {    // last run ends with text, nothing past it is read (text may be a mapped file)
+        output_chars += text[size-1];
+        output_run_length += (char)(counter + 1);
+    }
 
     if ( (output_chars.length() + output_run_length.length())*3 > size*2 ) {    // if RLE improves compression by less than 1/3 this-size bytes, then:
         RLE_used = false;
     }
 
     if( RLE_used ) {
-        if (counter != 0) {
-            output_chars += text[textlength-1];
-            output_run_length += counter;
-        }
-
-        delete[] text;
+        release_text();
         text = new uint8_t [output_run_length.length() + output_chars.length()];
         for (uint32_t i=0; i<output_run_length.length(); ++i) {
             text[i] = output_run_length[i];
@@ -467,10 +500,8 @@ void Compression::RLE_makeV2()
 
         if (*aborting_var) return;
 
-        std::swap(temp, text);
-
+        replace_text(temp);
         size++;
-        delete[] temp;
     }
 }
 
@@ -490,7 +521,7 @@ void Compression::RLE_reverseV2()
 
         if (*aborting_var) return;
 
-        delete[] text;
+        release_text();
         text = new uint8_t [output.length()];
         for (uint32_t i=0; i < output.length(); ++i) {
             text[i] = output[i];
@@ -506,9 +537,7 @@ void Compression::RLE_reverseV2()
 
         if (*aborting_var) return;
 
-        std::swap(text, temp);
-
-        delete[] temp;
+        replace_text(temp);
         size--;
     }
     else throw std::invalid_argument("RLE was neither used nor not used, apparently");
@@ -634,7 +663,7 @@ void Compression::AC_make()
     *(uint32_t*)(output.c_str()) = bitout.get_output_size();
 
     size = output.length();
-    delete[] text;
+    release_text();
 
     text = new uint8_t [size];
     for (uint32_t i=0; i < size; ++i) {
@@ -767,7 +796,7 @@ void Compression::AC_reverse()
 
     if (*aborting_var) return;
     size = output.length();
-    delete[] text;
+    release_text();
 
     text = new uint8_t [size];
     for (uint32_t j=0; j < size; ++j) {
@@ -894,7 +923,7 @@ void Compression::AC2_make()
     *(uint32_t*)(output.c_str()) = bitout.get_output_size();
 
     size = output.length();
-    delete[] text;
+    release_text();
 
     text = new uint8_t[size];
     for (uint32_t i = 0; i < size; ++i) {
@@ -1053,7 +1082,7 @@ void Compression::AC2_reverse()
     if (*aborting_var) return;
 
     size = output.length();
-    delete[] text;
+    release_text();
 
     text = new uint8_t [size];
     for (uint32_t j=0; j < size; ++j) {
@@ -1177,10 +1206,9 @@ void Compression::rANS_make()
         *reinterpret_cast<uint32_t*>(output + output_i + i*4) = stack[i];
     }
 
-    std::swap(text, output);
+    replace_text(output);
     std::swap(size, output_size);
 
-    delete[] output;
     delete[] stack;
 }
 
@@ -1275,9 +1303,77 @@ void Compression::rANS_reverse()
         return;
     }
 
-    std::swap(decoded, text);
+    replace_text(decoded);
     std::swap(size, original_size);
 
-    delete[] decoded;
     delete[] index2char;
 }
+
+
+void Compression::AES128_make(const uint8_t key[], [[maybe_unused]] uint32_t key_size)
+{
+    assert(key_size == crypto::AES128::key_size);
+    crypto::AES128::KeySchedule schedule;
+    crypto::AES128::expand_key(key, schedule);
+
+    // key is random for every file, so counter alone keeps every block's keystream unique
+    uint64_t first_counter = crypto::AES128::block_counter(part_id);
+    if (text_borrowed) {    // borrowed text may be read-only
+        auto encrypted = new uint8_t[size];
+        crypto::AES128::ctr_xor(schedule, 0, first_counter, text, encrypted, size);
+        replace_text(encrypted);
+    }
+    else crypto::AES128::ctr_xor(schedule, 0, first_counter, text, text, size);
+
+    std::memset(&schedule, 0, sizeof(schedule));
+}
+
+
+void Compression::AES128_reverse(const uint8_t key[], uint32_t key_size)
+{
+    AES128_make(key, key_size);     // CTR mode is its own inverse
+}
+
+
+void Compression::ChaCha20Poly1305_make(const uint8_t key[], [[maybe_unused]] uint32_t key_size)
+{
+    assert(key_size == crypto::ChaCha20Poly1305::key_size);
+    assert(size <= UINT32_MAX - crypto::ChaCha20Poly1305::tag_size);
+    uint8_t nonce[crypto::ChaCha20Poly1305::nonce_size];
+    crypto::ChaCha20Poly1305::block_nonce(part_id, nonce);
+
+    auto sealed = new uint8_t[size + crypto::ChaCha20Poly1305::tag_size];
+    crypto::ChaCha20Poly1305::seal(key, nonce, nullptr, 0, text, sealed, size, sealed + size);
+    replace_text(sealed);
+    size += crypto::ChaCha20Poly1305::tag_size;
+}
+
+
+bool Compression::ChaCha20Poly1305_reverse(const uint8_t key[], [[maybe_unused]] uint32_t key_size)
+{
+    assert(key_size == crypto::ChaCha20Poly1305::key_size);
+    uint8_t nonce[crypto::ChaCha20Poly1305::nonce_size];
+    crypto::ChaCha20Poly1305::block_nonce(part_id, nonce);
+
+    bool authentic = size >= crypto::ChaCha20Poly1305::tag_size;
+    uint32_t sealed_size = authentic ? size - crypto::ChaCha20Poly1305::tag_size : 0;
+    if (authentic) {
+        uint8_t* output = text_borrowed ? new uint8_t[sealed_size] : text;    // borrowed text may be read-only
+        authentic = crypto::ChaCha20Poly1305::open(key, nonce, nullptr, 0, text, output, sealed_size,
+                                                   text + sealed_size);
+        if (output != text) {
+            if (authentic) replace_text(output);
+            else delete[] output;
+        }
+    }
+
+    // nothing of a block that was tampered with gets any further
+    if (!authentic) {
+        rejected = true;
+        release_text();
+        size = 0;
+        return false;
+    }
+    size = sealed_size;
+    return true;
+}
@@ -4,19 +4,31 @@
 #include <fstream>
 #include <random>
 
+#include "misc/buffered_writer.h"
+#include "misc/positional_file.h"
+
 class Compression {
 public:
     bool* aborting_var;
     uint8_t* text;
     uint32_t size;
     uint32_t part_id=0;
+    bool text_borrowed=false;   // text points at memory owned by someone else (e.g. mapped file), so it's not freed
+    bool rejected=false;        // authenticated block didn't match its tag, text is empty then
 
     Compression( bool& aborting_variable );
     ~Compression();
 
     void load_text( std::fstream &input, uint64_t text_size );
+    bool load_text( const PositionalFile &input, uint64_t offset, uint64_t text_size );   // false if it couldn't read all of it
+    void load_text( const uint8_t* input, uint64_t text_size );
     void load_part( std::fstream &input, uint64_t text_size, uint32_t part_num, uint32_t block_size );
-    void save_text( std::fstream &output );
+    void save_text( BufferedWriter &output );
+
+    // Uses data as text without copying it. It has to stay valid until text is replaced, and may get written to
+    void borrow_text( uint8_t* data, uint32_t text_size );
+    void replace_text( uint8_t* new_text );     // takes ownership of new_text, and frees the old text if it's owned
+    void release_text();
 
     void BWT_make();    // Burrows-Wheeler transform (DC3)
     void BWT_reverse();
@@ -42,9 +54,11 @@ public:
     void rANS_make();   // asymmetric numeral systems (range variant)
     void rANS_reverse();
 
-    void AES128_make(uint8_t key[], uint32_t key_size, uint8_t iv[], uint32_t iv_size,
-                     uint8_t metadata[]= nullptr, uint8_t metadata_size=0);
-    void AES128_reverse(uint8_t key[], uint32_t key_size);
+    void AES128_make(const uint8_t key[], uint32_t key_size);     // AES-128 in CTR mode, counter comes from part_id
+    void AES128_reverse(const uint8_t key[], uint32_t key_size);
+
+    void ChaCha20Poly1305_make(const uint8_t key[], uint32_t key_size);  // nonce comes from part_id, tag is appended
+    bool ChaCha20Poly1305_reverse(const uint8_t key[], uint32_t key_size);  // false (and rejected) if tag doesn't match
 
     bool AES128_verify_password_str(std::string& pw, uint8_t *metadata, uint32_t metadata_size);
 
@@ -0,0 +1,159 @@
+#include "compression_pipeline.h"
+
+#include <cassert>
+#include <chrono>
+
+#include "misc/mapped_file.h"
+#include "misc/multithreading.h"
+
+
+EncodedFile::~EncodedFile() {
+    if (pipeline != nullptr) pipeline->release(reserved);
+}
+
+
+std::shared_ptr<EncodedFile> CompressionJob::take() {
+    if (taken) return result;
+    taken = true;
+
+    state expected = state::queued;
+    if (current.compare_exchange_strong(expected, state::cancelled)) {
+        pipeline->notify();
+        return nullptr;
+    }
+    if (expected == state::cancelled) return nullptr;
+    result = promise.get_future().get();
+    return result;
+}
+
+
+CompressionPipeline::CompressionPipeline(bool& aborting_var, uint64_t memory_budget) :
+        aborting_var(&aborting_var),
+        memory_budget(memory_budget) {}
+
+
+CompressionPipeline::~CompressionPipeline() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing = true;
+    }
+    memory_released.notify_all();
+    pool.wait();
+
+    // compressed data nobody picked up gives its memory back while this still exists
+    for (File* file : files_ahead) file->compression_job = nullptr;
+}
+
+
+void CompressionPipeline::compress_ahead(const std::vector<File*>& files) {
+    for (File* file : files) {
+        if (file->alreadySaved or file->compression_job or file->pending_delta or file->path.empty()) continue;
+        if (file->is_encrypted()) continue;     // metadata goes before blocks, process_the_file writes it
+        if (BlockIndex::block_count(file->flags_value, file->original_size) != 1) continue;
+
+        auto job = std::make_shared<CompressionJob>();
+        job->pipeline = this;
+        file->compression_job = job;
+        files_ahead.push_back(file);
+
+        pool.submit([this, file, job]() { compress(file, job); });
+    }
+}
+
+
+std::shared_ptr<EncodedFile> CompressionPipeline::finish(File& file) {
+    assert(file.compression_job and file.compression_job->pipeline == this);
+    CompressionJob& job = *file.compression_job;
+
+    // pool's task finds the job running, and leaves it alone
+    auto expected = CompressionJob::state::queued;
+    if (job.current.compare_exchange_strong(expected, CompressionJob::state::running)) {
+        notify();
+        encode(&file, job, 0);     // memory of a file the writer is on isn't held back by the budget
+    }
+    return job.take();
+}
+
+
+void CompressionPipeline::release(uint64_t bytes) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        assert(memory_used >= bytes);
+        memory_used -= bytes;
+    }
+    memory_released.notify_all();
+}
+
+
+void CompressionPipeline::notify() {
+    std::lock_guard<std::mutex> lock(mutex);
+    memory_released.notify_all();
+}
+
+
+bool CompressionPipeline::reserve(uint64_t bytes, const CompressionJob& job) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        if (closing or *aborting_var or job.current != CompressionJob::state::queued) return false;
+        if (memory_used == 0 or memory_used + bytes <= memory_budget) break;
+        // aborting_var isn't signalled, so it's checked every now and then
+        memory_released.wait_for(lock, std::chrono::milliseconds(50));
+    }
+    memory_used += bytes;
+    return true;
+}
+
+
+void CompressionPipeline::compress(File* file, const std::shared_ptr<CompressionJob>& job) {
+    uint64_t bytes = file->original_size;
+    if (!reserve(bytes, *job)) return;
+
+    auto expected = CompressionJob::state::queued;
+    if (!job->current.compare_exchange_strong(expected, CompressionJob::state::running)) {
+        release(bytes);     // writer got to the file first
+        return;
+    }
+    encode(file, *job, bytes);
+}
+
+
+void CompressionPipeline::encode(File* file, CompressionJob& job, uint64_t reserved) {
+    auto encoded = std::make_shared<EncodedFile>();
+    encoded->pipeline = this;
+    encoded->reserved = reserved;
+
+    MappedFile source;      // comp works on it in place, so it has to outlive comp
+    Compression comp(*aborting_var);
+    bool loaded = false;
+    if (source.open(file->path) and source.size() >= file->original_size) {
+        source.advise_sequential();
+        comp.borrow_text(source.data(), file->original_size);
+        loaded = true;
+    }
+    else {  // empty files can't be mapped
+        std::fstream stream(file->path, std::ios::binary | std::ios::in);
+        if (stream.is_open()) {
+            comp.load_part(stream, file->original_size, 0, BlockIndex::block_size(file->flags_value, file->original_size));
+            loaded = true;
+        }
+    }
+
+    if (loaded) {
+        bool finished = false;
+        uint8_t* key = nullptr;
+        uint8_t* metadata = nullptr;
+        uint32_t metadata_size = 0;
+        multithreading::processing_worker(multithreading::mode::compress, &comp, file->flags_value, *aborting_var,
+                                          &finished, key, metadata, metadata_size);
+
+        // same layout processing_scribe writes: [part_id][size][payload], then checksum
+        little_endian::append(encoded->data, 0, 4);
+        little_endian::append(encoded->data, comp.size, 4);
+        encoded->data.append((char*)comp.text, comp.size);
+        encoded->compressed_size = encoded->data.size();
+        encoded->blocks.add(8, comp.size, file->flags_value, file->original_size);
+        encoded->data += multithreading::file_checksum(file->path, file->flags_value, *aborting_var);
+        encoded->successful = !*aborting_var;
+    }
+    job.promise.set_value(encoded);
+}
@@ -0,0 +1,91 @@
+#ifndef COMPRESSION_PIPELINE_H
+#define COMPRESSION_PIPELINE_H
+
+#include <mutex>
+#include <atomic>
+#include <future>
+#include <vector>
+#include <condition_variable>
+
+#include "archive_structures.h"
+#include "misc/thread_pool.h"
+
+class CompressionPipeline;
+
+
+// File's data compressed ahead of writing, exactly as it goes into archive
+struct EncodedFile {
+    std::string data;                               // blocks, followed by checksum
+    uint64_t compressed_size = 0;                   // size of blocks, without checksum
+    BlockIndex blocks;
+    bool successful = false;
+
+    CompressionPipeline* pipeline = nullptr;        // gets memory back once this is gone
+    uint64_t reserved = 0;
+
+    ~EncodedFile();
+};
+
+
+// Compression of a single file ahead of the writer
+struct CompressionJob {
+    enum class state : uint8_t { queued, running, cancelled };
+
+    std::atomic<state> current{ state::queued };
+    std::promise<std::shared_ptr<EncodedFile>> promise;
+    CompressionPipeline* pipeline = nullptr;
+
+    // Called by writer when it gets to the file. Returns compressed data, waiting for it if it's being compressed,
+    // or nullptr if compression didn't start yet (it won't start anymore, writer has to compress the file itself).
+    // Calling it again returns the same thing
+    std::shared_ptr<EncodedFile> take();
+
+private:
+    bool taken = false;
+    std::shared_ptr<EncodedFile> result;
+};
+
+
+// Compresses files on a shared pool, ahead of the thread which writes them into archive.
+// Writer picks compressed data up through File::compression_job when it gets to the file, so files should be given
+// in the order they'll be written. Only single block files are compressed this way, bigger ones are left
+// for processing_foreman, which splits them between all cores by itself.
+// At most memory_budget bytes of files (or a single file, if it's bigger) are compressed or wait for the writer at a time
+class CompressionPipeline
+{
+public:
+    static const uint64_t default_memory_budget = 64ull << 20;     // 64 MiB
+
+    explicit CompressionPipeline(bool& aborting_var, uint64_t memory_budget = default_memory_budget);
+
+    // Stops compressing, and drops whatever the writer didn't pick up
+    ~CompressionPipeline();
+
+    void compress_ahead(const std::vector<File*>& files);
+
+    // Same as file's compression_job->take(), except that file which wasn't picked up by the pool yet is compressed
+    // right away, on the calling thread, so its compressed size is known before anything of it is written
+    std::shared_ptr<EncodedFile> finish(File& file);
+
+    // Memory of compressed data which was written, or dropped
+    void release(uint64_t bytes);
+
+    // Wakes up jobs waiting for memory, so cancelled ones can give up
+    void notify();
+
+private:
+    bool* aborting_var;
+    const uint64_t memory_budget;
+    uint64_t memory_used = 0;
+    bool closing = false;
+    std::mutex mutex;
+    std::condition_variable memory_released;
+    std::vector<File*> files_ahead;
+    ThreadPool pool;                                // last, so its threads are gone before anything above
+
+    bool reserve(uint64_t bytes, const CompressionJob& job);
+    void compress(File* file, const std::shared_ptr<CompressionJob>& job);
+    void encode(File* file, CompressionJob& job, uint64_t reserved);
+};
+
+#endif // COMPRESSION_PIPELINE_H
@@ -5,16 +5,44 @@
 
 #include <cmath>
 #include <cassert>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AES_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+// older Clangs declare AES intrinsics only when the whole file is built for AES
+#if defined(__ARM_FEATURE_AES) or !defined(__clang__) or __clang_major__ >= 16
+#define AES_ARMV8
+#endif
+#endif
 
 #include "integrity_validation.h"
 
 
 namespace crypto {
 
+    namespace {
+        // Zeroes memory in a way compiler can't leave out
+        void wipe(void* memory, uint64_t size) {
+            auto bytes = (volatile uint8_t*)memory;
+            for (uint64_t i=0; i < size; ++i) bytes[i] = 0;
+        }
+    }
+
     namespace HMAC {
 
         std::string SHA256(uint8_t message[], uint64_t message_size,
                            uint8_t key[], uint32_t key_size, bool &aborting_var) {
+            // hashes of an aborted run are left empty, so nothing below reads them
+            if (aborting_var) return "";
+
             uint32_t block_size = 64;   // block size of SHA-256
             uint32_t output_size = 32;  // output size of SHA-256
             auto *block_sized_key = new uint8_t[block_size]();
@@ -25,6 +53,10 @@ namespace crypto {
                 // if the key is longer than block size, we'll hash it
                 IntegrityValidation val;
                 val.get_SHA256_from_text(key, key_size, aborting_var);
+                if (aborting_var) {
+                    delete[] block_sized_key;
+                    return "";
+                }
 
                 for (uint32_t i = 0; i < output_size; ++i)
                     block_sized_key[i] = val.SHA256_num[i];
@@ -53,6 +85,10 @@ namespace crypto {
             IntegrityValidation val;
             val.get_SHA256_from_text(concatenated, concatenated_index, aborting_var);
             delete[] concatenated;
+            if (aborting_var) {
+                delete[] block_sized_key;
+                return "";
+            }
 
             // next, we'll need to concatenate (block-sized key xor opad) || SHA-256((block-sized key xor ipad) || message)
             // and hash it
@@ -72,6 +108,7 @@ namespace crypto {
             val.get_SHA256_from_text(concat2, concatenated_index2, aborting_var);
 
             delete[] concat2;
+            if (aborting_var) return "";
 
             assert(val.SHA256_num != nullptr);
 
@@ -97,6 +134,7 @@ namespace crypto {
                 for (uint32_t it = 1; it < iteration_count; ++it) {
                     U = HMAC::SHA256((uint8_t *) U.c_str(), U.length(), (uint8_t *) pw.c_str(), pw.length(),
                                      aborting_var);
+                    if (aborting_var) return "";
 
                     assert(U.length() == sha256_size);
                     assert(xored.length() == sha256_size);
@@ -129,6 +167,7 @@ namespace crypto {
 
             for (int32_t i = 1; i <= l; ++i) {
                 std::string T = HMAC_SHA256_get_block(pw, salt, salt_size, iteration_count, i, aborting_var);
+                if (aborting_var) return "";    // T may be empty
 
                 // concatenating Ts we got for every block, by copying them in the output
                 if (i != l) {
@@ -146,6 +185,744 @@ namespace crypto {
         }
     }
 
+    namespace AES128
+    {
+        namespace {
+            const uint64_t lanes = 0x0101010101010101ull;   // lowest bit of every byte
+
+            uint64_t load_big_endian(const uint8_t buffer[]) {
+                uint64_t value = 0;
+                for (uint32_t i=0; i < 8; ++i) value = (value << 8) | buffer[i];
+                return value;
+            }
+
+            void store_big_endian(uint8_t buffer[], uint64_t value) {
+                for (uint32_t i=0; i < 8; ++i) buffer[i] = (value >> (56 - i*8)) & 0xFF;
+            }
+
+            // Everything below works on 8 bytes at once, without tables or branches depending on data,
+            // so it takes the same time whatever the key and the data are
+
+            // every byte multiplied by x in GF(2^8)
+            uint64_t xtime(uint64_t bytes) {
+                return ((bytes & 0x7F7F7F7F7F7F7F7Full) << 1) ^ (((bytes >> 7) & lanes) * 0x1B);
+            }
+
+            // bytes of a multiplied by bytes of b in GF(2^8)
+            uint64_t gf_multiply(uint64_t a, uint64_t b) {
+                uint64_t product = 0;
+                for (uint32_t bit=0; bit < 8; ++bit) {
+                    product ^= a & (((b >> bit) & lanes) * 0xFF);
+                    a = xtime(a);
+                }
+                return product;
+            }
+
+            // bytes squared in GF(2^8), which is linear: bit i of a byte turns into x^2i, reduced
+            uint64_t gf_square(uint64_t bytes) {
+                const uint8_t squares[8] = { 0x01, 0x04, 0x10, 0x40, 0x1B, 0x6C, 0xAB, 0x9A };
+                uint64_t square = 0;
+                for (uint32_t bit=0; bit < 8; ++bit) square ^= ((bytes >> bit) & lanes) * squares[bit];
+                return square;
+            }
+
+            // every byte rotated left by n bits
+            uint64_t rotate_bytes(uint64_t bytes, uint32_t n) {
+                return ((bytes << n) & (lanes * ((0xFFu << n) & 0xFFu))) | ((bytes >> (8 - n)) & (lanes * ((1u << n) - 1)));
+            }
+
+            // S-box of every byte: its inverse (x^254, 0 stays 0), then the affine transform
+            uint64_t sub_bytes(uint64_t bytes) {
+                uint64_t x2 = gf_square(bytes);
+                uint64_t x3 = gf_multiply(x2, bytes);
+                uint64_t x12 = gf_square(gf_square(x3));
+                uint64_t x15 = gf_multiply(x12, x3);
+                uint64_t x240 = gf_square(gf_square(gf_square(gf_square(x15))));
+                uint64_t inverse = gf_multiply(gf_multiply(x240, x12), x2);
+                return inverse ^ rotate_bytes(inverse, 1) ^ rotate_bytes(inverse, 2) ^ rotate_bytes(inverse, 3)
+                       ^ rotate_bytes(inverse, 4) ^ (lanes * 0x63);
+            }
+
+            void encrypt_block_portable(const KeySchedule& schedule, uint8_t block[]) {
+                uint8_t state[16];
+                for (uint32_t i=0; i < 16; ++i) state[i] = block[i] ^ schedule.round_keys[0][i];
+
+                for (uint32_t round=1; round <= 10; ++round) {
+                    uint64_t halves[2];
+                    std::memcpy(halves, state, 16);
+                    halves[0] = sub_bytes(halves[0]);
+                    halves[1] = sub_bytes(halves[1]);
+                    uint8_t substituted[16];
+                    std::memcpy(substituted, halves, 16);
+
+                    // state is column after column, row r of column c is at r + 4c
+                    for (uint32_t c=0; c < 4; ++c)
+                        for (uint32_t r=0; r < 4; ++r)
+                            state[r + 4*c] = substituted[r + 4*((c + r) % 4)];
+
+                    if (round != 10) {
+                        for (uint32_t c=0; c < 4; ++c) {
+                            uint8_t* column = state + 4*c;
+                            uint8_t all = column[0] ^ column[1] ^ column[2] ^ column[3];
+                            uint8_t first = column[0];
+                            for (uint32_t r=0; r < 4; ++r) {
+                                uint8_t next = r == 3 ? first : column[r + 1];
+                                column[r] ^= all ^ (uint8_t)xtime(column[r] ^ next);
+                            }
+                        }
+                    }
+                    for (uint32_t i=0; i < 16; ++i) state[i] ^= schedule.round_keys[round][i];
+                }
+                std::memcpy(block, state, 16);
+                wipe(state, 16);
+            }
+
+            void ctr_xor_portable(const KeySchedule& schedule, uint64_t nonce, uint64_t counter,
+                                  const uint8_t input[], uint8_t output[], uint64_t size) {
+                uint8_t keystream[16];
+                for (uint64_t offset=0; offset < size; offset += 16, ++counter) {
+                    store_big_endian(keystream, nonce);
+                    store_big_endian(keystream + 8, counter);
+                    encrypt_block_portable(schedule, keystream);
+
+                    uint64_t length = std::min<uint64_t>(16, size - offset);
+                    for (uint64_t i=0; i < length; ++i) output[offset + i] = input[offset + i] ^ keystream[i];
+                }
+                wipe(keystream, 16);
+            }
+
+#if defined(AES_X86)
+            bool cpu_has_aes() {
+                return __builtin_cpu_supports("aes");
+            }
+
+            __attribute__((target("aes,sse2")))
+            void ctr_xor_hardware(const KeySchedule& schedule, uint64_t nonce, uint64_t counter,
+                                  const uint8_t input[], uint8_t output[], uint64_t size) {
+                __m128i keys[11];
+                for (uint32_t i=0; i < 11; ++i) keys[i] = _mm_load_si128((const __m128i*)schedule.round_keys[i]);
+                // counter block is [nonce][counter] in big-endian, so its low half is the nonce
+                const long long nonce_half = (long long)__builtin_bswap64(nonce);
+
+                uint64_t offset = 0;
+                // 8 blocks at once, so the rounds of one block don't wait for the ones of another
+                for (; size - offset >= 128; offset += 128, counter += 8) {
+                    __m128i blocks[8];
+                    for (uint32_t i=0; i < 8; ++i)
+                        blocks[i] = _mm_xor_si128(_mm_set_epi64x((long long)__builtin_bswap64(counter + i), nonce_half), keys[0]);
+                    for (uint32_t round=1; round < 10; ++round)
+                        for (uint32_t i=0; i < 8; ++i) blocks[i] = _mm_aesenc_si128(blocks[i], keys[round]);
+                    for (uint32_t i=0; i < 8; ++i) {
+                        blocks[i] = _mm_aesenclast_si128(blocks[i], keys[10]);
+                        auto data = _mm_loadu_si128((const __m128i*)(input + offset + 16*i));
+                        _mm_storeu_si128((__m128i*)(output + offset + 16*i), _mm_xor_si128(blocks[i], data));
+                    }
+                }
+                for (; offset < size; offset += 16, ++counter) {
+                    __m128i block = _mm_xor_si128(_mm_set_epi64x((long long)__builtin_bswap64(counter), nonce_half), keys[0]);
+                    for (uint32_t round=1; round < 10; ++round) block = _mm_aesenc_si128(block, keys[round]);
+                    block = _mm_aesenclast_si128(block, keys[10]);
+
+                    alignas(16) uint8_t keystream[16];
+                    _mm_store_si128((__m128i*)keystream, block);
+                    uint64_t length = std::min<uint64_t>(16, size - offset);
+                    for (uint64_t i=0; i < length; ++i) output[offset + i] = input[offset + i] ^ keystream[i];
+                    wipe(keystream, 16);
+                }
+            }
+#elif defined(AES_ARMV8)
+            bool cpu_has_aes() {
+                return getauxval(AT_HWCAP) & HWCAP_AES;
+            }
+
+#if defined(__clang__)
+            __attribute__((target("aes")))
+#else
+            __attribute__((target("+crypto")))
+#endif
+            void ctr_xor_hardware(const KeySchedule& schedule, uint64_t nonce, uint64_t counter,
+                                  const uint8_t input[], uint8_t output[], uint64_t size) {
+                uint8x16_t keys[11];
+                for (uint32_t i=0; i < 11; ++i) keys[i] = vld1q_u8(schedule.round_keys[i]);
+                uint8_t counter_block[16];
+                store_big_endian(counter_block, nonce);
+
+                uint64_t offset = 0;
+                // 8 blocks at once, so the rounds of one block don't wait for the ones of another
+                for (; size - offset >= 128; offset += 128, counter += 8) {
+                    uint8x16_t blocks[8];
+                    for (uint32_t i=0; i < 8; ++i) {
+                        store_big_endian(counter_block + 8, counter + i);
+                        blocks[i] = vld1q_u8(counter_block);
+                    }
+                    // aese adds the round key before substituting, so the last one is added separately
+                    for (uint32_t round=0; round < 9; ++round)
+                        for (uint32_t i=0; i < 8; ++i) blocks[i] = vaesmcq_u8(vaeseq_u8(blocks[i], keys[round]));
+                    for (uint32_t i=0; i < 8; ++i) {
+                        blocks[i] = veorq_u8(vaeseq_u8(blocks[i], keys[9]), keys[10]);
+                        vst1q_u8(output + offset + 16*i, veorq_u8(blocks[i], vld1q_u8(input + offset + 16*i)));
+                    }
+                }
+                for (; offset < size; offset += 16, ++counter) {
+                    store_big_endian(counter_block + 8, counter);
+                    uint8x16_t block = vld1q_u8(counter_block);
+                    for (uint32_t round=0; round < 9; ++round) block = vaesmcq_u8(vaeseq_u8(block, keys[round]));
+                    block = veorq_u8(vaeseq_u8(block, keys[9]), keys[10]);
+
+                    uint8_t keystream[16];
+                    vst1q_u8(keystream, block);
+                    uint64_t length = std::min<uint64_t>(16, size - offset);
+                    for (uint64_t i=0; i < length; ++i) output[offset + i] = input[offset + i] ^ keystream[i];
+                    wipe(keystream, 16);
+                }
+            }
+#else
+            bool cpu_has_aes() {
+                return false;
+            }
+
+            void ctr_xor_hardware(const KeySchedule& schedule, uint64_t nonce, uint64_t counter,
+                                  const uint8_t input[], uint8_t output[], uint64_t size) {
+                ctr_xor_portable(schedule, nonce, counter, input, output, size);
+            }
+#endif
+        }
+
+
+        void expand_key(const uint8_t key[], KeySchedule& schedule) {
+            uint8_t* words = &schedule.round_keys[0][0];
+            std::memcpy(words, key, key_size);
+
+            uint8_t round_constant = 1;
+            for (uint32_t i=key_size; i < sizeof(schedule.round_keys); i += 4) {
+                uint8_t word[8] = { words[i-4], words[i-3], words[i-2], words[i-1] };
+                if (i % key_size == 0) {    // rotated, substituted, and round constant added
+                    uint8_t rotated[8] = { word[1], word[2], word[3], word[0] };
+                    uint64_t bytes;
+                    std::memcpy(&bytes, rotated, 8);
+                    bytes = sub_bytes(bytes);
+                    std::memcpy(word, &bytes, 8);
+                    word[0] ^= round_constant;
+                    round_constant = xtime(round_constant);
+                }
+                for (uint32_t j=0; j < 4; ++j) words[i + j] = words[i - key_size + j] ^ word[j];
+            }
+        }
+
+
+        void ctr_xor(const KeySchedule& schedule, uint64_t nonce, uint64_t first_counter,
+                     const uint8_t input[], uint8_t output[], uint64_t size) {
+            if (hardware_accelerated()) ctr_xor_hardware(schedule, nonce, first_counter, input, output, size);
+            else ctr_xor_portable(schedule, nonce, first_counter, input, output, size);
+        }
+
+
+        bool hardware_accelerated() {
+            static const bool has_aes = cpu_has_aes();
+            return has_aes;
+        }
+
+
+        void encrypt(uint8_t*& plaintext, uint64_t& plaintext_size, uint8_t key[], [[maybe_unused]] uint32_t key_size,
+                     uint8_t iv_arr[], uint32_t iv_size) {
+            assert(key_size == AES128::key_size and iv_size == AES128::iv_size);
+            KeySchedule schedule;
+            expand_key(key, schedule);
+
+            auto ciphertext = new uint8_t[iv_size + plaintext_size];
+            std::memcpy(ciphertext, iv_arr, iv_size);
+            ctr_xor(schedule, load_big_endian(iv_arr), load_big_endian(iv_arr + 8), plaintext, ciphertext + iv_size,
+                    plaintext_size);
+            wipe(&schedule, sizeof(schedule));
+
+            wipe(plaintext, plaintext_size);
+            delete[] plaintext;
+            plaintext = ciphertext;
+            plaintext_size += iv_size;
+        }
+
+
+        void decrypt(uint8_t*& ciphertext, uint64_t& ciphertext_size, uint8_t key[], [[maybe_unused]] uint32_t key_size) {
+            assert(key_size == AES128::key_size and ciphertext_size >= iv_size);
+            KeySchedule schedule;
+            expand_key(key, schedule);
+
+            auto plaintext = new uint8_t[ciphertext_size - iv_size];
+            ctr_xor(schedule, load_big_endian(ciphertext), load_big_endian(ciphertext + 8), ciphertext + iv_size,
+                    plaintext, ciphertext_size - iv_size);
+            wipe(&schedule, sizeof(schedule));
+
+            delete[] ciphertext;
+            ciphertext = plaintext;
+            ciphertext_size -= iv_size;
+        }
+
+
+        void generate_metadata(uint8_t pwkey[], uint64_t pwkey_size, uint8_t salt[], uint32_t salt_size,
+                               uint64_t PBKDF2_iterations, uint8_t random_key[], uint32_t random_key_size,
+                               uint8_t*& output, uint32_t& output_size, std::mt19937& gen, bool& aborting_var,
+                               cipher data_cipher) {
+            assert(pwkey_size == key_size and salt_size == PBKDF2::saltSize and random_key_size == key_size);
+            assert(PBKDF2_iterations <= UINT32_MAX);
+            output_size = metadata_size;
+            output = new uint8_t[metadata_size];
+
+            std::memcpy(output, salt, salt_size);
+            for (uint32_t i=0; i < 4; ++i) output[salt_size + i] = (PBKDF2_iterations >> (i * 8u)) & 0xFFu;
+            for (uint32_t i=0; i < 4; ++i) output[salt_size + 4 + i] = ((uint32_t)data_cipher >> (i * 8u)) & 0xFFu;
+
+            uint8_t iv[iv_size];
+            PRNG::fill_with_random_data(iv, iv_size, gen);
+            uint64_t wrapped_size = random_key_size;
+            auto wrapped = new uint8_t[wrapped_size];
+            std::memcpy(wrapped, random_key, random_key_size);
+            encrypt(wrapped, wrapped_size, pwkey, pwkey_size, iv, iv_size);
+            std::memcpy(output + salt_size + 8, wrapped, wrapped_size);
+            delete[] wrapped;
+
+            std::string mac = HMAC::SHA256(random_key, random_key_size, pwkey, pwkey_size, aborting_var);
+            std::memcpy(output + salt_size + 8 + iv_size + key_size, mac.data(), mac.size());
+        }
+
+
+        cipher cipher_of(const uint8_t metadata[], uint32_t metadata_size) {
+            if (metadata == nullptr or metadata_size != AES128::metadata_size) return AES_128_CTR;
+            uint32_t value = 0;
+            for (uint32_t i=0; i < 4; ++i) value |= (uint32_t)metadata[PBKDF2::saltSize + 4 + i] << (i * 8u);
+            return (cipher)value;
+        }
+
+
+        uint32_t iterations_of(const uint8_t metadata[], uint32_t metadata_size) {
+            if (metadata == nullptr or metadata_size != AES128::metadata_size) return 0;
+            uint32_t value = 0;
+            for (uint32_t i=0; i < 4; ++i) value |= (uint32_t)metadata[PBKDF2::saltSize + i] << (i * 8u);
+            return value;
+        }
+
+
+        bool extract_random_key(uint8_t *pwkey, uint32_t pwkey_size, uint8_t *metadata, uint32_t metadata_size,
+                                uint8_t random_key[], bool& aborting_var) {
+            if (metadata_size != AES128::metadata_size or pwkey_size != key_size) return false;
+            const uint32_t wrapped_at = PBKDF2::saltSize + 8;
+            const uint32_t mac_at = wrapped_at + iv_size + key_size;
+
+            uint64_t wrapped_size = iv_size + key_size;
+            auto wrapped = new uint8_t[wrapped_size];
+            std::memcpy(wrapped, metadata + wrapped_at, wrapped_size);
+            decrypt(wrapped, wrapped_size, pwkey, pwkey_size);
+
+            // compared all the way through, so time doesn't tell how much of it matched
+            std::string mac = HMAC::SHA256(wrapped, key_size, pwkey, pwkey_size, aborting_var);
+            uint8_t difference = 0;
+            for (uint32_t i=0; i < mac.size(); ++i) difference |= (uint8_t)mac[i] ^ metadata[mac_at + i];
+
+            bool matches = difference == 0 and !mac.empty();   // it's empty if aborted
+            if (matches) std::memcpy(random_key, wrapped, key_size);
+            wipe(wrapped, key_size);
+            delete[] wrapped;
+            return matches and !aborting_var;
+        }
+
+
+        bool verify_password_key(uint8_t *pwkey, uint32_t pwkey_size, uint8_t *metadata,
+                                 uint32_t metadata_size, bool& aborting_var) {
+            uint8_t random_key[key_size];
+            bool matches = extract_random_key(pwkey, pwkey_size, metadata, metadata_size, random_key, aborting_var);
+            wipe(random_key, key_size);
+            return matches;
+        }
+    }
+
+    namespace ChaCha20Poly1305
+    {
+        namespace {
+            uint32_t load_little_endian32(const uint8_t buffer[]) {
+                return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+            }
+
+            uint64_t load_little_endian64(const uint8_t buffer[]) {
+                return load_little_endian32(buffer) | ((uint64_t)load_little_endian32(buffer + 4) << 32);
+            }
+
+            void store_little_endian64(uint8_t buffer[], uint64_t value) {
+                for (uint32_t i=0; i < 8; ++i) buffer[i] = (value >> (i * 8u)) & 0xFFu;
+            }
+
+            // Words of ChaCha20's input block, counter is word 12
+            void initial_state(const uint8_t key[], const uint8_t nonce[], uint32_t counter, uint32_t state[]) {
+                const uint32_t constants[4] = { 0x61707865, 0x3320646e, 0x79622d32, 0x6b206574 };   // "expand 32-byte k"
+                for (uint32_t i=0; i < 4; ++i) state[i] = constants[i];
+                for (uint32_t i=0; i < 8; ++i) state[4 + i] = load_little_endian32(key + 4*i);
+                state[12] = counter;
+                for (uint32_t i=0; i < 3; ++i) state[13 + i] = load_little_endian32(nonce + 4*i);
+            }
+
+// Every kernel defines ADD, XOR and ROTATE for whatever its words are
+#define CHACHA_QUARTER_ROUND(a, b, c, d) \
+            a = ADD(a, b); d = ROTATE(XOR(d, a), 16); \
+            c = ADD(c, d); b = ROTATE(XOR(b, c), 12); \
+            a = ADD(a, b); d = ROTATE(XOR(d, a), 8); \
+            c = ADD(c, d); b = ROTATE(XOR(b, c), 7);
+
+#define CHACHA_DOUBLE_ROUND(x) \
+            CHACHA_QUARTER_ROUND(x[0], x[4], x[8], x[12]) \
+            CHACHA_QUARTER_ROUND(x[1], x[5], x[9], x[13]) \
+            CHACHA_QUARTER_ROUND(x[2], x[6], x[10], x[14]) \
+            CHACHA_QUARTER_ROUND(x[3], x[7], x[11], x[15]) \
+            CHACHA_QUARTER_ROUND(x[0], x[5], x[10], x[15]) \
+            CHACHA_QUARTER_ROUND(x[1], x[6], x[11], x[12]) \
+            CHACHA_QUARTER_ROUND(x[2], x[7], x[8], x[13]) \
+            CHACHA_QUARTER_ROUND(x[3], x[4], x[9], x[14])
+
+#define ADD(a, b) ((a) + (b))
+#define XOR(a, b) ((a) ^ (b))
+#define ROTATE(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+            void block_portable(const uint32_t state[], uint8_t keystream[]) {
+                uint32_t x[16];
+                for (uint32_t i=0; i < 16; ++i) x[i] = state[i];
+                for (uint32_t round=0; round < 10; ++round) { CHACHA_DOUBLE_ROUND(x) }
+                for (uint32_t i=0; i < 16; ++i) {
+                    uint32_t word = x[i] + state[i];
+                    for (uint32_t j=0; j < 4; ++j) keystream[4*i + j] = (word >> (j * 8u)) & 0xFFu;
+                }
+                wipe(x, sizeof(x));
+            }
+#undef ADD
+#undef XOR
+#undef ROTATE
+
+            // Kernels below XOR as many whole groups of blocks as size has, starting at state's counter, and return
+            // number of bytes they did. Words are kept across blocks: lane i of every vector belongs to block i
+
+#if defined(__x86_64__) || defined(__i386__)
+            template <int n> __attribute__((target("sse2"), always_inline))
+            inline __m128i rotate_sse2(__m128i v) {
+                if constexpr (n == 16) return _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xB1), 0xB1);
+                else return _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - n));
+            }
+
+#define ADD(a, b) _mm_add_epi32(a, b)
+#define XOR(a, b) _mm_xor_si128(a, b)
+#define ROTATE(v, n) rotate_sse2<n>(v)
+            __attribute__((target("sse2")))
+            uint64_t xor_blocks_sse2(const uint32_t state[], const uint8_t input[], uint8_t output[], uint64_t size) {
+                uint64_t done = 0;
+                for (; size - done >= 256; done += 256) {
+                    __m128i original[16];
+                    __m128i x[16];
+                    for (uint32_t i=0; i < 16; ++i) original[i] = _mm_set1_epi32(state[i]);
+                    original[12] = _mm_add_epi32(_mm_set1_epi32(state[12] + done / 64), _mm_set_epi32(3, 2, 1, 0));
+                    for (uint32_t i=0; i < 16; ++i) x[i] = original[i];
+
+                    for (uint32_t round=0; round < 10; ++round) { CHACHA_DOUBLE_ROUND(x) }
+
+                    // 4x4 transposes turn lanes back into blocks, 16 bytes of each at a time
+                    for (uint32_t i=0; i < 16; ++i) x[i] = _mm_add_epi32(x[i], original[i]);
+                    for (uint32_t group=0; group < 4; ++group) {
+                        __m128i* words = x + 4*group;
+                        __m128i low01 = _mm_unpacklo_epi32(words[0], words[1]);
+                        __m128i low23 = _mm_unpacklo_epi32(words[2], words[3]);
+                        __m128i high01 = _mm_unpackhi_epi32(words[0], words[1]);
+                        __m128i high23 = _mm_unpackhi_epi32(words[2], words[3]);
+                        __m128i blocks[4] = { _mm_unpacklo_epi64(low01, low23), _mm_unpackhi_epi64(low01, low23),
+                                              _mm_unpacklo_epi64(high01, high23), _mm_unpackhi_epi64(high01, high23) };
+                        for (uint32_t block=0; block < 4; ++block) {
+                            uint64_t at = done + 64*block + 16*group;
+                            __m128i data = _mm_loadu_si128((const __m128i*)(input + at));
+                            _mm_storeu_si128((__m128i*)(output + at), _mm_xor_si128(data, blocks[block]));
+                        }
+                    }
+                }
+                return done;
+            }
+#undef ADD
+#undef XOR
+#undef ROTATE
+
+            template <int n> __attribute__((target("avx2"), always_inline))
+            inline __m256i rotate_avx2(__m256i v) {
+                if constexpr (n == 16) {
+                    const __m256i bytes = _mm256_set_epi8(13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2,
+                                                          13, 12, 15, 14, 9, 8, 11, 10, 5, 4, 7, 6, 1, 0, 3, 2);
+                    return _mm256_shuffle_epi8(v, bytes);
+                }
+                else if constexpr (n == 8) {
+                    const __m256i bytes = _mm256_set_epi8(14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3,
+                                                          14, 13, 12, 15, 10, 9, 8, 11, 6, 5, 4, 7, 2, 1, 0, 3);
+                    return _mm256_shuffle_epi8(v, bytes);
+                }
+                else return _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - n));
+            }
+
+#define ADD(a, b) _mm256_add_epi32(a, b)
+#define XOR(a, b) _mm256_xor_si256(a, b)
+#define ROTATE(v, n) rotate_avx2<n>(v)
+            __attribute__((target("avx2")))
+            uint64_t xor_blocks_avx2(const uint32_t state[], const uint8_t input[], uint8_t output[], uint64_t size) {
+                uint64_t done = 0;
+                for (; size - done >= 512; done += 512) {
+                    __m256i original[16];
+                    __m256i x[16];
+                    for (uint32_t i=0; i < 16; ++i) original[i] = _mm256_set1_epi32(state[i]);
+                    original[12] = _mm256_add_epi32(_mm256_set1_epi32(state[12] + done / 64),
+                                                    _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+                    for (uint32_t i=0; i < 16; ++i) x[i] = original[i];
+
+                    for (uint32_t round=0; round < 10; ++round) { CHACHA_DOUBLE_ROUND(x) }
+
+                    // unpacks work within 128-bit halves, so lower halves end up with blocks 0-3, upper with 4-7
+                    for (uint32_t i=0; i < 16; ++i) x[i] = _mm256_add_epi32(x[i], original[i]);
+                    for (uint32_t group=0; group < 4; ++group) {
+                        __m256i* words = x + 4*group;
+                        __m256i low01 = _mm256_unpacklo_epi32(words[0], words[1]);
+                        __m256i low23 = _mm256_unpacklo_epi32(words[2], words[3]);
+                        __m256i high01 = _mm256_unpackhi_epi32(words[0], words[1]);
+                        __m256i high23 = _mm256_unpackhi_epi32(words[2], words[3]);
+                        __m256i blocks[4] = { _mm256_unpacklo_epi64(low01, low23), _mm256_unpackhi_epi64(low01, low23),
+                                              _mm256_unpacklo_epi64(high01, high23), _mm256_unpackhi_epi64(high01, high23) };
+                        for (uint32_t block=0; block < 4; ++block) {
+                            uint64_t at = done + 64*block + 16*group;
+                            __m128i data = _mm_loadu_si128((const __m128i*)(input + at));
+                            _mm_storeu_si128((__m128i*)(output + at), _mm_xor_si128(data, _mm256_castsi256_si128(blocks[block])));
+                            data = _mm_loadu_si128((const __m128i*)(input + at + 256));
+                            _mm_storeu_si128((__m128i*)(output + at + 256), _mm_xor_si128(data, _mm256_extracti128_si256(blocks[block], 1)));
+                        }
+                    }
+                }
+                return done;
+            }
+#undef ADD
+#undef XOR
+#undef ROTATE
+
+            uint64_t xor_blocks_simd(const uint32_t state[], const uint8_t input[], uint8_t output[], uint64_t size) {
+                static const bool has_avx2 = __builtin_cpu_supports("avx2");
+                uint64_t done = has_avx2 ? xor_blocks_avx2(state, input, output, size) : 0;
+
+                uint32_t rest[16];
+                std::memcpy(rest, state, sizeof(rest));
+                rest[12] += done / 64;
+                done += xor_blocks_sse2(rest, input + done, output + done, size - done);
+                wipe(rest, sizeof(rest));
+                return done;
+            }
+#elif defined(__aarch64__) || defined(__ARM_NEON)
+            template <int n>
+            inline uint32x4_t rotate_neon(uint32x4_t v) {
+                if constexpr (n == 16) return vreinterpretq_u32_u16(vrev32q_u16(vreinterpretq_u16_u32(v)));
+                else return vsriq_n_u32(vshlq_n_u32(v, n), v, 32 - n);
+            }
+
+#define ADD(a, b) vaddq_u32(a, b)
+#define XOR(a, b) veorq_u32(a, b)
+#define ROTATE(v, n) rotate_neon<n>(v)
+            uint64_t xor_blocks_simd(const uint32_t state[], const uint8_t input[], uint8_t output[], uint64_t size) {
+                const uint32_t lanes[4] = { 0, 1, 2, 3 };
+                uint64_t done = 0;
+                for (; size - done >= 256; done += 256) {
+                    uint32x4_t original[16];
+                    uint32x4_t x[16];
+                    for (uint32_t i=0; i < 16; ++i) original[i] = vdupq_n_u32(state[i]);
+                    original[12] = vaddq_u32(vdupq_n_u32(state[12] + done / 64), vld1q_u32(lanes));
+                    for (uint32_t i=0; i < 16; ++i) x[i] = original[i];
+
+                    for (uint32_t round=0; round < 10; ++round) { CHACHA_DOUBLE_ROUND(x) }
+
+                    // 4x4 transposes turn lanes back into blocks, 16 bytes of each at a time
+                    for (uint32_t i=0; i < 16; ++i) x[i] = vaddq_u32(x[i], original[i]);
+                    for (uint32_t group=0; group < 4; ++group) {
+                        uint32x4_t* words = x + 4*group;
+                        uint32x4x2_t pairs01 = vtrnq_u32(words[0], words[1]);
+                        uint32x4x2_t pairs23 = vtrnq_u32(words[2], words[3]);
+                        uint32x4_t blocks[4] = {
+                                vcombine_u32(vget_low_u32(pairs01.val[0]), vget_low_u32(pairs23.val[0])),
+                                vcombine_u32(vget_low_u32(pairs01.val[1]), vget_low_u32(pairs23.val[1])),
+                                vcombine_u32(vget_high_u32(pairs01.val[0]), vget_high_u32(pairs23.val[0])),
+                                vcombine_u32(vget_high_u32(pairs01.val[1]), vget_high_u32(pairs23.val[1])) };
+                        for (uint32_t block=0; block < 4; ++block) {
+                            uint64_t at = done + 64*block + 16*group;
+                            uint8x16_t data = vld1q_u8(input + at);
+                            vst1q_u8(output + at, veorq_u8(data, vreinterpretq_u8_u32(blocks[block])));
+                        }
+                    }
+                }
+                return done;
+            }
+#undef ADD
+#undef XOR
+#undef ROTATE
+#else
+            uint64_t xor_blocks_simd(const uint32_t[], const uint8_t[], uint8_t[], uint64_t) {
+                return 0;
+            }
+#endif
+#undef CHACHA_QUARTER_ROUND
+#undef CHACHA_DOUBLE_ROUND
+
+            void chacha20_xor(const uint8_t key[], const uint8_t nonce[], uint32_t counter,
+                              const uint8_t input[], uint8_t output[], uint64_t size) {
+                uint32_t state[16];
+                initial_state(key, nonce, counter, state);
+                uint64_t done = xor_blocks_simd(state, input, output, size);
+                state[12] += done / 64;
+
+                uint8_t keystream[64];
+                for (; done < size; done += 64, ++state[12]) {
+                    block_portable(state, keystream);
+                    uint64_t length = std::min<uint64_t>(64, size - done);
+                    for (uint64_t i=0; i < length; ++i) output[done + i] = input[done + i] ^ keystream[i];
+                }
+                wipe(state, sizeof(state));
+                wipe(keystream, sizeof(keystream));
+            }
+
+            // Poly1305 with 44, 44 and 42 bit limbs, multiplied in 128 bits
+            class Poly1305 {
+            public:
+                explicit Poly1305(const uint8_t key[]) {
+                    uint64_t t0 = load_little_endian64(key);
+                    uint64_t t1 = load_little_endian64(key + 8);
+                    // r is clamped as it's loaded
+                    r[0] = t0 & 0xFFC0FFFFFFFull;
+                    r[1] = ((t0 >> 44) | (t1 << 20)) & 0xFFFFFC0FFFFull;
+                    r[2] = (t1 >> 24) & 0x00FFFFFFC0Full;
+                    pad[0] = load_little_endian64(key + 16);
+                    pad[1] = load_little_endian64(key + 24);
+                }
+
+                ~Poly1305() {
+                    wipe(r, sizeof(r));
+                    wipe(pad, sizeof(pad));
+                    wipe(h, sizeof(h));
+                }
+
+                // Adds data, and zeroes up to a multiple of 16 bytes (as AEAD construction pads it)
+                void update_padded(const uint8_t data[], uint64_t size) {
+                    uint64_t whole = size - size % 16;
+                    blocks(data, whole);
+                    if (whole == size) return;
+
+                    uint8_t last[16] = {};
+                    std::memcpy(last, data + whole, size - whole);
+                    blocks(last, 16);
+                }
+
+                void finish(uint8_t tag[]) {
+                    const uint64_t mask44 = 0xFFFFFFFFFFFull;
+                    const uint64_t mask42 = 0x3FFFFFFFFFFull;
+                    uint64_t c;
+                    c = h[1] >> 44; h[1] &= mask44; h[2] += c;
+                    c = h[2] >> 42; h[2] &= mask42; h[0] += c * 5;
+                    c = h[0] >> 44; h[0] &= mask44; h[1] += c;
+                    c = h[1] >> 44; h[1] &= mask44; h[2] += c;
+                    c = h[2] >> 42; h[2] &= mask42; h[0] += c * 5;
+                    c = h[0] >> 44; h[0] &= mask44; h[1] += c;
+
+                    // h - p is taken instead of h if it doesn't go below zero, without branching on which one it is
+                    uint64_t g0 = h[0] + 5; c = g0 >> 44; g0 &= mask44;
+                    uint64_t g1 = h[1] + c; c = g1 >> 44; g1 &= mask44;
+                    uint64_t g2 = h[2] + c - (1ull << 42);
+                    c = (g2 >> 63) - 1;
+                    h[0] = (h[0] & ~c) | (g0 & c);
+                    h[1] = (h[1] & ~c) | (g1 & c);
+                    h[2] = (h[2] & ~c) | (g2 & c);
+
+                    h[0] += pad[0] & mask44; c = h[0] >> 44; h[0] &= mask44;
+                    h[1] += (((pad[0] >> 44) | (pad[1] << 20)) & mask44) + c; c = h[1] >> 44; h[1] &= mask44;
+                    h[2] += ((pad[1] >> 24) & mask42) + c; h[2] &= mask42;
+
+                    store_little_endian64(tag, h[0] | (h[1] << 44));
+                    store_little_endian64(tag + 8, (h[1] >> 20) | (h[2] << 24));
+                }
+
+            private:
+                uint64_t r[3];
+                uint64_t pad[2];
+                uint64_t h[3] = {};
+
+                void blocks(const uint8_t data[], uint64_t size) {
+                    const uint64_t mask44 = 0xFFFFFFFFFFFull;
+                    const uint64_t mask42 = 0x3FFFFFFFFFFull;
+                    const uint64_t s1 = r[1] * (5 << 2);
+                    const uint64_t s2 = r[2] * (5 << 2);
+                    for (uint64_t offset=0; offset < size; offset += 16) {
+                        uint64_t t0 = load_little_endian64(data + offset);
+                        uint64_t t1 = load_little_endian64(data + offset + 8);
+                        h[0] += t0 & mask44;
+                        h[1] += ((t0 >> 44) | (t1 << 20)) & mask44;
+                        h[2] += ((t1 >> 24) & mask42) | (1ull << 40);     // 2^128 of every block
+
+                        unsigned __int128 d0 = (unsigned __int128)h[0] * r[0] + (unsigned __int128)h[1] * s2 + (unsigned __int128)h[2] * s1;
+                        unsigned __int128 d1 = (unsigned __int128)h[0] * r[1] + (unsigned __int128)h[1] * r[0] + (unsigned __int128)h[2] * s2;
+                        unsigned __int128 d2 = (unsigned __int128)h[0] * r[2] + (unsigned __int128)h[1] * r[1] + (unsigned __int128)h[2] * r[0];
+
+                        uint64_t c = (uint64_t)(d0 >> 44); h[0] = (uint64_t)d0 & mask44;
+                        d1 += c; c = (uint64_t)(d1 >> 44); h[1] = (uint64_t)d1 & mask44;
+                        d2 += c; c = (uint64_t)(d2 >> 42); h[2] = (uint64_t)d2 & mask42;
+                        h[0] += c * 5; c = h[0] >> 44; h[0] &= mask44;
+                        h[1] += c;
+                    }
+                }
+            };
+
+            // Tag of aad and ciphertext, its one-time key is the first block of keystream
+            void compute_tag(const uint8_t key[], const uint8_t nonce[], const uint8_t aad[], uint64_t aad_size,
+                             const uint8_t ciphertext[], uint64_t size, uint8_t tag[]) {
+                uint8_t one_time_key[64] = {};
+                chacha20_xor(key, nonce, 0, one_time_key, one_time_key, sizeof(one_time_key));
+
+                Poly1305 mac(one_time_key);
+                wipe(one_time_key, sizeof(one_time_key));
+                mac.update_padded(aad, aad_size);
+                mac.update_padded(ciphertext, size);
+                uint8_t sizes[16];
+                store_little_endian64(sizes, aad_size);
+                store_little_endian64(sizes + 8, size);
+                mac.update_padded(sizes, sizeof(sizes));
+                mac.finish(tag);
+            }
+        }
+
+
+        void seal(const uint8_t key[], const uint8_t nonce[], const uint8_t aad[], uint64_t aad_size,
+                  const uint8_t input[], uint8_t output[], uint64_t size, uint8_t tag[]) {
+            chacha20_xor(key, nonce, 1, input, output, size);
+            compute_tag(key, nonce, aad, aad_size, output, size, tag);
+        }
+
+
+        bool open(const uint8_t key[], const uint8_t nonce[], const uint8_t aad[], uint64_t aad_size,
+                  const uint8_t input[], uint8_t output[], uint64_t size, const uint8_t tag[]) {
+            uint8_t expected[tag_size];
+            compute_tag(key, nonce, aad, aad_size, input, size, expected);
+
+            // compared all the way through, so time doesn't tell how much of it matched
+            uint8_t difference = 0;
+            for (uint32_t i=0; i < tag_size; ++i) difference |= expected[i] ^ tag[i];
+            if (difference != 0) return false;
+
+            chacha20_xor(key, nonce, 1, input, output, size);
+            return true;
+        }
+
+
+        void block_nonce(uint32_t part_id, uint8_t nonce[]) {
+            std::memset(nonce, 0, nonce_size);
+            for (uint32_t i=0; i < 4; ++i) nonce[i] = (part_id >> (i * 8u)) & 0xFFu;
+        }
+
+
+        void derive_key(uint8_t random_key[], uint32_t random_key_size, uint8_t key[], bool& aborting_var) {
+            std::string label = "ChaCha20-Poly1305";
+            std::string derived = HMAC::SHA256((uint8_t*)label.data(), label.size(), random_key, random_key_size,
+                                               aborting_var);
+            if (derived.size() != key_size) return;     // aborted
+            std::memcpy(key, derived.data(), key_size);
+            wipe(derived.data(), derived.size());
+        }
+    }
+
     namespace PRNG
     {
         void fill_with_random_data(uint8_t arr[], int64_t arr_size, std::mt19937& gen, int64_t start, int64_t stop)
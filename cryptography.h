@@ -4,10 +4,14 @@
 
 #include <string>
 #include <random>
+#include <cstdint>
 
 
 namespace crypto {
 
+    // Ciphers file's data can be encrypted with, their values are the ones stored in encryption metadata
+    enum cipher : uint32_t { AES_128_CTR = 1, ChaCha20_Poly1305 = 2 };
+
     namespace HMAC {
 
         // HMAC-SHA256
@@ -27,21 +31,81 @@ namespace crypto {
     namespace AES128 // CTR mode
     {
         const uint32_t key_size = 16;
+        const uint32_t iv_size = 16;
         const uint32_t metadata_size = 88;
 
+        // Round keys, expanded once per key
+        struct KeySchedule {
+            alignas(16) uint8_t round_keys[11][16];
+        };
+
+        void expand_key(const uint8_t key[], KeySchedule& schedule);
+
+        // XORs input with keystream of counter blocks [nonce 8B][counter 8B] (both big-endian) into output, counter
+        // going up by one every 16 bytes, so it both encrypts and decrypts. input and output may be the same.
+        // Runs on AES-NI or ARMv8 AES (8 blocks at a time) if CPU has them, otherwise on a slower, table-free
+        // implementation, which is constant-time as well
+        void ctr_xor(const KeySchedule& schedule, uint64_t nonce, uint64_t first_counter,
+                     const uint8_t input[], uint8_t output[], uint64_t size);
+
+        // True if ctr_xor runs on AES instructions of the CPU
+        bool hardware_accelerated();
+
+        // First counter of file's block, so every block can be encrypted on its own, by whichever worker gets it.
+        // Blocks are never longer than 2^32 counters (64 GiB)
+        inline uint64_t block_counter(uint32_t part_id) { return (uint64_t)part_id << 32; }
+
+        // Metadata is [salt 16B][PBKDF2 iterations 4B][cipher 4B][iv 16B][random key encrypted with password's key 16B]
+        // [HMAC-SHA256 of random key, with password's key 32B]. Whatever the cipher is, the random key is wrapped with
+        // AES, so metadata is always the same size. output is allocated here
         void generate_metadata(uint8_t pwkey[], uint64_t pwkey_size, uint8_t salt[], uint32_t salt_size,
                                uint64_t PBKDF2_iterations, uint8_t random_key[], uint32_t random_key_size,
-                               uint8_t*& output, uint32_t& output_size, std::mt19937& gen, bool& aborting_var);
+                               uint8_t*& output, uint32_t& output_size, std::mt19937& gen, bool& aborting_var,
+                               cipher data_cipher = AES_128_CTR);
+
+        // Cipher of file's data, from its metadata
+        cipher cipher_of(const uint8_t metadata[], uint32_t metadata_size);
+
+        // PBKDF2 iterations of password's key, from file's metadata (salt is at its start)
+        uint32_t iterations_of(const uint8_t metadata[], uint32_t metadata_size);
 
         bool verify_password_key(uint8_t *pwkey, uint32_t pwkey_size, uint8_t *metadata,
                                  uint32_t metadata_size, bool& aborting_var);
 
+        // Random key out of metadata, returns false if password's key doesn't match it
+        bool extract_random_key(uint8_t *pwkey, uint32_t pwkey_size, uint8_t *metadata, uint32_t metadata_size,
+                                uint8_t random_key[], bool& aborting_var);
+
+        // Replaces plaintext with [iv][ciphertext], iv being the first counter block
         void encrypt(uint8_t*& plaintext, uint64_t& plaintext_size, uint8_t key[], uint32_t key_size,
                      uint8_t iv_arr[], uint32_t iv_size);
 
+        // Reverses encrypt
         void decrypt(uint8_t*& ciphertext, uint64_t& ciphertext_size, uint8_t key[], uint32_t key_size );
     }
 
+    namespace ChaCha20Poly1305 // RFC 8439
+    {
+        const uint32_t key_size = 32;
+        const uint32_t nonce_size = 12;
+        const uint32_t tag_size = 16;
+
+        // Encrypts input into output (which may be the same), and computes tag of aad and the ciphertext.
+        // ChaCha20 runs on AVX2 (8 blocks at a time), SSE2 or NEON (4 blocks at a time), whichever CPU has
+        void seal(const uint8_t key[], const uint8_t nonce[], const uint8_t aad[], uint64_t aad_size,
+                  const uint8_t input[], uint8_t output[], uint64_t size, uint8_t tag[]);
+
+        // Checks the tag first, and decrypts input only if it matches. Returns false if it doesn't
+        bool open(const uint8_t key[], const uint8_t nonce[], const uint8_t aad[], uint64_t aad_size,
+                  const uint8_t input[], uint8_t output[], uint64_t size, const uint8_t tag[]);
+
+        // Nonce of file's block, so every block is sealed on its own, and can't be swapped with another one
+        void block_nonce(uint32_t part_id, uint8_t nonce[]);
+
+        // Key of file's data, derived from the random key stored in its metadata
+        void derive_key(uint8_t random_key[], uint32_t random_key_size, uint8_t key[], bool& aborting_var);
+    }
+
     namespace PRNG
     {
         void fill_with_random_data(uint8_t arr[], int64_t arr_size, std::mt19937& gen, int64_t start=0, int64_t stop=-1);
@@ -0,0 +1,445 @@
+#include "delta.h"
+
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+#include "header_record.h"
+#include "misc/mapped_file.h"
+#include "misc/thread_pool.h"
+#include "misc/multithreading.h"
+
+
+namespace {
+    constexpr uint64_t literal = UINT64_MAX;
+
+    // Adler-like checksum of a window, which can be moved by a byte in constant time
+    struct RollingHash {
+        uint32_t a = 0;
+        uint32_t b = 0;
+
+        void reset(const uint8_t* data, uint32_t length) {
+            a = b = 0;
+            for (uint32_t i=0; i < length; ++i) {
+                a += data[i];
+                b += (length - i) * data[i];
+            }
+        }
+
+        void roll(uint8_t out, uint8_t in, uint32_t length) {
+            a += in - out;
+            b += a - length * out;
+        }
+
+        uint32_t value() const { return (a & 0xFFFFu) | (b << 16); }
+    };
+
+    // Tells chunks with the same rolling hash apart
+    uint64_t strong_hash(const uint8_t* data, uint32_t length) {
+        uint64_t hash = 0x243F6A8885A308D3ull ^ length;
+        uint32_t i = 0;
+        for (; i + 8 <= length; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, data + i, 8);
+            hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+            hash ^= hash >> 29;
+        }
+        for (; i < length; ++i) hash = (hash ^ data[i]) * 0x9E3779B97F4A7C15ull;
+        return hash ^ (hash >> 32);
+    }
+
+    File file_of(const delta::Base& base) {
+        File file;
+        file.data_location = base.data_location;
+        file.compressed_size = base.compressed_size;
+        file.original_size = base.original_size;
+        file.flags_value = base.flags;
+        file.alreadySaved = true;
+        return file;
+    }
+
+    bool decode_in_parallel(File& file, std::vector<std::unique_ptr<Compression>>& comps,
+                            const std::vector<uint32_t>& blocks, std::vector<std::string>& decoded, bool& aborting_var) {
+        decoded.assign(blocks.size(), {});
+        std::atomic<bool> successful = true;
+        auto decode = [&](uint64_t i) {
+            if (!file.decode_block(blocks[i], *comps[i], aborting_var)) successful = false;
+            else decoded[i].assign((const char*)comps[i]->text, comps[i]->size);
+            comps[i] = nullptr;
+        };
+
+        if (blocks.size() == 1) decode(0);
+        else {
+            ThreadPool pool(std::min<uint64_t>(blocks.size(), std::max(1u, std::thread::hardware_concurrency())));
+            for (uint64_t i=0; i < blocks.size(); ++i) pool.submit([&decode, i]() { decode(i); });
+            pool.wait();
+        }
+        return successful and !aborting_var;
+    }
+}
+
+
+uint64_t delta::Base::span() const {
+    return compressed_size + multithreading::checksum_length(flags);
+}
+
+
+bool delta::is_delta(uint16_t flags) {
+    return (flags >> flag) & 1u;
+}
+
+
+delta::Base delta::base_of(const File& file) {
+    return { file.data_location, file.compressed_size, file.original_size, file.flags_value };
+}
+
+
+bool delta::read_base(const PositionalFile& archive_io, uint64_t data_location, Base& base) {
+    uint8_t prefix[prefix_size];
+    if (archive_io.read_at(prefix, prefix_size, data_location) != prefix_size) return false;
+    base.data_location = little_endian::load(prefix, 8);
+    base.compressed_size = little_endian::load(prefix + 8, 8);
+    base.original_size = little_endian::load(prefix + 16, 8);
+    base.flags = little_endian::load(prefix + 24, 2);
+    return base.data_location != 0;
+}
+
+
+bool delta::encode(const PositionalFile& archive_io, const Base& base, const std::filesystem::path& source,
+                   std::string& stream, bool& aborting_var) {
+    MappedFile source_map;
+    if (is_delta(base.flags) or base.original_size < chunk_size) return false;
+    if (!source_map.open(source, MappedFile::view::read_only)) return false;
+    source_map.advise_sequential();
+    const uint8_t* data = source_map.data();
+    uint64_t size = source_map.size();
+
+    // Signatures of every whole chunk of base. Its blocks are decoded a few at a time, on all cores
+    File base_file = file_of(base);
+    if (!base_file.load_block_index(archive_io)) return false;
+
+    std::vector<uint64_t> strong;                   // by chunk
+    std::unordered_multimap<uint32_t, uint64_t> chunks_by_hash;
+    std::vector<bool> maybe_there(1u << 20);        // most positions are ruled out without looking into the map
+    std::string pending;                            // base's bytes which don't make a whole chunk yet
+
+    uint32_t block_count = base_file.blocks.blocks.size();
+    uint32_t window = std::max(1u, std::thread::hardware_concurrency());
+    for (uint32_t first = 0; first < block_count; first += window) {
+        std::vector<uint32_t> blocks;
+        std::vector<std::unique_ptr<Compression>> comps;
+        for (uint32_t block = first; block < std::min(block_count, first + window); ++block) {
+            blocks.push_back(block);
+            comps.push_back(std::make_unique<Compression>(aborting_var));
+            if (!base_file.load_block(archive_io, block, *comps.back())) return false;
+        }
+        std::vector<std::string> decoded;
+        if (!decode_in_parallel(base_file, comps, blocks, decoded, aborting_var)) return false;
+
+        for (auto& block : decoded) {
+            pending += block;
+            uint64_t used = 0;
+            for (; pending.size() - used >= chunk_size; used += chunk_size) {
+                auto chunk = (const uint8_t*)pending.data() + used;
+                RollingHash rolling;
+                rolling.reset(chunk, chunk_size);
+                chunks_by_hash.emplace(rolling.value(), strong.size());
+                maybe_there[rolling.value() & (maybe_there.size() - 1)] = true;
+                strong.push_back(strong_hash(chunk, chunk_size));
+            }
+            pending.erase(0, used);
+        }
+    }
+
+    // Ops of source. Chunk right after the last copied one is tried first, changes are usually few and far apart
+    struct Op { uint64_t length; uint64_t base_offset; };
+    std::vector<Op> ops;
+    std::string literals;
+    auto add_literal = [&](uint64_t from, uint64_t to) {
+        if (from == to) return;
+        ops.push_back({ to - from, literal });
+        literals.append((const char*)data + from, to - from);
+    };
+    auto add_copy = [&](uint64_t chunk) {
+        uint64_t base_offset = chunk * chunk_size;
+        if (!ops.empty() and ops.back().base_offset != literal and ops.back().base_offset + ops.back().length == base_offset)
+            ops.back().length += chunk_size;
+        else ops.push_back({ chunk_size, base_offset });
+    };
+
+    uint64_t position = 0;
+    uint64_t literal_start = 0;
+    uint64_t next_chunk = 0;
+    RollingHash rolling;
+    if (size >= chunk_size) rolling.reset(data, chunk_size);
+    while (position + chunk_size <= size) {
+        if (aborting_var) return false;
+
+        uint32_t weak = rolling.value();
+        uint64_t found = literal;
+        if (maybe_there[weak & (maybe_there.size() - 1)]) {
+            uint64_t hash = strong_hash(data + position, chunk_size);
+            auto [begin, end] = chunks_by_hash.equal_range(weak);
+            for (auto it = begin; it != end; ++it) {
+                if (strong[it->second] != hash) continue;
+                found = it->second;
+                if (found == next_chunk) break;
+            }
+        }
+
+        if (found != literal) {
+            add_literal(literal_start, position);
+            add_copy(found);
+            next_chunk = found + 1;
+            position += chunk_size;
+            literal_start = position;
+            if (position + chunk_size <= size) rolling.reset(data + position, chunk_size);
+            continue;
+        }
+        if (position + chunk_size < size) rolling.roll(data[position], data[position + chunk_size], chunk_size);
+        position++;
+    }
+    add_literal(literal_start, size);
+
+    if (literals.size() > size / 2) return false;   // not worth it
+
+    stream.clear();
+    stream.reserve(8 + ops.size() * 16 + literals.size());
+    little_endian::append(stream, ops.size(), 8);
+    for (const Op& op : ops) {
+        little_endian::append(stream, op.length, 8);
+        little_endian::append(stream, op.base_offset, 8);
+    }
+    stream += literals;
+    return true;
+}
+
+
+bool delta::write(std::fstream& archive_stream, const Base& base, const std::string& stream, uint16_t flags,
+                  const std::string& checksum, uint64_t& compressed_size, bool& aborting_var) {
+    std::string prefix;
+    little_endian::append(prefix, base.data_location, 8);
+    little_endian::append(prefix, base.compressed_size, 8);
+    little_endian::append(prefix, base.original_size, 8);
+    little_endian::append(prefix, base.flags, 2);
+    little_endian::append(prefix, stream.size(), 8);
+    assert(prefix.size() == prefix_size);
+    archive_stream.write(prefix.data(), prefix.size());
+
+    // same layout processing_scribe writes: [part_id][size][payload] for every block
+    uint16_t stream_flags = flags & ~(1u << flag);
+    uint32_t block_size = BlockIndex::block_size(stream_flags, stream.size());
+    uint32_t block_count = BlockIndex::block_count(stream_flags, stream.size());
+    std::vector<std::string> blocks(block_count);
+    {
+        ThreadPool pool(std::min<uint32_t>(block_count, std::max(1u, std::thread::hardware_concurrency())));
+        for (uint32_t i=0; i < block_count; ++i) {
+            pool.submit([&, i]() {
+                uint64_t offset = (uint64_t)i * block_size;
+                Compression comp(aborting_var);
+                comp.part_id = i;
+                comp.load_text((const uint8_t*)stream.data() + offset, std::min<uint64_t>(block_size, stream.size() - offset));
+
+                bool finished = false;
+                uint8_t* key = nullptr;
+                uint8_t* metadata = nullptr;
+                uint32_t metadata_size = 0;
+                multithreading::processing_worker(multithreading::mode::compress, &comp, stream_flags, aborting_var,
+                                                  &finished, key, metadata, metadata_size);
+
+                little_endian::append(blocks[i], i, 4);
+                little_endian::append(blocks[i], comp.size, 4);
+                blocks[i].append((const char*)comp.text, comp.size);
+            });
+        }
+        pool.wait();
+    }
+    if (aborting_var) return false;
+
+    compressed_size = prefix_size;
+    for (const std::string& block : blocks) {
+        archive_stream.write(block.data(), block.size());
+        compressed_size += block.size();
+    }
+    archive_stream.write(checksum.data(), checksum.size());
+    return (bool)archive_stream;
+}
+
+
+DeltaReader::DeltaReader(const PositionalFile& archive_io, const File& file) :
+        data_location(file.data_location),
+        compressed_size(file.compressed_size),
+        original_size(file.original_size),
+        flags(file.flags_value) {
+    read_at = [&archive_io](uint64_t location, uint64_t length, uint8_t* buffer) {
+        return archive_io.read_at(buffer, length, location) == length;
+    };
+    load_index = [&archive_io](File& f) { return f.load_block_index(archive_io); };
+    load_block = [&archive_io](File& f, uint32_t block, Compression& comp) { return f.load_block(archive_io, block, comp); };
+}
+
+
+DeltaReader::DeltaReader(std::fstream& archive_stream, const File& file) :
+        data_location(file.data_location),
+        compressed_size(file.compressed_size),
+        original_size(file.original_size),
+        flags(file.flags_value) {
+    read_at = [&archive_stream](uint64_t location, uint64_t length, uint8_t* buffer) {
+        archive_stream.seekg(location);
+        archive_stream.read((char*)buffer, length);
+        if (archive_stream) return true;
+        archive_stream.clear();
+        return false;
+    };
+    load_index = [&archive_stream](File& f) { return f.load_block_index(archive_stream); };
+    load_block = [&archive_stream](File& f, uint32_t block, Compression& comp) {
+        return f.load_block(archive_stream, block, comp);
+    };
+}
+
+
+bool DeltaReader::decode_blocks(File& file, const std::vector<uint32_t>& blocks, std::vector<std::string>& decoded,
+                                bool& aborting_var) {
+    std::vector<std::unique_ptr<Compression>> comps;
+    for (uint32_t block : blocks) {
+        comps.push_back(std::make_unique<Compression>(aborting_var));
+        if (!load_block(file, block, *comps.back())) return false;
+    }
+    return decode_in_parallel(file, comps, blocks, decoded, aborting_var);
+}
+
+
+bool DeltaReader::load(bool& aborting_var) {
+    if (compressed_size < delta::prefix_size) return false;
+
+    uint8_t prefix[delta::prefix_size];
+    if (!read_at(data_location, delta::prefix_size, prefix)) return false;
+    delta::Base base_fields;
+    base_fields.data_location = little_endian::load(prefix, 8);
+    base_fields.compressed_size = little_endian::load(prefix + 8, 8);
+    base_fields.original_size = little_endian::load(prefix + 16, 8);
+    base_fields.flags = little_endian::load(prefix + 24, 2);
+    uint64_t stream_size = little_endian::load(prefix + 26, 8);
+
+    base = file_of(base_fields);
+    if (!load_index(base)) return false;
+
+    File stream_file = file_of({ data_location + delta::prefix_size, compressed_size - delta::prefix_size,
+                                 stream_size, (uint16_t)(flags & ~(1u << delta::flag)) });
+    if (!load_index(stream_file)) return false;
+
+    std::vector<uint32_t> blocks(stream_file.blocks.blocks.size());
+    for (uint32_t i=0; i < blocks.size(); ++i) blocks[i] = i;
+    std::vector<std::string> decoded;
+    if (!decode_blocks(stream_file, blocks, decoded, aborting_var)) return false;
+    std::string stream;
+    for (auto& block : decoded) stream += block;
+
+    // ops have to add up to the whole file, and stay within base and literals
+    auto buffer = (const uint8_t*)stream.data();
+    if (stream.size() < 8) return false;
+    uint64_t op_count = little_endian::load(buffer, 8);
+    if (op_count > (stream.size() - 8) / 16) return false;
+
+    uint64_t offset = 0;
+    uint64_t literal_offset = 0;
+    ops.clear();
+    ops.reserve(op_count);
+    for (uint64_t i=0; i < op_count; ++i) {
+        uint64_t length = little_endian::load(buffer + 8 + i*16, 8);
+        uint64_t base_offset = little_endian::load(buffer + 8 + i*16 + 8, 8);
+        if (length == 0) return false;
+        if (base_offset != literal and (base_offset > base.original_size or base.original_size - base_offset < length))
+            return false;
+
+        ops.push_back({ offset, length, base_offset, literal_offset });
+        offset += length;
+        if (base_offset == literal) literal_offset += length;
+    }
+    literals = stream.substr(8 + op_count * 16);
+    return offset == original_size and literal_offset == literals.size();
+}
+
+
+uint64_t DeltaReader::read(uint64_t offset, uint64_t length, uint8_t* buffer, bool& aborting_var) {
+    if (offset >= original_size or length == 0) return 0;
+    if (length > original_size - offset) length = original_size - offset;
+    uint64_t end = offset + length;
+
+    auto first_op = std::upper_bound(ops.begin(), ops.end(), offset,
+                                     [](uint64_t o, const Op& op) { return o < op.offset; }) - 1;
+
+    // blocks of base the read needs, the ones already decoded are kept
+    std::vector<uint32_t> needed;
+    for (auto op = first_op; op != ops.end() and op->offset < end; ++op) {
+        if (op->base_offset == literal) continue;
+        uint64_t from = op->base_offset + (std::max(offset, op->offset) - op->offset);
+        uint64_t to = op->base_offset + (std::min(end, op->offset + op->length) - op->offset);
+        for (uint32_t block = base.blocks.find(from); block <= base.blocks.find(to - 1); ++block)
+            if (needed.empty() or needed.back() != block) needed.push_back(block);
+    }
+    std::sort(needed.begin(), needed.end());
+    needed.erase(std::unique(needed.begin(), needed.end()), needed.end());
+
+    std::map<uint32_t, std::string> kept;
+    std::vector<uint32_t> missing;
+    for (uint32_t block : needed) {
+        auto it = base_blocks.find(block);
+        if (it != base_blocks.end()) kept[block] = std::move(it->second);
+        else missing.push_back(block);
+    }
+    base_blocks = std::move(kept);
+
+    std::vector<std::string> decoded;
+    if (!missing.empty() and !decode_blocks(base, missing, decoded, aborting_var)) return 0;
+    for (uint64_t i=0; i < missing.size(); ++i) base_blocks[missing[i]] = std::move(decoded[i]);
+
+    uint64_t copied = 0;
+    for (auto op = first_op; op != ops.end() and op->offset < end; ++op) {
+        uint64_t skip = std::max(offset, op->offset) - op->offset;
+        uint64_t to_copy = std::min(end, op->offset + op->length) - op->offset - skip;
+
+        if (op->base_offset == literal) {
+            std::memcpy(buffer + copied, literals.data() + op->literal_offset + skip, to_copy);
+            copied += to_copy;
+            continue;
+        }
+        for (uint64_t done = 0; done < to_copy; ) {
+            uint64_t base_offset = op->base_offset + skip + done;
+            uint32_t block = base.blocks.find(base_offset);
+            const std::string& decoded_block = base_blocks[block];
+            uint64_t offset_in_block = base_offset - base.blocks.blocks[block].original_offset;
+            uint64_t part = std::min<uint64_t>(to_copy - done, decoded_block.size() - offset_in_block);
+            std::memcpy(buffer + copied, decoded_block.data() + offset_in_block, part);
+            copied += part;
+            done += part;
+        }
+    }
+    return copied;
+}
+
+
+bool DeltaReader::unpack(const std::filesystem::path& destination, bool validate_integrity, bool& aborting_var) {
+    std::fstream output(destination, std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc);
+    if (!output.is_open()) return false;
+
+    std::string window(std::min<uint64_t>(original_size, window_size), 0x00);
+    for (uint64_t offset = 0; offset < original_size; ) {
+        if (aborting_var) return false;
+        uint64_t got = read(offset, window.size(), (uint8_t*)window.data(), aborting_var);
+        if (got == 0) return false;
+        output.write(window.data(), got);
+        offset += got;
+    }
+    base_blocks.clear();
+
+    uint8_t checksum_length = multithreading::checksum_length(flags);
+    if (!validate_integrity or checksum_length == 0) return (bool)output;
+
+    std::string checksum(checksum_length, 0x00);
+    if (!read_at(data_location + compressed_size, checksum_length, (uint8_t*)checksum.data())) return false;
+    output.flush();
+    return multithreading::stream_checksum(output, flags, original_size, aborting_var) == checksum;
+}
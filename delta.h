@@ -0,0 +1,110 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdint>
+#include <functional>
+#include <filesystem>
+
+#include "archive_structures.h"
+
+
+// Delta encoding of a file against its previous version, which is already in the archive (like rsync does it).
+// Previous version (base) is cut into chunks, and new version is searched for them with a rolling hash,
+// so it turns into ops: copies of base's ranges, and literal bytes base doesn't have.
+// File stored as delta has flag 7 set, and its data is:
+// [base data_location 8B][base compressed_size 8B][base original_size 8B][base flags 2B][stream_size 8B],
+// then the stream, compressed in blocks like any file's data is, then checksum of the new version.
+// Stream is [op_count 8B], [length 8B][base_offset 8B] for every op (base_offset of literals is UINT64_MAX),
+// then literal bytes of all ops, one after another.
+// Base's header is removed along with it, its data stays in archive for as long as the delta does
+namespace delta {
+    constexpr uint8_t flag = 7;
+    constexpr uint32_t chunk_size = 4096;
+    constexpr uint8_t prefix_size = 34;
+
+    // Data of previous version, as it is in the archive
+    struct Base {
+        uint64_t data_location = 0;
+        uint64_t compressed_size = 0;
+        uint64_t original_size = 0;
+        uint16_t flags = 0;
+
+        // Bytes of archive taken by base's data, checksum included
+        uint64_t span() const;
+    };
+
+    bool is_delta(uint16_t flags);
+
+    Base base_of(const File& file);
+
+    // Reads base of delta file from its data
+    bool read_base(const PositionalFile& archive_io, uint64_t data_location, Base& base);
+
+    // Stream turning base into source. Returns false if it wouldn't make source at least half smaller
+    bool encode(const PositionalFile& archive_io, const Base& base, const std::filesystem::path& source,
+                std::string& stream, bool& aborting_var);
+
+    // Writes data of delta file at archive_stream's position, its blocks are compressed on all cores.
+    // compressed_size gets size of everything but the checksum
+    bool write(std::fstream& archive_stream, const Base& base, const std::string& stream, uint16_t flags,
+               const std::string& checksum, uint64_t& compressed_size, bool& aborting_var);
+}
+
+
+// Delta computed before the new version is written, see File::pending_delta
+struct PendingDelta {
+    delta::Base base;
+    std::string stream;
+};
+
+
+// Rebuilds a file stored as delta. Only the base's blocks a read needs are decoded, all of them at once
+class DeltaReader
+{
+public:
+    DeltaReader(const PositionalFile& archive_io, const File& file);
+    DeltaReader(std::fstream& archive_stream, const File& file);
+
+    // Reads and decodes the stream, has to succeed before anything else is used
+    bool load(bool& aborting_var);
+
+    // Copies up to length bytes of file's contents, starting at offset, into buffer. Returns number of bytes copied
+    uint64_t read(uint64_t offset, uint64_t length, uint8_t* buffer, bool& aborting_var);
+
+    // Writes the whole file to destination
+    bool unpack(const std::filesystem::path& destination, bool validate_integrity, bool& aborting_var);
+
+private:
+    static constexpr uint64_t window_size = 16u << 20;  // of unpack(), 16 MiB
+
+    struct Op {
+        uint64_t offset;                            // in the new version
+        uint64_t length;
+        uint64_t base_offset;                       // UINT64_MAX for literals
+        uint64_t literal_offset;                    // in literals, literals only
+    };
+
+    std::function<bool(uint64_t location, uint64_t length, uint8_t* buffer)> read_at;
+    std::function<bool(File& file)> load_index;
+    std::function<bool(File& file, uint32_t block, Compression& comp)> load_block;
+
+    uint64_t data_location;
+    uint64_t compressed_size;
+    uint64_t original_size;
+    uint16_t flags;
+
+    File base;                                      // previous version, with fields of its (removed) header
+    std::vector<Op> ops;
+    std::string literals;
+    std::map<uint32_t, std::string> base_blocks;    // decoded blocks of base, kept since the last read
+
+    // Loads blocks one after another (a stream can't be read by many threads), and decodes them all at once
+    bool decode_blocks(File& file, const std::vector<uint32_t>& blocks, std::vector<std::string>& decoded,
+                       bool& aborting_var);
+};
+
+#endif // DELTA_H
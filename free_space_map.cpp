@@ -0,0 +1,129 @@
+#include "free_space_map.h"
+
+#include <cassert>
+#include <iterator>
+
+#include "header_record.h"
+
+
+void FreeSpaceMap::add(uint64_t offset, uint64_t length) {
+    if (length == 0) return;
+
+    auto next = ranges.lower_bound(offset);
+    assert(next == ranges.end() or offset + length <= next->first);
+    free_bytes += length;
+
+    if (next != ranges.begin()) {
+        auto previous = std::prev(next);
+        assert(previous->first + previous->second <= offset);
+        if (previous->first + previous->second == offset) {     // grows the range before it
+            offset = previous->first;
+            length += previous->second;
+            ranges.erase(previous);
+        }
+    }
+    if (next != ranges.end() and offset + length == next->first) {
+        length += next->second;
+        ranges.erase(next);
+    }
+    ranges[offset] = length;
+}
+
+
+bool FreeSpaceMap::take(uint64_t length, uint64_t& offset) {
+    auto best = ranges.end();
+    for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+        if (it->second < length) continue;
+        if (best == ranges.end() or it->second < best->second) best = it;
+        if (best->second == length) break;
+    }
+    if (best == ranges.end()) return false;
+
+    offset = best->first;
+    uint64_t left = best->second - length;
+    ranges.erase(best);
+    if (left != 0) ranges[offset + length] = left;
+    free_bytes -= length;
+    return true;
+}
+
+
+bool FreeSpaceMap::take_below(uint64_t length, uint64_t limit, uint64_t& offset) {
+    for (auto it = ranges.begin(); it != ranges.end() and it->first + length <= limit; ++it) {
+        if (it->second < length) continue;
+
+        offset = it->first;
+        uint64_t left = it->second - length;
+        ranges.erase(it);
+        if (left != 0) ranges[offset + length] = left;
+        free_bytes -= length;
+        return true;
+    }
+    return false;
+}
+
+
+uint64_t FreeSpaceMap::trim_tail(uint64_t archive_end) {
+    if (ranges.empty()) return archive_end;
+
+    auto last = std::prev(ranges.end());
+    if (last->first + last->second != archive_end) return archive_end;
+
+    uint64_t new_end = last->first;
+    free_bytes -= last->second;
+    ranges.erase(last);
+    return new_end;
+}
+
+
+bool FreeSpaceMap::empty() const {
+    return ranges.empty();
+}
+
+
+void FreeSpaceMap::clear() {
+    ranges.clear();
+    free_bytes = 0;
+}
+
+
+uint64_t FreeSpaceMap::total() const {
+    return free_bytes;
+}
+
+
+std::string FreeSpaceMap::encode() const {
+    std::string payload;
+    payload.reserve(4 + ranges.size() * 16);
+    little_endian::append(payload, ranges.size(), 4);
+    for (auto [offset, length] : ranges) {
+        little_endian::append(payload, offset, 8);
+        little_endian::append(payload, length, 8);
+    }
+    return payload;
+}
+
+
+bool FreeSpaceMap::decode(std::string_view payload) {
+    clear();
+    auto buffer = (const uint8_t*)payload.data();
+    if (payload.size() < 4) return false;
+
+    uint32_t count = little_endian::load(buffer, 4);
+    if (payload.size() != 4 + (uint64_t)count * 16) return false;
+
+    uint64_t previous_end = 1;  // byte 0 is never free
+    for (uint32_t i=0; i < count; ++i) {
+        uint64_t offset = little_endian::load(buffer + 4 + i*16, 8);
+        uint64_t length = little_endian::load(buffer + 4 + i*16 + 8, 8);
+        // ranges are written in order, and never overlap
+        if (offset < previous_end or length == 0 or offset + length < offset) {
+            clear();
+            return false;
+        }
+        ranges[offset] = length;
+        free_bytes += length;
+        previous_end = offset + length;
+    }
+    return true;
+}
@@ -0,0 +1,41 @@
+#ifndef FREE_SPACE_MAP_H
+#define FREE_SPACE_MAP_H
+
+#include <map>
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+
+// Ranges of the archive which nothing points at anymore (left behind by removed structures), so they can be reused.
+// Neighbouring ranges are always merged into one
+class FreeSpaceMap {
+public:
+    // Marks [offset, offset + length) as free
+    void add(uint64_t offset, uint64_t length);
+
+    // Takes length bytes from the smallest range that fits them (from its start), returns false if none does
+    bool take(uint64_t length, uint64_t& offset);
+
+    // Same as take, but from the lowest range that fits, and ends at or before limit
+    bool take_below(uint64_t length, uint64_t limit, uint64_t& offset);
+
+    // Forgets range that ends at archive_end, returns where archive can end without it
+    uint64_t trim_tail(uint64_t archive_end);
+
+    bool empty() const;
+    void clear();
+
+    // Number of free bytes in total
+    uint64_t total() const;
+
+    // Payload of table of contents extension: [range_count 4B] and [offset 8B][length 8B] for every range
+    std::string encode() const;
+    bool decode(std::string_view payload);
+
+private:
+    std::map<uint64_t, uint64_t> ranges;            // length by offset
+    uint64_t free_bytes = 0;
+};
+
+#endif // FREE_SPACE_MAP_H
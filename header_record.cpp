@@ -0,0 +1,140 @@
+#include "header_record.h"
+
+#include <cassert>
+
+#include "archive_structures.h"
+#include "misc/mapped_file.h"
+#include "misc/project_exceptions.h"
+
+
+uint32_t HeaderRecord::header_size(kind type, uint8_t name_length) {
+    if (type == kind::folder) return Folder::base_metadata_size + name_length;
+    return File::base_metadata_size + name_length;
+}
+
+
+uint32_t HeaderRecord::decode(const uint8_t* buffer, uint64_t available) {
+    if (available < 1) return 0;
+    uint8_t name_length = buffer[0];
+    uint32_t total_size = header_size(type, name_length);
+    if (available < total_size) return 0;
+
+    uint32_t bi = 1;    // buffer index
+    name.assign((const char*)buffer + bi, name_length);
+    bi += name_length;
+
+    parent_location = little_endian::load(buffer + bi, 8);
+    bi += 8;
+
+    if (type == kind::folder) {
+        child_dir_location = little_endian::load(buffer + bi, 8);
+        bi += 8;
+        sibling_location = little_endian::load(buffer + bi, 8);
+        bi += 8;
+        child_file_location = little_endian::load(buffer + bi, 8);
+        bi += 8;
+    }
+    else {
+        sibling_location = little_endian::load(buffer + bi, 8);
+        bi += 8;
+        flags_value = little_endian::load(buffer + bi, 2);
+        bi += 2;
+        data_location = little_endian::load(buffer + bi, 8);
+        bi += 8;
+        compressed_size = little_endian::load(buffer + bi, 8);
+        bi += 8;
+        original_size = little_endian::load(buffer + bi, 8);
+        bi += 8;
+    }
+
+    assert(bi == total_size);
+    return total_size;
+}
+
+
+void HeaderRecord::encode(std::string& output) const {
+    assert(name.length() < 256);
+    output.push_back((char)name.length());
+    output += name;
+    little_endian::append(output, parent_location, 8);
+
+    if (type == kind::folder) {
+        little_endian::append(output, child_dir_location, 8);
+        little_endian::append(output, sibling_location, 8);
+        little_endian::append(output, child_file_location, 8);
+    }
+    else {
+        little_endian::append(output, sibling_location, 8);
+        little_endian::append(output, flags_value, 2);
+        little_endian::append(output, data_location, 8);
+        little_endian::append(output, compressed_size, 8);
+        little_endian::append(output, original_size, 8);
+    }
+}
+
+
+void record_extension::append(std::string& extension, tag field_tag, const std::string& payload) {
+    extension.push_back((char)field_tag);
+    little_endian::append(extension, payload.size(), 4);
+    extension += payload;
+}
+
+
+std::string_view record_extension::find(std::string_view extension, tag field_tag) {
+    auto buffer = (const uint8_t*)extension.data();
+    uint64_t bi = 0;    // buffer index
+    while (extension.size() - bi >= 5) {
+        auto current_tag = (tag)buffer[bi];
+        uint64_t payload_size = little_endian::load(buffer + bi + 1, 4);
+        bi += 5;
+        if (extension.size() - bi < payload_size) break;
+
+        if (current_tag == field_tag) return extension.substr(bi, payload_size);
+        bi += payload_size;
+    }
+    return {};
+}
+
+
+StreamHeaderSource::StreamHeaderSource(std::fstream& archive_stream) : stream(archive_stream) {}
+
+
+void StreamHeaderSource::read(uint64_t location, HeaderRecord::kind type, HeaderRecord& record) {
+    uint8_t buffer[File::base_metadata_size + 255];
+
+    stream.seekg(location);
+    buffer[0] = (uint8_t)stream.get();
+    uint32_t header_size = HeaderRecord::header_size(type, buffer[0]);
+    stream.read((char*)buffer + 1, header_size - 1);    // rest of the header in one go
+    if (!stream) throw CorruptedArchiveException();
+
+    record.type = type;
+    record.location = location;
+    record.decode(buffer, header_size);
+    record.extension.clear();   // archive's headers have none
+}
+
+
+MappedHeaderSource::MappedHeaderSource(const MappedFile& archive_map, HeaderSource& fallback) :
+        map(archive_map),
+        fallback(fallback) {}
+
+
+void MappedHeaderSource::read(uint64_t location, HeaderRecord::kind type, HeaderRecord& record) {
+    if (!map.contains(location, 1)) {
+        fallback.read(location, type, record);
+        return;
+    }
+
+    const uint8_t* header = map.data() + location;
+    uint32_t header_size = HeaderRecord::header_size(type, header[0]);
+    if (!map.contains(location, header_size)) {
+        fallback.read(location, type, record);
+        return;
+    }
+
+    record.type = type;
+    record.location = location;
+    record.decode(header, header_size);
+    record.extension.clear();   // archive's headers have none
+}
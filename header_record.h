@@ -0,0 +1,110 @@
+#ifndef HEADER_RECORD_H
+#define HEADER_RECORD_H
+
+#include <bit>
+#include <cassert>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <fstream>
+
+
+class MappedFile;
+
+
+// Integers in headers are stored as little endian, byte_count bytes long
+namespace little_endian {
+    inline uint64_t load(const uint8_t* buffer, uint8_t byte_count) {
+        assert(byte_count <= 8);
+        uint64_t value = 0;
+        if constexpr (std::endian::native == std::endian::little) {
+            std::memcpy(&value, buffer, byte_count);    // single unaligned load, buffer can point anywhere
+            return value;
+        }
+        for (uint8_t i=0; i < byte_count; i++)
+            value |= (uint64_t)buffer[i] << (i*8u);
+        return value;
+    }
+
+    inline void append(std::string& output, uint64_t value, uint8_t byte_count) {
+        for (uint8_t i=0; i < byte_count; i++)
+            output.push_back((char)((value >> (i*8u)) & 0xFFu));
+    }
+}
+
+
+// Single folder's or file's header, decoded from the same byte layout it has in the archive
+struct HeaderRecord {
+    enum class kind : uint8_t { folder=0, file=1 };
+
+    kind type = kind::folder;
+    uint64_t location = 0;                          // absolute location of the header in archive
+    std::string name;
+
+    uint64_t parent_location = 0;
+    uint64_t sibling_location = 0;
+    uint64_t child_dir_location = 0;                // folders only
+    uint64_t child_file_location = 0;               // folders only
+
+    uint16_t flags_value = 0;                       // files only
+    uint64_t data_location = 0;                     // files only
+    uint64_t compressed_size = 0;                   // files only
+    uint64_t original_size = 0;                     // files only
+
+    std::string extension;                          // extra data kept only in table of contents, see record_extension
+
+    // Size of header in archive, name_length byte and name included
+    static uint32_t header_size(kind type, uint8_t name_length);
+
+    // Decodes header starting at its name_length byte, returns number of bytes used, or 0 if available wasn't enough
+    uint32_t decode(const uint8_t* buffer, uint64_t available);
+
+    // Appends header in archive's layout to output
+    void encode(std::string& output) const;
+};
+
+
+// Extension of a table of contents record is a list of [tag 1B][size 4B][payload] fields.
+// Fields with unknown tags are skipped, so new ones can be added without breaking older readers
+namespace record_extension {
+    enum class tag : uint8_t { block_index=1, free_space=2, modification_time=3 };
+
+    void append(std::string& extension, tag field_tag, const std::string& payload);
+
+    // Payload of the field with given tag, empty if there's none
+    std::string_view find(std::string_view extension, tag field_tag);
+}
+
+
+// Something that headers of the archive can be read from, by their location
+class HeaderSource {
+public:
+    virtual ~HeaderSource() = default;
+    virtual void read(uint64_t location, HeaderRecord::kind type, HeaderRecord& record) = 0;
+};
+
+
+// Reads headers straight from the archive, one seek per header (linked layout)
+class StreamHeaderSource : public HeaderSource {
+public:
+    explicit StreamHeaderSource(std::fstream& archive_stream);
+    void read(uint64_t location, HeaderRecord::kind type, HeaderRecord& record) override;
+
+private:
+    std::fstream& stream;
+};
+
+
+// Decodes headers straight from archive's mapping, without reading them into a buffer first.
+// Headers outside of it (appended after it was made, or when nothing is mapped) are read from fallback
+class MappedHeaderSource : public HeaderSource {
+public:
+    MappedHeaderSource(const MappedFile& archive_map, HeaderSource& fallback);
+    void read(uint64_t location, HeaderRecord::kind type, HeaderRecord& record) override;
+
+private:
+    const MappedFile& map;
+    HeaderSource& fallback;
+};
+
+#endif // HEADER_RECORD_H
@@ -8,6 +8,8 @@
 #include <cmath>
 #include <sstream>
 
+#include "blake3.h"
+
 IntegrityValidation::IntegrityValidation()
 : SHA1_num(nullptr), SHA256_num(nullptr), CRC32_num(nullptr) {
     generate_CRC32_lookup_table();
@@ -931,3 +933,30 @@ std::string IntegrityValidation::get_CRC32_from_stream(std::fstream &source, boo
 }
 
 
+std::string IntegrityValidation::get_BLAKE3_from_file( const std::string& path_to_file, bool& aborting_var ) {
+    std::fstream source(path_to_file, std::ios::binary | std::ios::in);
+    assert( source.is_open() );
+    return get_BLAKE3_from_stream(source, aborting_var);
+}
+
+
+std::string IntegrityValidation::get_BLAKE3_from_stream( std::fstream& source, bool& aborting_var ) {
+    assert( source.is_open() );
+    uint64_t backup_pos = source.tellg();
+    source.seekg(0);
+
+    // big reads, so hasher gets many whole chunks to hash at once
+    std::vector<uint8_t> buffer(1 << 20);
+    blake3::Hasher hasher;
+    while (source.good() and !aborting_var)
+    {
+        source.read((char*)buffer.data(), buffer.size());
+        hasher.update(buffer.data(), source.gcount());
+    }
+
+    source.clear();
+    source.seekg(backup_pos);
+    if (aborting_var) return "";
+    this->BLAKE3 = hasher.hex_digest();
+    return this->BLAKE3;
+}
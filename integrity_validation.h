@@ -10,6 +10,7 @@ public:
     std::string SHA1;
     std::string SHA256;
     std::string CRC32;
+    std::string BLAKE3;
 
     // arrays of numbers
     uint8_t* SHA1_num;      // 20 bytes
@@ -29,6 +30,10 @@ public:
     std::string get_CRC32_from_text( uint8_t text[], uint64_t text_size, bool& aborting_var );
     std::string get_CRC32_from_file( std::string path, bool& aborting_var );
     std::string get_CRC32_from_stream( std::fstream& source, bool& aborting_var );
+
+    // Files compressed with BLAKE3 set have theirs computed block by block by workers instead, see blake3::join
+    std::string get_BLAKE3_from_file( const std::string& path_to_file, bool& aborting_var );
+    std::string get_BLAKE3_from_stream( std::fstream& source, bool& aborting_var );
 private:
     const uint64_t polynomial = 0x4C11DB7;
     uint32_t CRC32_lookup_table[256];
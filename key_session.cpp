@@ -0,0 +1,127 @@
+#include "key_session.h"
+
+#include <random>
+#include <cstring>
+#include <algorithm>
+
+#include "misc/thread_pool.h"
+
+
+namespace {
+    // Same time whatever the contents are, so a password can't be guessed a byte at a time
+    bool equal(const uint8_t a[], const uint8_t b[], uint64_t size) {
+        uint8_t difference = 0;
+        for (uint64_t i=0; i < size; ++i) difference |= a[i] ^ b[i];
+        return difference == 0;
+    }
+
+    void wipe(void* memory, uint64_t size) {
+        auto bytes = (volatile uint8_t*)memory;
+        for (uint64_t i=0; i < size; ++i) bytes[i] = 0;
+    }
+}
+
+
+bool KeySession::derive(std::string& pw, const Params& params, uint8_t key[], bool& aborting_var) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Entry* entry = find(pw, params);
+        if (entry != nullptr) {
+            std::memcpy(key, entry->secret.data() + pw.size(), key_size);
+            return true;
+        }
+    }
+
+    // derived without holding mutex, so other threads can derive other keys meanwhile
+    if (!derive_uncached(pw, params, key, aborting_var)) return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    add(pw, params, key);
+    return true;
+}
+
+
+void KeySession::derive_all(std::string& pw, const std::vector<Params>& params, bool& aborting_var) {
+    std::vector<Params> missing;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& p : params) {
+            bool listed = std::any_of(missing.begin(), missing.end(), [&](const Params& m) {
+                return m.salt == p.salt and m.iterations == p.iterations;
+            });
+            if (!listed and find(pw, p) == nullptr) missing.push_back(p);
+        }
+    }
+    if (missing.empty()) return;
+
+    // PBKDF2 can't be split, but runs for different salts don't depend on each other
+    ThreadPool pool(std::min<uint64_t>(missing.size(), std::max(1u, std::thread::hardware_concurrency())));
+    for (auto& p : missing) {
+        pool.submit([this, &pw, &p, &aborting_var]() {
+            uint8_t key[key_size];
+            if (derive_uncached(pw, p, key, aborting_var)) {
+                std::lock_guard<std::mutex> lock(mutex);
+                add(pw, p, key);
+            }
+            wipe(key, sizeof(key));
+        });
+    }
+    pool.wait();
+}
+
+
+KeySession::Params KeySession::encryption_params() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!has_encryption_params) {
+        std::random_device device;
+        for (auto& byte : encryption.salt) byte = device() & 0xFF;
+        encryption.iterations = (uint32_t)crypto::PBKDF2::iteration_count::medium;
+        has_encryption_params = true;
+    }
+    return encryption;
+}
+
+
+void KeySession::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    entries.clear();    // LockedBuffer zeroes itself
+}
+
+
+uint64_t KeySession::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return entries.size();
+}
+
+
+KeySession::Entry* KeySession::find(const std::string& pw, const Params& params) {
+    for (auto& entry : entries) {
+        if (entry.params.salt != params.salt or entry.params.iterations != params.iterations) continue;
+        if (entry.secret.size() != pw.size() + key_size) continue;
+        if (equal(entry.secret.data(), (const uint8_t*)pw.data(), pw.size())) return &entry;
+    }
+    return nullptr;
+}
+
+
+void KeySession::add(const std::string& pw, const Params& params, const uint8_t key[]) {
+    if (find(pw, params) != nullptr) return;
+
+    Entry entry{params, LockedBuffer(pw.size() + key_size)};
+    std::memcpy(entry.secret.data(), pw.data(), pw.size());
+    std::memcpy(entry.secret.data() + pw.size(), key, key_size);
+    entries.push_back(std::move(entry));
+}
+
+
+bool KeySession::derive_uncached(std::string& pw, const Params& params, uint8_t key[], bool& aborting_var) {
+    auto salt = params.salt;
+    std::string derived = crypto::PBKDF2::HMAC_SHA256(pw, salt.data(), salt.size(), params.iterations, key_size,
+                                                      aborting_var);
+    if (aborting_var or derived.size() != key_size) {
+        wipe(derived.data(), derived.size());
+        return false;
+    }
+    std::memcpy(key, derived.data(), key_size);
+    wipe(derived.data(), derived.size());
+    return true;
+}
@@ -0,0 +1,68 @@
+#ifndef KEY_SESSION_H
+#define KEY_SESSION_H
+
+#include <array>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "cryptography.h"
+#include "misc/locked_buffer.h"
+
+
+// Keys derived from passwords with PBKDF2, kept for as long as the session is, so it runs once for every
+// (password, salt, iterations), however many files they unlock. Passwords and keys stay in locked memory
+// (see LockedBuffer) until the session is cleared or destroyed.
+// Any number of threads can use the same session at once
+class KeySession
+{
+public:
+    static const uint32_t key_size = crypto::AES128::key_size;
+
+    struct Params {
+        std::array<uint8_t, crypto::PBKDF2::saltSize> salt;
+        uint32_t iterations;
+    };
+
+    KeySession() = default;
+
+    KeySession(const KeySession&) = delete;
+    KeySession& operator=(const KeySession&) = delete;
+
+    // Copies key of pw into key (key_size bytes), deriving it only if it wasn't derived yet. False if aborted
+    bool derive(std::string& pw, const Params& params, uint8_t key[], bool& aborting_var);
+
+    // Derives keys of pw for all of params that weren't derived yet, each one on its own core
+    void derive_all(std::string& pw, const std::vector<Params>& params, bool& aborting_var);
+
+    // Params for files encrypted during this session, so password's key is derived once for all of them.
+    // Salt is random, made on the first call. Every file still has its own random key, this one only encrypts it
+    Params encryption_params();
+
+    // Zeroes and forgets all keys
+    void clear();
+
+    uint64_t size();    // number of keys kept
+
+private:
+    struct Entry {
+        Params params;
+        LockedBuffer secret;                        // [password][key]
+    };
+
+    std::mutex mutex;
+    std::vector<Entry> entries;
+    bool has_encryption_params = false;
+    Params encryption;
+
+    // Entry of pw and params, nullptr if there's none. mutex has to be locked
+    Entry* find(const std::string& pw, const Params& params);
+
+    // Keeps key of pw, unless the same key was added in the meantime
+    void add(const std::string& pw, const Params& params, const uint8_t key[]);
+
+    static bool derive_uncached(std::string& pw, const Params& params, uint8_t key[], bool& aborting_var);
+};
+
+#endif // KEY_SESSION_H
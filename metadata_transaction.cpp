@@ -0,0 +1,53 @@
+#include "metadata_transaction.h"
+
+#include <algorithm>
+
+#include "header_record.h"
+
+
+void MetadataTransaction::patch(uint64_t location, uint64_t value, uint8_t byte_count) {
+    Patch p{ location, {} };
+    little_endian::append(p.bytes, value, byte_count);
+    patches.push_back(std::move(p));
+}
+
+
+bool MetadataTransaction::commit(std::fstream& archive_stream) {
+    // stable, so patches of the same field stay in the order they were made
+    std::stable_sort(patches.begin(), patches.end(),
+                     [](const Patch& a, const Patch& b) { return a.location < b.location; });
+
+    uint64_t run_location = 0;
+    std::string run;
+    for (const Patch& p : patches) {
+        if (!run.empty() and p.location > run_location + run.size()) {
+            archive_stream.seekp(run_location);
+            archive_stream.write(run.data(), run.size());
+            run.clear();
+        }
+        if (run.empty()) run_location = p.location;
+
+        uint64_t offset = p.location - run_location;
+        if (run.size() < offset + p.bytes.size()) run.resize(offset + p.bytes.size());
+        run.replace(offset, p.bytes.size(), p.bytes);
+    }
+    if (!run.empty()) {
+        archive_stream.seekp(run_location);
+        archive_stream.write(run.data(), run.size());
+    }
+    patches.clear();
+
+    archive_stream.seekp(0, std::ios_base::end);
+    archive_stream.flush();
+    return (bool)archive_stream;
+}
+
+
+bool MetadataTransaction::empty() const {
+    return patches.empty();
+}
+
+
+uint64_t MetadataTransaction::size() const {
+    return patches.size();
+}
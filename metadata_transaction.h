@@ -0,0 +1,36 @@
+#ifndef METADATA_TRANSACTION_H
+#define METADATA_TRANSACTION_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+
+// Changes to headers which are already in the archive, collected while structures are being written,
+// and applied all at once, instead of a seek back for every header that points at a new one.
+// Patches of the same field should have the same location and size, the one made last wins
+class MetadataTransaction
+{
+public:
+    // Overwrites byte_count bytes at location with value (little endian), once committed
+    void patch(uint64_t location, uint64_t value, uint8_t byte_count);
+
+    // Writes patches in order of their locations, adjacent ones as a single write, then leaves the stream
+    // at its end, and flushes it. Returns false if writing failed
+    bool commit(std::fstream& archive_stream);
+
+    bool empty() const;
+
+    // Number of patches waiting for commit
+    uint64_t size() const;
+
+private:
+    struct Patch {
+        uint64_t location;
+        std::string bytes;
+    };
+
+    std::vector<Patch> patches;
+};
+
+#endif // METADATA_TRANSACTION_H
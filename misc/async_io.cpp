@@ -0,0 +1,492 @@
+#include "async_io.h"
+
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <stdexcept>
+#include <condition_variable>
+#include <unistd.h>
+
+#if defined(TK2K_IO_URING) && defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define ASYNC_IO_HAS_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#endif
+
+
+AsyncIO::AsyncIO(uint32_t depth, uint32_t buffer_size) :
+        size_of_buffer(buffer_size)
+{
+    assert(depth != 0);
+    uint64_t allocated = ((uint64_t)buffer_size + 4095) / 4096 * 4096;   // aligned_alloc wants a multiple of alignment
+    if (allocated == 0) allocated = 4096;
+    for (uint32_t i=0; i < depth; ++i) {
+        buffers.emplace_back((uint8_t*)std::aligned_alloc(4096, allocated));
+        assert(buffers.back() != nullptr);
+    }
+}
+
+
+uint8_t* AsyncIO::buffer(uint32_t index) const {
+    return buffers[index].get();
+}
+
+
+uint32_t AsyncIO::depth() const {
+    return buffers.size();
+}
+
+
+uint32_t AsyncIO::buffer_size() const {
+    return size_of_buffer;
+}
+
+
+namespace {
+    // Single thread doing requests one after another, with plain pread/pwrite
+    class ThreadAsyncIO : public AsyncIO
+    {
+    public:
+        ThreadAsyncIO(uint32_t depth, uint32_t buffer_size) : AsyncIO(depth, buffer_size) {
+            worker = std::thread(&ThreadAsyncIO::work, this);
+        }
+
+        ~ThreadAsyncIO() override {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            requested.notify_all();
+            worker.join();
+        }
+
+        backend kind() const override { return backend::thread; }
+
+        void read(int fd, uint32_t buffer, uint32_t buffer_offset, uint32_t size, uint64_t offset) override {
+            push({ false, fd, buffer, buffer_offset, size, offset });
+        }
+
+        void write(int fd, uint32_t buffer, uint32_t buffer_offset, uint32_t size, uint64_t offset) override {
+            push({ true, fd, buffer, buffer_offset, size, offset });
+        }
+
+        Completion wait() override {
+            std::unique_lock<std::mutex> lock(mutex);
+            completed.wait(lock, [this]() { return !completions.empty(); });
+            Completion completion = completions.front();
+            completions.pop_front();
+            return completion;
+        }
+
+    private:
+        struct Request {
+            bool write;
+            int fd;
+            uint32_t buffer;
+            uint32_t buffer_offset;
+            uint32_t size;
+            uint64_t offset;
+        };
+
+        std::mutex mutex;
+        std::condition_variable requested;
+        std::condition_variable completed;
+        std::deque<Request> requests;
+        std::deque<Completion> completions;
+        bool stopping = false;
+        std::thread worker;
+
+        void push(const Request& request) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                requests.push_back(request);
+            }
+            requested.notify_one();
+        }
+
+        void work() {
+            while (true) {
+                Request request{};
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    requested.wait(lock, [this]() { return stopping or !requests.empty(); });
+                    if (requests.empty()) return;
+                    request = requests.front();
+                    requests.pop_front();
+                }
+
+                uint8_t* data = buffer(request.buffer) + request.buffer_offset;
+                ssize_t result;
+                do {
+                    if (request.write) result = ::pwrite(request.fd, data, request.size, request.offset);
+                    else result = ::pread(request.fd, data, request.size, request.offset);
+                } while (result == -1 and errno == EINTR);
+
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    completions.push_back({ request.buffer, result == -1 ? -(int64_t)errno : (int64_t)result });
+                }
+                completed.notify_one();
+            }
+        }
+    };
+
+
+#ifdef ASYNC_IO_HAS_URING
+    // io_uring driven straight through its system calls. Buffers are registered with the kernel if it lets them,
+    // so it doesn't have to map them for every request
+    class UringAsyncIO : public AsyncIO
+    {
+    public:
+        // nullptr if io_uring isn't available (old kernel, or blocked by seccomp)
+        static std::unique_ptr<AsyncIO> open(uint32_t depth, uint32_t buffer_size) {
+            std::unique_ptr<UringAsyncIO> io(new UringAsyncIO(depth, buffer_size));
+            if (!io->setup()) return nullptr;
+            return io;
+        }
+
+        ~UringAsyncIO() override {
+            if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+            if (cq_ring != MAP_FAILED and cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+            if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+            if (ring_fd != -1) ::close(ring_fd);
+        }
+
+        backend kind() const override { return backend::io_uring; }
+
+        void read(int fd, uint32_t buffer, uint32_t buffer_offset, uint32_t size, uint64_t offset) override {
+            submit(fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ, fd, buffer, buffer_offset, size, offset);
+        }
+
+        void write(int fd, uint32_t buffer, uint32_t buffer_offset, uint32_t size, uint64_t offset) override {
+            submit(fixed_buffers ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd, buffer, buffer_offset, size, offset);
+        }
+
+        Completion wait() override {
+            while (true) {
+                uint32_t head = *cq_head;
+                if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                    const io_uring_cqe& cqe = cqes[head & *cq_mask];
+                    Completion completion{ (uint32_t)cqe.user_data, cqe.res };
+                    __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                    return completion;
+                }
+                enter(unsubmitted, 1, IORING_ENTER_GETEVENTS);
+            }
+        }
+
+    private:
+        int ring_fd = -1;
+        void* sq_ring = MAP_FAILED;
+        void* cq_ring = MAP_FAILED;
+        io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+        size_t sq_ring_size = 0;
+        size_t cq_ring_size = 0;
+        size_t sqes_size = 0;
+
+        uint32_t* sq_tail = nullptr;
+        uint32_t* sq_mask = nullptr;
+        uint32_t* sq_array = nullptr;
+        uint32_t* cq_head = nullptr;
+        uint32_t* cq_tail = nullptr;
+        uint32_t* cq_mask = nullptr;
+        io_uring_cqe* cqes = nullptr;
+
+        bool fixed_buffers = false;
+        uint32_t unsubmitted = 0;                   // queued in the ring, but not taken by the kernel yet
+
+        UringAsyncIO(uint32_t depth, uint32_t buffer_size) : AsyncIO(depth, buffer_size) {}
+
+        bool setup() {
+            io_uring_params params{};
+            ring_fd = syscall(__NR_io_uring_setup, depth(), &params);
+            if (ring_fd == -1) return false;
+
+            sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+            cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+
+            sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+            if (sq_ring == MAP_FAILED) return false;
+            if (single_mmap) cq_ring = sq_ring;
+            else {
+                cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+                if (cq_ring == MAP_FAILED) return false;
+            }
+            sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            sqes = (io_uring_sqe*)mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED) return false;
+
+            auto sq = (uint8_t*)sq_ring;
+            sq_tail = (uint32_t*)(sq + params.sq_off.tail);
+            sq_mask = (uint32_t*)(sq + params.sq_off.ring_mask);
+            sq_array = (uint32_t*)(sq + params.sq_off.array);
+            auto cq = (uint8_t*)cq_ring;
+            cq_head = (uint32_t*)(cq + params.cq_off.head);
+            cq_tail = (uint32_t*)(cq + params.cq_off.tail);
+            cq_mask = (uint32_t*)(cq + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+            // registering counts against locked memory limit, without it requests still work, only a bit slower
+            std::vector<iovec> vectors;
+            for (uint32_t i=0; i < depth(); ++i) vectors.push_back({ buffer(i), buffer_size() });
+            fixed_buffers = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS,
+                                    vectors.data(), vectors.size()) == 0;
+            return true;
+        }
+
+        void submit(uint8_t opcode, int fd, uint32_t buffer_index, uint32_t buffer_offset, uint32_t size, uint64_t offset) {
+            uint32_t tail = *sq_tail;   // only this thread moves it
+            uint32_t index = tail & *sq_mask;
+
+            io_uring_sqe& sqe = sqes[index];
+            std::memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = opcode;
+            sqe.fd = fd;
+            sqe.off = offset;
+            sqe.addr = (uint64_t)(uintptr_t)(buffer(buffer_index) + buffer_offset);
+            sqe.len = size;
+            if (fixed_buffers) sqe.buf_index = buffer_index;
+            sqe.user_data = buffer_index;
+
+            sq_array[index] = index;
+            __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+            unsubmitted++;
+            enter(unsubmitted, 0, 0);
+        }
+
+        void enter(uint32_t to_submit, uint32_t min_complete, uint32_t flags) {
+            int result = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+            if (result >= 0) unsubmitted -= std::min<uint32_t>(result, unsubmitted);
+            else if (errno != EINTR and errno != EAGAIN and errno != EBUSY)
+                throw std::runtime_error("io_uring_enter failed: " + std::string(std::strerror(errno)));
+        }
+    };
+#endif
+}
+
+
+std::unique_ptr<AsyncIO> AsyncIO::create(uint32_t depth, uint32_t buffer_size, [[maybe_unused]] backend preferred) {
+#ifdef ASYNC_IO_HAS_URING
+    if (preferred == backend::io_uring) {
+        std::unique_ptr<AsyncIO> io = UringAsyncIO::open(depth, buffer_size);
+        if (io) return io;
+    }
+#endif
+    return std::make_unique<ThreadAsyncIO>(depth, buffer_size);
+}
+
+
+
+ReadAhead::ReadAhead(const PositionalFile& file, std::vector<Range> ranges, uint32_t depth, AsyncIO::backend preferred) :
+        file(file),
+        alignment(file.direct() ? PositionalFile::direct_alignment : 1),
+        ranges(std::move(ranges))
+{
+    uint32_t buffer_size = 1;
+    for (const Range& range : this->ranges) {
+        uint64_t lead = range.offset % alignment;
+        buffer_size = std::max<uint64_t>(buffer_size, (lead + range.size + alignment - 1) / alignment * alignment);
+    }
+    depth = std::max<uint32_t>(1, std::min<uint64_t>(depth, this->ranges.size()));
+
+    io = AsyncIO::create(depth, buffer_size, preferred);
+    slots.resize(depth);
+    for (uint32_t slot=0; slot < depth and next_to_queue < this->ranges.size(); ++slot) queue(slot);
+}
+
+
+ReadAhead::~ReadAhead() {
+    for (uint32_t slot=0; slot < slots.size(); ++slot)
+        while (slots[slot].busy) handle(io->wait());
+}
+
+
+bool ReadAhead::next(const uint8_t*& data, uint32_t& size) {
+    if (holding) {  // caller is done with the previous range, so its buffer takes the next one to read
+        holding = false;
+        if (next_to_queue < ranges.size()) queue((next_range - 1) % slots.size());
+    }
+    if (next_range >= ranges.size()) return false;
+
+    // ranges go round the slots, so this one is in slot (range % depth)
+    uint32_t slot = next_range % slots.size();
+    while (slots[slot].busy) handle(io->wait());
+
+    next_range++;
+    holding = true;
+    if (slots[slot].failed) return false;
+
+    data = io->buffer(slot) + slots[slot].lead;
+    size = ranges[slots[slot].range].size;
+    return true;
+}
+
+
+AsyncIO::backend ReadAhead::kind() const {
+    return io->kind();
+}
+
+
+void ReadAhead::queue(uint32_t slot) {
+    Slot& s = slots[slot];
+    const Range& range = ranges[next_to_queue++];
+    s.range = next_to_queue - 1;
+    s.lead = range.offset % alignment;
+    s.done = 0;
+    s.failed = false;
+    s.busy = range.size != 0;
+
+    uint32_t read_size = (s.lead + range.size + alignment - 1) / alignment * alignment;
+    if (s.busy) io->read(file.descriptor(), slot, 0, read_size, range.offset - s.lead);
+}
+
+
+void ReadAhead::handle(const AsyncIO::Completion& completion) {
+    Slot& s = slots[completion.buffer];
+    const Range& range = ranges[s.range];
+
+    if (completion.result <= 0) {   // error, or file ended before the range did
+        s.failed = true;
+        s.busy = false;
+        return;
+    }
+    s.done += completion.result;
+    uint32_t needed = s.lead + range.size;
+    if (s.done < needed) {  // short read, rest of it is asked for again
+        uint32_t read_size = (needed - s.done + alignment - 1) / alignment * alignment;
+        io->read(file.descriptor(), completion.buffer, s.done, read_size, range.offset - s.lead + s.done);
+    }
+    else s.busy = false;
+}
+
+
+
+DropBehind::DropBehind(const PositionalFile& file) :
+        file(file) {}
+
+
+DropBehind::~DropBehind() {
+    finish();
+}
+
+
+void DropBehind::written(uint64_t offset, uint64_t length) {
+    file.write_back(offset, length);
+    file.drop_cache(pending_offset, pending_length);   // it had the whole last write to get to storage
+    pending_offset = offset;
+    pending_length = length;
+}
+
+
+void DropBehind::finish() {
+    file.drop_cache(pending_offset, pending_length);
+    pending_length = 0;
+}
+
+
+
+WriteBehind::WriteBehind(const PositionalFile& file, uint64_t offset, uint32_t depth, uint32_t buffer_size,
+                         AsyncIO::backend preferred, bool drop_behind) :
+        file(file),
+        io(AsyncIO::create(std::max<uint32_t>(depth, 1), std::max<uint32_t>(buffer_size, 1), preferred)),
+        slots(io->depth()),
+        offset(offset),
+        filling(0)
+{
+    assert(!file.direct() or (offset % PositionalFile::direct_alignment == 0
+                              and io->buffer_size() % PositionalFile::direct_alignment == 0));
+    if (drop_behind and !file.direct()) dropper = std::make_unique<DropBehind>(file);
+}
+
+
+WriteBehind::~WriteBehind() {
+    while (in_flight != 0) handle(io->wait());
+}
+
+
+bool WriteBehind::write(const uint8_t* data, uint64_t size) {
+    while (size != 0 and !failed) {
+        Slot& s = slots[filling];
+        if (s.size == 0) s.offset = offset;
+
+        uint32_t part = std::min<uint64_t>(size, io->buffer_size() - s.size);
+        std::memcpy(io->buffer(filling) + s.size, data, part);
+        s.size += part;
+        offset += part;
+        data += part;
+        size -= part;
+
+        if (s.size == io->buffer_size()) {
+            submit(filling);
+            filling = free_slot();
+        }
+    }
+    return !failed;
+}
+
+
+bool WriteBehind::finish() {
+    Slot& last = slots[filling];
+    uint32_t padding = 0;
+    if (file.direct() and last.size % PositionalFile::direct_alignment != 0) {
+        // buffers are allocated in whole multiples of alignment, so the padding fits
+        padding = PositionalFile::direct_alignment - last.size % PositionalFile::direct_alignment;
+        std::memset(io->buffer(filling) + last.size, 0, padding);
+        last.size += padding;
+    }
+
+    if (last.size != 0) submit(filling);
+    while (in_flight != 0) handle(io->wait());
+    filling = free_slot();
+
+    if (padding != 0 and !failed) failed = !file.resize(offset);
+    if (dropper) dropper->finish();
+    return !failed;
+}
+
+
+AsyncIO::backend WriteBehind::kind() const {
+    return io->kind();
+}
+
+
+void WriteBehind::submit(uint32_t slot) {
+    Slot& s = slots[slot];
+    s.busy = true;
+    s.done = 0;
+    in_flight++;
+    io->write(file.descriptor(), slot, 0, s.size, s.offset);
+}
+
+
+void WriteBehind::handle(const AsyncIO::Completion& completion) {
+    Slot& s = slots[completion.buffer];
+    if (completion.result > 0) s.done += completion.result;
+    else failed = true;
+
+    if (!failed and s.done < s.size) {   // short write, rest of it goes again
+        io->write(file.descriptor(), completion.buffer, s.done, s.size - s.done, s.offset + s.done);
+        return;
+    }
+    if (dropper and !failed) dropper->written(s.offset, s.size);
+    s.busy = false;
+    s.size = 0;
+    in_flight--;
+}
+
+
+uint32_t WriteBehind::free_slot() {
+    while (true) {
+        for (uint32_t slot=0; slot < slots.size(); ++slot)
+            if (!slots[slot].busy and slots[slot].size == 0) return slot;
+        handle(io->wait());
+    }
+}
@@ -0,0 +1,167 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+
+#include "positional_file.h"
+
+
+// Reads and writes at explicit offsets, done in the background while the caller keeps working.
+// Data goes through buffers owned by the queue (registered with the kernel, when io_uring is used), there are depth
+// of them, buffer_size bytes each. Requests finish in any order. Meant to be driven by a single thread
+class AsyncIO
+{
+public:
+    enum class backend : uint8_t { io_uring, thread };
+
+    struct Completion {
+        uint32_t buffer;                            // buffer of the request that finished
+        int64_t result;                             // bytes transferred, or -errno
+    };
+
+    // io_uring if it was compiled in (TK2K_IO_URING) and the kernel allows it, a thread doing pread/pwrite otherwise
+    static std::unique_ptr<AsyncIO> create(uint32_t depth, uint32_t buffer_size, backend preferred = backend::io_uring);
+
+    virtual ~AsyncIO() = default;
+
+    virtual backend kind() const = 0;
+
+    uint8_t* buffer(uint32_t index) const;
+    uint32_t depth() const;
+    uint32_t buffer_size() const;
+
+    // Queues transfer of size bytes between file's offset and buffer (starting at buffer_offset)
+    virtual void read(int fd, uint32_t buffer, uint32_t buffer_offset, uint32_t size, uint64_t offset) = 0;
+    virtual void write(int fd, uint32_t buffer, uint32_t buffer_offset, uint32_t size, uint64_t offset) = 0;
+
+    // Waits until any of the queued requests is done
+    virtual Completion wait() = 0;
+
+protected:
+    AsyncIO(uint32_t depth, uint32_t buffer_size);
+
+private:
+    struct aligned_free { void operator()(uint8_t* p) const { std::free(p); } };
+
+    std::vector<std::unique_ptr<uint8_t[], aligned_free>> buffers;
+    uint32_t size_of_buffer;
+};
+
+
+// Reads given ranges of a file in order, with up to depth of them being read ahead of the caller.
+// Ranges don't have to be aligned for direct I/O, whole aligned blocks around them are read if file needs it
+class ReadAhead
+{
+public:
+    struct Range {
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    static constexpr uint32_t default_depth = 2;
+
+    ReadAhead(const PositionalFile& file, std::vector<Range> ranges, uint32_t depth = default_depth,
+              AsyncIO::backend preferred = AsyncIO::backend::io_uring);
+
+    // Waits for reads which are still going, since they write into buffers of this
+    ~ReadAhead();
+
+    // Next range's data, valid until the next call. Returns false past the last range, or if it couldn't be read whole
+    bool next(const uint8_t*& data, uint32_t& size);
+
+    AsyncIO::backend kind() const;
+
+private:
+    struct Slot {
+        uint64_t range = 0;                         // index of range being read into this buffer
+        uint32_t lead = 0;                          // bytes read before the range, so the read starts aligned
+        uint32_t done = 0;                          // bytes read so far, lead included
+        bool busy = false;                          // request in flight
+        bool failed = false;
+    };
+
+    const PositionalFile& file;
+    uint32_t alignment;                             // of reads' offsets and sizes
+    std::vector<Range> ranges;
+    std::unique_ptr<AsyncIO> io;
+    std::vector<Slot> slots;
+    uint64_t next_range = 0;                        // next one to hand out
+    uint64_t next_to_queue = 0;                     // next one to start reading
+    bool holding = false;                           // caller still has the buffer of (next_range - 1)
+
+    void queue(uint32_t slot);
+    void handle(const AsyncIO::Completion& completion);
+};
+
+
+// Keeps what's written to a file out of page cache, for files which can't skip it: every written range is sent
+// to storage right away, and dropped from page cache once the next one is written, so the writer doesn't wait for it
+class DropBehind
+{
+public:
+    explicit DropBehind(const PositionalFile& file);
+
+    // Drops whatever is left
+    ~DropBehind();
+
+    void written(uint64_t offset, uint64_t length);
+    void finish();
+
+private:
+    const PositionalFile& file;
+    uint64_t pending_offset = 0;                    // range written before the last one, still in page cache
+    uint64_t pending_length = 0;
+};
+
+
+// Writes data at consecutive offsets of a file, in the background. Data is copied into a free buffer first,
+// so the caller can reuse its memory as soon as write() returns
+class WriteBehind
+{
+public:
+    static constexpr uint32_t default_depth = 4;
+    static constexpr uint32_t default_buffer_size = 1u << 20;  // 1 MiB
+
+    // With drop_behind, written data is kept out of page cache (through DropBehind, if file isn't direct already)
+    WriteBehind(const PositionalFile& file, uint64_t offset, uint32_t depth = default_depth,
+                uint32_t buffer_size = default_buffer_size, AsyncIO::backend preferred = AsyncIO::backend::io_uring,
+                bool drop_behind = false);
+
+    // Waits for writes which are still going
+    ~WriteBehind();
+
+    // Returns false if any write failed so far
+    bool write(const uint8_t* data, uint64_t size);
+
+    // Writes out what's buffered, and waits until all of it is in the file. Returns false if any write failed.
+    // With direct I/O last write is padded up to alignment, and file is cut back after it, so nothing can follow it
+    bool finish();
+
+    AsyncIO::backend kind() const;
+
+private:
+    struct Slot {
+        uint64_t offset = 0;                        // where in file buffer's data goes
+        uint32_t size = 0;
+        uint32_t done = 0;
+        bool busy = false;
+    };
+
+    const PositionalFile& file;
+    std::unique_ptr<AsyncIO> io;
+    std::unique_ptr<DropBehind> dropper;
+    std::vector<Slot> slots;
+    uint64_t offset;                                // where the next byte goes
+    uint32_t filling;                               // slot being filled by write()
+    uint32_t in_flight = 0;
+    bool failed = false;
+
+    void submit(uint32_t slot);
+    void handle(const AsyncIO::Completion& completion);
+    uint32_t free_slot();
+};
+
+#endif // ASYNC_IO_H
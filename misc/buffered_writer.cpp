@@ -0,0 +1,71 @@
+#include "buffered_writer.h"
+
+#include <cassert>
+#include <cstring>
+
+
+BufferedWriter::BufferedWriter(std::fstream& output, uint32_t capacity) :
+        output(output),
+        capacity((capacity + alignment - 1) / alignment * alignment)
+{
+    assert(this->capacity != 0);
+    buffer.reset((char*)std::aligned_alloc(alignment, this->capacity));
+    assert(buffer != nullptr);
+}
+
+
+BufferedWriter::~BufferedWriter() {
+    drain();
+}
+
+
+void BufferedWriter::write(const char* data, uint64_t size) {
+    total += size;
+
+    if (used + size > capacity) {
+        // topping buffer up first, so the stream keeps getting full buffers
+        uint32_t part = capacity - used;
+        std::memcpy(buffer.get() + used, data, part);
+        used += part;
+        data += part;
+        size -= part;
+        drain();
+
+        if (size >= capacity) {     // whole buffers of it wouldn't gain anything from copying
+            uint64_t direct = size - size % capacity;
+            output.write(data, direct);
+            data += direct;
+            size -= direct;
+        }
+    }
+    std::memcpy(buffer.get() + used, data, size);
+    used += size;
+}
+
+
+void BufferedWriter::write_integer(uint64_t value, uint8_t byte_count) {
+    assert(byte_count <= 8);
+    char bytes[8];
+    for (uint8_t i=0; i < byte_count; i++)
+        bytes[i] = (char)((value >> (i*8u)) & 0xFFu);
+    write(bytes, byte_count);
+}
+
+
+bool BufferedWriter::commit() {
+    drain();
+    output.flush();
+    return (bool)output;
+}
+
+
+uint64_t BufferedWriter::written() const {
+    return total;
+}
+
+
+void BufferedWriter::drain() {
+    if (used == 0) return;
+    output.write(buffer.get(), used);
+    used = 0;
+}
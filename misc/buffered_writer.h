@@ -0,0 +1,46 @@
+#ifndef BUFFERED_WRITER_H
+#define BUFFERED_WRITER_H
+
+#include <fstream>
+#include <memory>
+#include <cstdlib>
+
+
+// Gathers small writes (block headers, checksums) together with the payloads after them in a large aligned buffer,
+// so the stream gets few big writes instead of many small ones. Nothing is flushed before commit()
+class BufferedWriter
+{
+public:
+    static const uint32_t alignment = 4096;
+    static const uint32_t default_capacity = 1u << 20;     // 1 MiB
+
+    // capacity is rounded up to a multiple of alignment
+    explicit BufferedWriter(std::fstream& output, uint32_t capacity = default_capacity);
+
+    // Whatever is still in the buffer is handed to the stream, without flushing it
+    ~BufferedWriter();
+
+    void write(const char* data, uint64_t size);
+
+    // Integer as little endian, byte_count bytes long
+    void write_integer(uint64_t value, uint8_t byte_count);
+
+    // Hands buffered data to the stream, and flushes it. Returns false if writing failed
+    bool commit();
+
+    // Bytes given to write() since the writer was created
+    uint64_t written() const;
+
+private:
+    struct aligned_free { void operator()(char* p) const { std::free(p); } };
+
+    std::fstream& output;
+    std::unique_ptr<char[], aligned_free> buffer;
+    uint32_t capacity;
+    uint32_t used = 0;
+    uint64_t total = 0;
+
+    void drain();
+};
+
+#endif // BUFFERED_WRITER_H
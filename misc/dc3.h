@@ -670,9 +670,10 @@ namespace dc3
                 return;
 
             case 1:
-            {
-                SA = new uint32_t [1];
-                SA[0] = 0;
+            {   // suffix array includes the one starting at EOF, which goes first
+                SA = new uint32_t [2];
+                SA[0] = 1;
+                SA[1] = 0;
                 return;
             }
 
@@ -0,0 +1,80 @@
+#include "locked_buffer.h"
+
+#include <new>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <utility>
+
+
+LockedBuffer::LockedBuffer(uint64_t size) {
+    if (size == 0) return;
+
+    // mapped on its own, so no other data shares (and unlocks) its pages
+    static const uint64_t page_size = ::sysconf(_SC_PAGESIZE);
+    uint64_t pages_length = (size + page_size - 1) / page_size * page_size;
+    void* mapped = ::mmap(nullptr, pages_length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) throw std::bad_alloc();
+
+    address = (uint8_t*)mapped;
+    length = size;
+    mapped_length = pages_length;
+    locked = ::mlock(address, mapped_length) == 0;
+#ifdef MADV_DONTDUMP
+    ::madvise(address, mapped_length, MADV_DONTDUMP);
+#endif
+}
+
+
+LockedBuffer::~LockedBuffer() {
+    release();
+}
+
+
+LockedBuffer::LockedBuffer(LockedBuffer&& other) noexcept :
+        address(std::exchange(other.address, nullptr)),
+        length(std::exchange(other.length, 0)),
+        mapped_length(std::exchange(other.mapped_length, 0)),
+        locked(std::exchange(other.locked, false)) {}
+
+
+LockedBuffer& LockedBuffer::operator=(LockedBuffer&& other) noexcept {
+    if (this != &other) {
+        release();
+        address = std::exchange(other.address, nullptr);
+        length = std::exchange(other.length, 0);
+        mapped_length = std::exchange(other.mapped_length, 0);
+        locked = std::exchange(other.locked, false);
+    }
+    return *this;
+}
+
+
+uint8_t* LockedBuffer::data() const {
+    return address;
+}
+
+
+uint64_t LockedBuffer::size() const {
+    return length;
+}
+
+
+bool LockedBuffer::is_locked() const {
+    return locked;
+}
+
+
+void LockedBuffer::release() {
+    if (address == nullptr) return;
+
+    // through volatile, so compiler can't leave it out as a dead store
+    auto bytes = (volatile uint8_t*)address;
+    for (uint64_t i=0; i < length; ++i) bytes[i] = 0;
+
+    if (locked) ::munlock(address, mapped_length);
+    ::munmap(address, mapped_length);
+    address = nullptr;
+    length = 0;
+    mapped_length = 0;
+    locked = false;
+}
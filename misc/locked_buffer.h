@@ -0,0 +1,35 @@
+#ifndef LOCKED_BUFFER_H
+#define LOCKED_BUFFER_H
+
+#include <cstdint>
+
+
+// Memory for secrets (passwords, keys). It's locked, so it's never swapped out (as long as the OS lets it be locked,
+// see RLIMIT_MEMLOCK), left out of core dumps, and zeroed before it's freed
+class LockedBuffer
+{
+public:
+    LockedBuffer() = default;
+    explicit LockedBuffer(uint64_t size);   // zeroed
+    ~LockedBuffer();
+
+    LockedBuffer(const LockedBuffer&) = delete;
+    LockedBuffer& operator=(const LockedBuffer&) = delete;
+    LockedBuffer(LockedBuffer&& other) noexcept;
+    LockedBuffer& operator=(LockedBuffer&& other) noexcept;
+
+    uint8_t* data() const;
+    uint64_t size() const;
+    bool is_locked() const;                 // false if the OS didn't let it be locked (it's still zeroed when freed)
+
+    // Zeroes and frees the memory
+    void release();
+
+private:
+    uint8_t* address = nullptr;
+    uint64_t length = 0;
+    uint64_t mapped_length = 0;             // whole pages, since that's what gets locked
+    bool locked = false;
+};
+
+#endif // LOCKED_BUFFER_H
@@ -0,0 +1,114 @@
+#include "mapped_file.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <utility>
+
+
+MappedFile::MappedFile(const std::filesystem::path& path, view mode) {
+    open(path, mode);
+}
+
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+
+MappedFile::MappedFile(MappedFile&& other) noexcept :
+        address(std::exchange(other.address, nullptr)),
+        length(std::exchange(other.length, 0)) {}
+
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        close();
+        address = std::exchange(other.address, nullptr);
+        length = std::exchange(other.length, 0);
+    }
+    return *this;
+}
+
+
+bool MappedFile::open(const std::filesystem::path& path, view mode) {
+    close();
+
+    int fd;
+    do fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    while (fd == -1 and errno == EINTR);
+    if (fd == -1) return false;
+
+    struct stat info{};
+    if (::fstat(fd, &info) != 0 or info.st_size <= 0) {
+        ::close(fd);
+        return false;
+    }
+
+    // mapping stays valid after the descriptor is closed
+    void* mapped;
+    if (mode == view::read_only) mapped = ::mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    else mapped = ::mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) return false;
+
+    address = (uint8_t*)mapped;
+    length = info.st_size;
+    return true;
+}
+
+
+void MappedFile::close() {
+    if (address == nullptr) return;
+    ::munmap(address, length);
+    address = nullptr;
+    length = 0;
+}
+
+
+bool MappedFile::is_open() const {
+    return address != nullptr;
+}
+
+
+uint8_t* MappedFile::data() const {
+    return address;
+}
+
+
+uint64_t MappedFile::size() const {
+    return length;
+}
+
+
+bool MappedFile::contains(uint64_t offset, uint64_t range_length) const {
+    return address != nullptr and offset <= length and range_length <= length - offset;
+}
+
+
+void MappedFile::advise_sequential() const {
+    advise(0, length, MADV_SEQUENTIAL);
+}
+
+
+void MappedFile::will_need(uint64_t offset, uint64_t range_length) const {
+    advise(offset, range_length, MADV_WILLNEED);
+}
+
+
+void MappedFile::dont_need(uint64_t offset, uint64_t range_length) const {
+    advise(offset, range_length, MADV_DONTNEED);
+}
+
+
+void MappedFile::advise(uint64_t offset, uint64_t range_length, int advice) const {
+    if (address == nullptr or offset >= length) return;
+    if (range_length > length - offset) range_length = length - offset;
+
+    // madvise wants a page-aligned start
+    static const uint64_t page_size = ::sysconf(_SC_PAGESIZE);
+    uint64_t aligned_offset = offset - offset % page_size;
+    ::madvise(address + aligned_offset, range_length + (offset - aligned_offset), advice);
+}
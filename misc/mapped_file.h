@@ -0,0 +1,50 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstdint>
+#include <filesystem>
+
+
+// Whole file mapped into memory, so it can be read without copying it into buffers first.
+// The file itself is never changed through the mapping
+class MappedFile
+{
+public:
+    enum class view : uint8_t {
+        copy_on_write,      // pages can be written to, each one gets copied on the first write
+        read_only           // shared with the file, so whatever is written to the file (through other means) shows up
+    };
+
+    MappedFile() = default;
+    explicit MappedFile(const std::filesystem::path& path, view mode = view::copy_on_write);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept;
+    MappedFile& operator=(MappedFile&& other) noexcept;
+
+    // Unmaps whatever was mapped before. Returns false if the file couldn't be mapped (empty files can't be)
+    bool open(const std::filesystem::path& path, view mode = view::copy_on_write);
+    void close();
+    bool is_open() const;
+
+    uint8_t* data() const;
+    uint64_t size() const;
+
+    // Whether length bytes at offset are all mapped. Nothing is, if file isn't open
+    bool contains(uint64_t offset, uint64_t length) const;
+
+    // Hints for the kernel, they don't change what's read
+    void advise_sequential() const;                         // read ahead more, and drop pages behind sooner
+    void will_need(uint64_t offset, uint64_t length) const; // start reading this range now
+    void dont_need(uint64_t offset, uint64_t length) const; // this range won't be read again (writes to it are lost)
+
+private:
+    uint8_t* address = nullptr;
+    uint64_t length = 0;
+
+    void advise(uint64_t offset, uint64_t range_length, int advice) const;
+};
+
+#endif // MAPPED_FILE_H
@@ -9,14 +9,17 @@
 #include <cassert>
 #include <fstream>
 #include <thread>
-#include <sstream>
 #include <random>
 #include <filesystem>
 #include <iostream>
 
 #include "../integrity_validation.h"
 #include "../compression.h"
+#include "../block_index.h"
+#include "../blake3.h"
 #include "../cryptography.h"
+#include "async_io.h"
+#include "mapped_file.h"
 
 namespace multithreading
 {
@@ -24,11 +27,16 @@ namespace multithreading
     inline uint16_t calculate_progress(float current, float whole) {return roundf(current*100 / whole);}
 
     void processing_worker(multithreading::mode task, Compression* comp, uint16_t flags, bool& aborting_var, bool* is_finished,
-                           uint8_t*& key, uint8_t*& metadata, uint32_t& metadata_size, uint32_t* progress_ptr = nullptr)
+                           uint8_t*& key, uint8_t*& metadata, uint32_t& metadata_size, uint32_t* progress_ptr = nullptr,
+                           blake3::Output* tree_node = nullptr)
     {
         std::bitset<16> bin_flags = flags;
+        // block's subtree of file's BLAKE3 tree, blocks are always a power of 2 chunks (if there's more than one)
+        uint64_t first_chunk = (uint64_t)comp->part_id * (BlockIndex::block_size(flags, UINT64_MAX) / blake3::chunk_size);
         if (task == multithreading::mode::compress)
         {
+            if (tree_node != nullptr and !aborting_var) *tree_node = blake3::subtree(comp->text, comp->size, first_chunk);
+
             if (bin_flags[0] and !aborting_var) {
                 comp->BWT_make();
                 if (progress_ptr != nullptr) (*progress_ptr)++;
@@ -58,9 +66,25 @@ namespace multithreading
                 comp->rANS_make();
                 if (progress_ptr != nullptr) (*progress_ptr)++;
             }
+
+            // encrypted last, since encrypted data doesn't compress
+            if (bin_flags[6] and key != nullptr and !aborting_var) {
+                if (crypto::AES128::cipher_of(metadata, metadata_size) == crypto::ChaCha20_Poly1305)
+                    comp->ChaCha20Poly1305_make(key, crypto::ChaCha20Poly1305::key_size);
+                else comp->AES128_make(key, crypto::AES128::key_size);
+            }
         }
         else if (task == multithreading::mode::decompress)
         {
+            if ( bin_flags[6] and key != nullptr and !aborting_var) {
+                if (crypto::AES128::cipher_of(metadata, metadata_size) != crypto::ChaCha20_Poly1305)
+                    comp->AES128_reverse(key, crypto::AES128::key_size);
+                else if (!comp->ChaCha20Poly1305_reverse(key, crypto::ChaCha20Poly1305::key_size)) {
+                    *is_finished = true;    // block was tampered with, none of it is decoded
+                    return;
+                }
+            }
+
             if ( bin_flags[5] and !aborting_var) {
                 comp->rANS_reverse();
                 if (progress_ptr != nullptr) (*progress_ptr)++;
@@ -90,18 +114,72 @@ namespace multithreading
                 comp->BWT_reverse();
                 if (progress_ptr != nullptr) (*progress_ptr)++;
             }
+
+            if (tree_node != nullptr and !aborting_var) *tree_node = blake3::subtree(comp->text, comp->size, first_chunk);
         }
         *is_finished = true;
     }
 
 
+    uint8_t checksum_length(uint16_t flags)
+    {
+        std::bitset<16> bin_flags = flags;
+        // if more than one is set, the last one computed during compression is the one in archive.
+        // BLAKE3 is computed instead of all the others
+        if (bin_flags[8]) return 64;    // BLAKE3
+        if (bin_flags[13]) return 64;   // SHA-256
+        if (bin_flags[14]) return 10;   // CRC-32
+        if (bin_flags[15]) return 40;   // SHA-1
+        return 0;
+    }
+
+
+    std::string stream_checksum(std::fstream& output, uint16_t flags, uint64_t original_size, bool& aborting_var)
+    {
+        IntegrityValidation iv;
+        uint8_t length = checksum_length(flags);
+        if ( (flags >> 8) & 1 )  // BLAKE3
+            return iv.get_BLAKE3_from_stream(output, aborting_var);
+        else if ( length == 10 )  // CRC-32
+            return iv.get_CRC32_from_stream(output, aborting_var);
+        else if ( length == 40 ) // SHA-1
+            return iv.get_SHA1_from_stream(output, original_size, aborting_var);
+        else if ( length == 64 )  // SHA-256
+            return iv.get_SHA256_from_stream(output, aborting_var);
+        return "";
+    }
+
+
+    std::string file_checksum(const std::string& path, uint16_t flags, bool& aborting_var)
+    {
+        IntegrityValidation iv;
+        if ((flags >> 8) & 1) return iv.get_BLAKE3_from_file(path, aborting_var);
+        switch (checksum_length(flags)) {
+            case 64: return iv.get_SHA256_from_file(path, aborting_var);
+            case 10: return iv.get_CRC32_from_file(path, aborting_var);
+            case 40: return iv.get_SHA1_from_file(path, aborting_var);
+            default: return "";
+        }
+    }
+
+
     void processing_scribe( multithreading::mode task, std::fstream& output, std::vector<Compression*>& comp_v,
                             bool worker_finished[], uint32_t block_count, uint64_t* compressed_size,
-                            std::string& checksum, bool& checksum_done, uint64_t original_size, bool& aborting_var, bool* successful )
+                            std::string& checksum, bool& checksum_done, uint64_t original_size, bool& aborting_var, bool* successful,
+                            uint16_t flags, BlockIndex* block_index, WriteBehind* write_behind, DropBehind* drop_behind,
+                            std::vector<blake3::Output>* tree_nodes )
     {
         assert(output.is_open());
+        BufferedWriter writer(output);      // block headers go out together with payloads, flushed only at the end
         uint32_t next_to_write = 0;  // index of last written block of data in comp_v
-        if (task == multithreading::mode::compress) *compressed_size = 0;
+        uint64_t start = 0;          // where in output the first block goes (compression only)
+        uint64_t dropped = 0;        // bytes of output given to drop_behind already
+        bool rejected = false;       // some block didn't match its tag (decompression only)
+        if (task == multithreading::mode::compress) {
+            *compressed_size = 0;
+            if (block_index != nullptr) block_index->blocks.clear();
+            start = output.tellp();
+        }
         std::this_thread::sleep_for(std::chrono::milliseconds(100));
         while (next_to_write != block_count)
         {
@@ -109,15 +187,24 @@ namespace multithreading
 
             if (worker_finished[next_to_write]) {
                 if (task == multithreading::mode::compress) {
-                    std::stringstream block_metadata;
-                    block_metadata.write((char *) &next_to_write, sizeof(next_to_write)); // part number
-                    block_metadata.write((char *) &comp_v[next_to_write]->size,
-                                         sizeof(comp_v[next_to_write]->size));
-                    output << block_metadata.rdbuf();
+                    writer.write_integer(next_to_write, 4);                    // part number
+                    writer.write_integer(comp_v[next_to_write]->size, 4);
+                    if (block_index != nullptr)     // payload goes right after part number and block size
+                        block_index->add(*compressed_size + 8, comp_v[next_to_write]->size, flags, original_size);
                     *compressed_size += comp_v[next_to_write]->size + 4 + 4;    // due to part number and block size
                 }
 
-                comp_v[next_to_write]->save_text(output);
+                if (comp_v[next_to_write]->rejected) rejected = true;
+                else if (write_behind != nullptr and !aborting_var)
+                    write_behind->write(comp_v[next_to_write]->text, comp_v[next_to_write]->size);
+                else comp_v[next_to_write]->save_text(writer);
+
+                // with drop_behind every block is flushed on its own, so it can leave page cache before the next one
+                if (drop_behind != nullptr and task == multithreading::mode::compress) {
+                    writer.commit();
+                    drop_behind->written(start + dropped, writer.written() - dropped);
+                    dropped = writer.written();
+                }
                 delete comp_v[next_to_write];
                 comp_v[next_to_write] = nullptr;
                 next_to_write++;
@@ -128,31 +215,28 @@ namespace multithreading
             while (!checksum_done or aborting_var)
                 std::this_thread::sleep_for(std::chrono::milliseconds(50));
             if (aborting_var) return;
-            if (checksum.length() != 0) output.write(checksum.c_str(), checksum.length());
-            *successful = true; // if this didn't crash, then I guess it succeeded
+            // workers hashed their own blocks, only the top of the tree is left
+            if (tree_nodes != nullptr) checksum = blake3::join(*tree_nodes);
+            if (checksum.length() != 0) writer.write(checksum.c_str(), checksum.length());
+            *successful = writer.commit(); // if this didn't crash, then I guess it succeeded
 
         }
         else if (task == multithreading::mode::decompress)
         {
             while (!checksum_done) std::this_thread::sleep_for(std::chrono::milliseconds(50));
             if (aborting_var) return;
-            if (checksum.length() != 0)
+            // checksum is computed from the file itself, so all of it has to be there
+            writer.commit();
+            if (write_behind != nullptr and !write_behind->finish()) {
+                *successful = false;
+                return;
+            }
+            if (rejected) *successful = false;
+            else if (checksum.length() != 0)
             {
 
-                IntegrityValidation iv;
-                std::string new_checksum;
-                if ( checksum.length() == 10 )  // CRC-32
-                {
-                    new_checksum = iv.get_CRC32_from_stream(output, aborting_var);
-                }
-                else if ( checksum.length() == 40 ) // SHA-1
-                {
-                    new_checksum = iv.get_SHA1_from_stream(output, original_size, aborting_var);
-                }
-                else if (checksum.length() == 64 )  // SHA-256
-                {
-                    new_checksum = iv.get_SHA256_from_stream(output, aborting_var);
-                }
+                std::string new_checksum = tree_nodes != nullptr ? blake3::join(*tree_nodes)
+                                                                 : stream_checksum(output, flags, original_size, aborting_var);
                 std::cout << "new checksum == old one?\n" << new_checksum << "\n" << checksum << std::endl;
 
                 if (new_checksum == checksum) {
@@ -179,9 +263,13 @@ namespace multithreading
                             bool validate_integrity,
                             uint32_t* partialProgress,
                             uint32_t* totalProgress,
+                            BlockIndex* block_index=nullptr,
                             uint8_t** key=nullptr,
                             uint8_t* metadata=nullptr,
-                            uint32_t metadata_size=0)
+                            uint32_t metadata_size=0,
+                            const PositionalFile* archive_io=nullptr,
+                            const MappedFile* archive_map=nullptr,
+                            bool direct_io=false)
     /*/ 1. delegates work to each thread
     // 2. calculates checksum and sends it to scribe, after all the blocks of data have been processed
 
@@ -191,28 +279,41 @@ namespace multithreading
 
     // decompression:
     // key in the beginning is PBKDF2(pw), and is swapped with the random one before worker threads are started
-    // metadata starts empty, and then is extracted from a file */
+    // metadata starts empty, and then is extracted from a file
+
+    // block_index:
+    // compression fills it, decompression uses it (if it's not empty) to find each block,
+    // instead of reading them one after another. Either way archive_stream starts at file's data
+
+    // archive_io:
+    // if it's given along with the index, blocks are read from it ahead of workers, in the background.
+    // Blocks of the file being compressed are taken from its mapping (or read ahead, if it can't be mapped),
+    // and decompressed ones are written behind
+
+    // archive_map:
+    // if it's given along with the index, and covers the whole file, workers decode blocks straight from it
+
+    // direct_io:
+    // file being compressed, or decompressed one, skips page cache (or is dropped from it right behind, if that's not
+    // possible), and so does the part of archive holding its blocks (through archive_io). Meant for huge files,
+    // which would push everything else out of memory otherwise */
     {
         assert(task == mode::compress xor task == mode::decompress);
         assert(archive_stream.is_open());
         //assert(std::filesystem::exists(target_path));
 
         std::bitset<16> bin_flags = flags;
-        uint32_t block_size = 1 << 24;  // 2^24 Bytes = 16 MiB, default block size
-
-        if (bin_flags[9]) block_size >>= 1;
-        if (bin_flags[10]) block_size >>= 2;
-        if (bin_flags[11]) block_size >>= 4;
-        if (bin_flags[12]) block_size >>= 8;
+        uint32_t block_size = BlockIndex::block_size(flags, original_size);
+        uint32_t block_count = BlockIndex::block_count(flags, original_size);
 
+        // with BLAKE3, every worker hashes its own block. Blocks smaller than a chunk can't be subtrees of their own,
+        // file is hashed as a whole then
+        bool tree_hash = bin_flags[8] and block_count > 0 and (block_count == 1 or block_size % blake3::chunk_size == 0);
+        std::vector<blake3::Output> tree_nodes(tree_hash ? block_count : 0);
 
-
-        uint32_t block_count = ceill((long double)original_size / block_size);
-        if (block_count == 1) block_size = original_size;
-        if (block_count == 0) {
-            block_count = 1;
-            block_size = 0;
-        }
+        bool use_index = task == multithreading::mode::decompress and block_index != nullptr
+                         and block_index->blocks.size() == block_count;
+        uint64_t data_location = use_index ? (uint64_t)archive_stream.tellg() : 0;
 
         // preparing vector of empty Compression objects for threads
         std::vector<Compression*> comp_v;
@@ -243,6 +344,98 @@ namespace multithreading
             task_started_arr[i] = false;
         }
 
+        // File being compressed is mapped, and workers take their blocks straight from the mapping, without copying
+        // them. Pages are read in as the first stage of each worker goes through them, and get freed with the mapping
+        MappedFile source_map;
+        if (task == multithreading::mode::compress and !direct_io and source_map.open(target_path)) {
+            if (source_map.size() >= original_size) source_map.advise_sequential();
+            else source_map.close();    // file has shrunk since it was added
+        }
+
+        // Archive being decompressed may be mapped already
+        bool archive_mapped = use_index and !direct_io and archive_map != nullptr
+                              and archive_map->contains(data_location, block_index->end());
+
+        // Otherwise files of more than one block are read ahead of workers, so they don't wait for storage between
+        // blocks, and decompressed ones are written behind the scribe
+        PositionalFile source_io;
+        PositionalFile target_io;
+        std::unique_ptr<ReadAhead> read_ahead;
+        std::unique_ptr<WriteBehind> write_behind;
+        std::unique_ptr<DropBehind> archive_dropper;
+        auto caching = direct_io ? PositionalFile::caching::direct : PositionalFile::caching::normal;
+        if (block_count > 1) {
+            std::vector<ReadAhead::Range> ranges;
+            if (task == multithreading::mode::compress and !source_map.is_open()
+                and source_io.open(target_path, PositionalFile::access::read, caching)) {
+                for (uint32_t i=0; i < block_count; ++i) {
+                    uint64_t block_start = (uint64_t)i * block_size;
+                    ranges.push_back({ block_start, (uint32_t)std::min<uint64_t>(block_size, original_size - block_start) });
+                }
+                read_ahead = std::make_unique<ReadAhead>(source_io, std::move(ranges));
+            }
+            else if (task == multithreading::mode::decompress) {
+                if (use_index and !archive_mapped and archive_io != nullptr and archive_io->is_open()) {
+                    for (const BlockIndex::Entry& entry : block_index->blocks)
+                        ranges.push_back({ data_location + entry.location, entry.stored_size });
+                    read_ahead = std::make_unique<ReadAhead>(*archive_io, std::move(ranges));
+                }
+                if (target_io.open(target_path, PositionalFile::access::read_write, caching))
+                    write_behind = std::make_unique<WriteBehind>(target_io, 0, WriteBehind::default_depth,
+                                                                 WriteBehind::default_buffer_size,
+                                                                 AsyncIO::backend::io_uring, direct_io);
+            }
+            if (task == multithreading::mode::compress and direct_io and archive_io != nullptr and archive_io->is_open())
+                archive_dropper = std::make_unique<DropBehind>(*archive_io);
+        }
+
+        // Fills comp_v[i] with i-th block. If it couldn't be mapped or read ahead, it's read from the stream right here
+        auto load_block = [&](uint32_t i) {
+            const uint8_t* data;
+            uint32_t size;
+            if (source_map.is_open()) {
+                uint64_t block_start = (uint64_t)i * block_size;
+                comp_v[i]->borrow_text(source_map.data() + block_start,
+                                       (uint32_t)std::min<uint64_t>(block_size, original_size - block_start));
+                comp_v[i]->part_id = i;
+                source_map.will_need(block_start + block_size, block_size);    // next block's worker won't wait for it
+            }
+            else if (archive_mapped) {
+                const BlockIndex::Entry& entry = block_index->blocks[i];
+                comp_v[i]->borrow_text(archive_map->data() + data_location + entry.location, entry.stored_size);
+                comp_v[i]->part_id = i;
+                archive_map->will_need(data_location + entry.location + entry.stored_size, block_size);
+            }
+            else if (read_ahead and read_ahead->next(data, size)) {
+                comp_v[i]->load_text(data, size);
+                comp_v[i]->part_id = i;
+
+                // it's copied already, so if it had to go through page cache, it doesn't have to stay there
+                if (direct_io and task == multithreading::mode::compress and !source_io.direct())
+                    source_io.drop_cache((uint64_t)i * block_size, size);
+                else if (direct_io and task == multithreading::mode::decompress)
+                    archive_io->drop_cache(data_location + block_index->blocks[i].location, size);
+            }
+            else if (task == multithreading::mode::compress) {
+                comp_v[i]->load_part(target_stream, original_size, i, block_size);
+                comp_v[i]->part_id = i;
+            }
+            else if (use_index) {
+                archive_stream.seekg(data_location + block_index->blocks[i].location);
+                comp_v[i]->part_id = i;
+                comp_v[i]->load_text(archive_stream, block_index->blocks[i].stored_size);
+            }
+            else {
+                archive_stream.read((char*)&comp_v[i]->part_id, sizeof(comp_v[i]->part_id));
+                archive_stream.read((char*)&comp_v[i]->size, sizeof(comp_v[i]->size));
+                comp_v[i]->load_text(archive_stream, comp_v[i]->size);
+            }
+        };
+
+        // workers take the key by reference, files which aren't encrypted have none
+        uint8_t* no_key = nullptr;
+        uint8_t*& worker_key = key != nullptr ? *key : no_key;
+
         std::vector<std::thread> workers;
         std::string checksum;
         bool checksum_done = false;
@@ -252,20 +445,12 @@ namespace multithreading
         for ( uint32_t i=0; i < worker_count; ++i )
         {
             if (aborting_var) break;
-            if (task == multithreading::mode::compress) {
-                comp_v[i]->load_part(target_stream, original_size, i, block_size);
-                comp_v[i]->part_id = i;
-
-                if (compressed_size != nullptr) *compressed_size = 0;
-            }
-            else if (task == multithreading::mode::decompress) {
-                archive_stream.read((char*)&comp_v[i]->part_id, sizeof(comp_v[i]->part_id));
-                archive_stream.read((char*)&comp_v[i]->size, sizeof(comp_v[i]->size));
-                comp_v[i]->load_text(archive_stream, comp_v[i]->size);
-            }
+            load_block(i);
+            if (task == multithreading::mode::compress and compressed_size != nullptr) *compressed_size = 0;
 
             workers.emplace_back(&processing_worker, task, comp_v[i], flags, std::ref(aborting_var),
-                                 &task_finished_arr[i], std::ref(*key), std::ref(metadata), std::ref(metadata_size), partialProgress);
+                                 &task_finished_arr[i], std::ref(worker_key), std::ref(metadata), std::ref(metadata_size), partialProgress,
+                                 tree_hash ? &tree_nodes[i] : nullptr);
 
 
             task_started_arr[i] = true;
@@ -288,11 +473,13 @@ namespace multithreading
         if (task == multithreading::mode::compress)
             scribe = std::thread( &processing_scribe, task, std::ref(archive_stream), std::ref(comp_v),
                                   task_finished_arr, block_count, compressed_size,
-                                  std::ref(checksum), std::ref(checksum_done), original_size, std::ref(aborting_var), &successful );
+                                  std::ref(checksum), std::ref(checksum_done), original_size, std::ref(aborting_var), &successful,
+                                  flags, block_index, nullptr, archive_dropper.get(), tree_hash ? &tree_nodes : nullptr );
         else if (task == multithreading::mode::decompress)
             scribe = std::thread( &processing_scribe, task, std::ref(target_stream), std::ref(comp_v), task_finished_arr,
                                   block_count, compressed_size, std::ref(checksum), std::ref(checksum_done),
-                                  original_size, std::ref(aborting_var), &successful );
+                                  original_size, std::ref(aborting_var), &successful, flags, block_index, write_behind.get(),
+                                  nullptr, tree_hash ? &tree_nodes : nullptr );
 
         while (lowest_free_work_ind != block_count and !aborting_var) {
 
@@ -302,15 +489,7 @@ namespace multithreading
                     if (aborting_var) break;
 
                     if (lowest_free_work_ind != block_count) {
-                        if (task == multithreading::mode::compress) {
-                            comp_v[lowest_free_work_ind]->load_part(target_stream, original_size, lowest_free_work_ind, block_size);
-                            comp_v[lowest_free_work_ind]->part_id = lowest_free_work_ind;
-                        }
-                        else if (task == multithreading::mode::decompress) {
-                            archive_stream.read((char*)&comp_v[lowest_free_work_ind]->part_id, sizeof(comp_v[lowest_free_work_ind]->part_id));
-                            archive_stream.read((char*)&comp_v[lowest_free_work_ind]->size, sizeof(comp_v[lowest_free_work_ind]->size));
-                            comp_v[lowest_free_work_ind]->load_text(archive_stream, comp_v[lowest_free_work_ind]->size);
-                        }
+                        load_block(lowest_free_work_ind);
 
                         workers.emplace_back(&processing_worker,
                                              task,
@@ -318,8 +497,9 @@ namespace multithreading
                                              flags,
                                              std::ref(aborting_var),
                                              &task_finished_arr[lowest_free_work_ind],
-                                             std::ref(*key), std::ref(metadata), std::ref(metadata_size),
-                                             partialProgress);
+                                             std::ref(worker_key), std::ref(metadata), std::ref(metadata_size),
+                                             partialProgress,
+                                             tree_hash ? &tree_nodes[lowest_free_work_ind] : nullptr);
 
                         lowest_free_work_ind++;
                     }
@@ -341,42 +521,59 @@ namespace multithreading
         if (task == multithreading::mode::compress) {
             // since we're done with giving workers work, we can calculate checksum, which scribe thread will append to file
 
-            if (bin_flags[15])  // SHA-1
+            if (bin_flags[8])   // BLAKE3, instead of all the others
+            {
+                // scribe joins what workers hashed, unless they couldn't
+                IntegrityValidation iv;
+                if (!tree_hash) checksum = iv.get_BLAKE3_from_file(target_path, aborting_var);
+                if(partialProgress) (*partialProgress)++;
+            }
+            if (bin_flags[15] and !bin_flags[8])  // SHA-1
             {
                 IntegrityValidation iv;
                 checksum = iv.get_SHA1_from_file(target_path, aborting_var);
                 if(partialProgress) (*partialProgress)++;
             }
-            if (bin_flags[14])  // CRC-32
+            if (bin_flags[14] and !bin_flags[8])  // CRC-32
             {
                 IntegrityValidation iv;
                 checksum = iv.get_CRC32_from_file(target_path, aborting_var);
                 if(partialProgress)(*partialProgress)++;
             }
-            if (bin_flags[13])  // SHA-256
+            if (bin_flags[13] and !bin_flags[8])  // SHA-256
             {
                 IntegrityValidation iv;
                 checksum = iv.get_SHA256_from_file(target_path, aborting_var);
                 if(partialProgress)(*partialProgress)++;
             }
+            // checksum is computed through page cache, whatever it brought in can go
+            if (direct_io and source_io.is_open()) source_io.drop_cache(0, original_size);
 
             checksum_done = true;
         }
         else if (task == multithreading::mode::decompress)
         {
-            if (bin_flags[15])  // SHA-1
+            if (use_index) archive_stream.seekg(data_location + block_index->end());   // checksum is right after the last block
+
+            if (bin_flags[8])   // BLAKE3
+            {
+                checksum = std::string(64, 0x00);
+                archive_stream.read((char*)checksum.data(), checksum.length());
+                if(partialProgress) (*partialProgress)++;
+            }
+            if (bin_flags[15] and !bin_flags[8])  // SHA-1
             {
                 checksum = std::string(40, 0x00);
                 archive_stream.read((char*)checksum.data(), checksum.length());
                 if(partialProgress) (*partialProgress)++;
             }
-            if (bin_flags[14])  // CRC-32
+            if (bin_flags[14] and !bin_flags[8])  // CRC-32
             {
                 checksum = std::string(10, 0x00);
                 archive_stream.read((char*)checksum.data(), checksum.length());
                 if(partialProgress) (*partialProgress)++;
             }
-            if (bin_flags[13])  // SHA-256
+            if (bin_flags[13] and !bin_flags[8])  // SHA-256
             {
                 checksum = std::string(64, 0x00);
                 archive_stream.read((char*)checksum.data(), checksum.length());
@@ -390,6 +587,7 @@ namespace multithreading
 
         for (auto& th : workers) if (th.joinable()) th.join();
         if (scribe.joinable()) scribe.join();
+        if (direct_io and target_io.is_open()) target_io.drop_cache(0, original_size);     // read back for checksum
 
         delete[] task_finished_arr;
         delete[] task_started_arr;
@@ -10,22 +10,44 @@
 
 #include "../integrity_validation.h"
 #include "../compression.h"
+#include "../block_index.h"
+#include "../blake3.h"
+#include "positional_file.h"
+#include "mapped_file.h"
+
+class WriteBehind;
+class DropBehind;
 
 namespace multithreading
 {
-    enum class mode : int { compress=100, decompress=200 };
+    enum class mode : uint32_t { compress=100, decompress=200 };
 
     inline uint16_t calculate_progress( float current, float whole );
 
-    void processing_worker( const int task, Compression* comp, uint16_t flags, bool& aborting_var, bool* is_finished,
-                            uint8_t*& key, uint8_t*& metadata, uint32_t& metadata_size, uint32_t* progress_ptr = nullptr );
+    // Length of checksum stored after file's data, 0 if there's none
+    uint8_t checksum_length( uint16_t flags );
+
+    // Checksum of decompressed output, of the kind that gets stored with given flags
+    std::string stream_checksum( std::fstream& output, uint16_t flags, uint64_t original_size, bool& aborting_var );
+
+    // Checksum of uncompressed file, of the kind that gets stored with given flags
+    std::string file_checksum( const std::string& path, uint16_t flags, bool& aborting_var );
+
+    void processing_worker( multithreading::mode task, Compression* comp, uint16_t flags, bool& aborting_var, bool* is_finished,
+                            uint8_t*& key, uint8_t*& metadata, uint32_t& metadata_size, uint32_t* progress_ptr = nullptr,
+                            blake3::Output* tree_node = nullptr );
 
-    void processing_scribe( const int task, std::fstream& output, std::vector<Compression*>& comp_v,
+    void processing_scribe( multithreading::mode task, std::fstream& output, std::vector<Compression*>& comp_v,
                             bool worker_finished[], uint32_t block_count, uint64_t* compressed_size,
-                            std::string& checksum, bool& checksum_done, uint64_t original_size, bool& aborting_var, bool* successful );
+                            std::string& checksum, bool& checksum_done, uint64_t original_size, bool& aborting_var, bool* successful,
+                            uint16_t flags, BlockIndex* block_index, WriteBehind* write_behind, DropBehind* drop_behind,
+                            std::vector<blake3::Output>* tree_nodes );
 
     bool processing_foreman( std::fstream &archive_stream, const std::string& target_path, multithreading::mode task, uint16_t flags,
                              uint64_t original_size, uint64_t* compressed_size, bool& aborting_var, bool validate_integrity,
-                             uint32_t* partialProgress, uint32_t* totalProgress, uint8_t** key=nullptr, uint8_t* metadata=nullptr, uint32_t metadata_size=0);
+                             uint32_t* partialProgress, uint32_t* totalProgress, BlockIndex* block_index=nullptr,
+                             uint8_t** key=nullptr, uint8_t* metadata=nullptr, uint32_t metadata_size=0,
+                             const PositionalFile* archive_io=nullptr, const MappedFile* archive_map=nullptr,
+                             bool direct_io=false);
 }
 #endif // MULTITHREADING_H
@@ -0,0 +1,219 @@
+#include "positional_file.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <utility>
+#include <memory>
+#include <algorithm>
+
+#if defined(__linux__) && __has_include(<linux/fs.h>)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+
+PositionalFile::PositionalFile(const std::filesystem::path& path, access mode, caching cache) {
+    open(path, mode, cache);
+}
+
+
+PositionalFile::~PositionalFile() {
+    close();
+}
+
+
+PositionalFile::PositionalFile(PositionalFile&& other) noexcept :
+        fd(std::exchange(other.fd, -1)),
+        direct_io(std::exchange(other.direct_io, false)) {}
+
+
+PositionalFile& PositionalFile::operator=(PositionalFile&& other) noexcept {
+    if (this != &other) {
+        close();
+        fd = std::exchange(other.fd, -1);
+        direct_io = std::exchange(other.direct_io, false);
+    }
+    return *this;
+}
+
+
+bool PositionalFile::open(const std::filesystem::path& path, access mode, caching cache) {
+    close();
+    int flags = (mode == access::read ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+#ifdef O_DIRECT
+    if (cache == caching::direct) {
+        do fd = ::open(path.c_str(), flags | O_DIRECT);
+        while (fd == -1 and errno == EINTR);
+        direct_io = fd != -1;
+        if (direct_io or errno != EINVAL) return direct_io;     // EINVAL: filesystem doesn't do direct I/O
+    }
+#endif
+    do fd = ::open(path.c_str(), flags);
+    while (fd == -1 and errno == EINTR);
+    return fd != -1;
+}
+
+
+void PositionalFile::close() {
+    if (fd == -1) return;
+    ::close(fd);
+    fd = -1;
+    direct_io = false;
+}
+
+
+bool PositionalFile::is_open() const {
+    return fd != -1;
+}
+
+
+bool PositionalFile::direct() const {
+    return direct_io;
+}
+
+
+uint64_t PositionalFile::read_at(void* buffer, uint64_t size, uint64_t offset) const {
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t result = ::pread(fd, (char*)buffer + done, size - done, offset + done);
+        if (result == -1 and errno == EINTR) continue;
+        if (result <= 0) break;     // end of file, or error
+        done += result;
+    }
+    return done;
+}
+
+
+bool PositionalFile::write_at(const void* buffer, uint64_t size, uint64_t offset) const {
+    uint64_t done = 0;
+    while (done < size) {
+        ssize_t result = ::pwrite(fd, (const char*)buffer + done, size - done, offset + done);
+        if (result == -1 and errno == EINTR) continue;
+        if (result <= 0) return false;
+        done += result;
+    }
+    return true;
+}
+
+
+uint64_t PositionalFile::size() const {
+    struct stat info{};
+    if (fd == -1 or ::fstat(fd, &info) != 0) return 0;
+    return info.st_size;
+}
+
+
+bool PositionalFile::resize(uint64_t new_size) const {
+    int result;
+    do result = ::ftruncate(fd, new_size);
+    while (result == -1 and errno == EINTR);
+    return result == 0;
+}
+
+
+bool PositionalFile::copy_to(const PositionalFile& destination, uint64_t offset, uint64_t length,
+                             uint64_t destination_offset) const {
+#ifdef FICLONERANGE
+    // clones work in whole filesystem blocks, so only the part where both ranges have them can be shared
+    struct stat info{};
+    if (length != 0 and ::fstat(destination.fd, &info) == 0 and info.st_blksize > 0) {
+        uint64_t block = info.st_blksize;
+        uint64_t lead = (block - offset % block) % block;
+        if (offset % block == destination_offset % block and length > lead) {
+            uint64_t cloned = (length - lead) / block * block;
+            file_clone_range range{};
+            range.src_fd = fd;
+            range.src_offset = offset + lead;
+            range.src_length = cloned;
+            range.dest_offset = destination_offset + lead;
+            if (cloned != 0 and ::ioctl(destination.fd, FICLONERANGE, &range) == 0) {
+                // what's left around the shared blocks is copied
+                return copy_to(destination, offset, lead, destination_offset)
+                       and copy_to(destination, offset + lead + cloned, length - lead - cloned,
+                                   destination_offset + lead + cloned);
+            }
+        }
+    }
+#endif
+
+    uint64_t done = 0;
+#ifdef __NR_copy_file_range
+    // called directly, since libc may not wrap it (bionic doesn't, below API 34)
+    while (done < length) {
+        auto from = (loff_t)(offset + done);
+        auto to = (loff_t)(destination_offset + done);
+        long result = ::syscall(__NR_copy_file_range, fd, &from, destination.fd, &to, length - done, 0u);
+        if (result == -1 and errno == EINTR) continue;
+        if (result <= 0) break;     // not supported between these files, or source ended, either way it's copied below
+        done += result;
+    }
+#endif
+
+    const uint64_t buffer_size = 1u << 20;
+    std::unique_ptr<uint8_t[]> buffer;
+    while (done < length) {
+        if (!buffer) buffer = std::make_unique<uint8_t[]>(buffer_size);
+        uint64_t part = std::min(buffer_size, length - done);
+        if (read_at(buffer.get(), part, offset + done) != part) return false;
+        if (!destination.write_at(buffer.get(), part, destination_offset + done)) return false;
+        done += part;
+    }
+    return true;
+}
+
+
+void PositionalFile::write_back(uint64_t offset, uint64_t length) const {
+    if (fd == -1 or length == 0) return;
+#ifdef __linux__
+    ::sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+
+void PositionalFile::drop_cache(uint64_t offset, uint64_t length) const {
+    if (fd == -1 or length == 0) return;
+    // dirty pages can't be dropped, they have to be written back first
+#ifdef __linux__
+    ::sync_file_range(fd, offset, length, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+    ::fdatasync(fd);
+#endif
+    ::posix_fadvise(fd, offset, length, POSIX_FADV_DONTNEED);
+}
+
+
+int PositionalFile::descriptor() const {
+    return fd;
+}
+
+
+PositionalFile::Cursor::Cursor(const PositionalFile& file, uint64_t position) :
+        file(&file),
+        position(position) {}
+
+
+uint64_t PositionalFile::Cursor::read(void* buffer, uint64_t size) {
+    uint64_t done = file->read_at(buffer, size, position);
+    position += done;
+    return done;
+}
+
+
+bool PositionalFile::Cursor::write(const void* buffer, uint64_t size) {
+    if (!file->write_at(buffer, size, position)) return false;
+    position += size;
+    return true;
+}
+
+
+void PositionalFile::Cursor::seek(uint64_t new_position) {
+    position = new_position;
+}
+
+
+uint64_t PositionalFile::Cursor::tell() const {
+    return position;
+}
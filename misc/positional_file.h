@@ -0,0 +1,80 @@
+#ifndef POSITIONAL_FILE_H
+#define POSITIONAL_FILE_H
+
+#include <cstdint>
+#include <filesystem>
+
+
+// File accessed only at explicit offsets (pread/pwrite), so it has no shared position to move around.
+// Any number of threads can read and write through the same PositionalFile at once,
+// each of them keeping track of where it is with its own Cursor
+class PositionalFile
+{
+public:
+    enum class access : uint8_t { read, read_write };
+
+    // direct: data goes between storage and caller's buffers, skipping page cache. Offsets, sizes and buffers
+    // of transfers have to be multiples of direct_alignment then (except for the part past the end of file)
+    enum class caching : uint8_t { normal, direct };
+    static const uint32_t direct_alignment = 4096;
+
+    PositionalFile() = default;
+    PositionalFile(const std::filesystem::path& path, access mode, caching cache = caching::normal);
+    ~PositionalFile();
+
+    PositionalFile(const PositionalFile&) = delete;
+    PositionalFile& operator=(const PositionalFile&) = delete;
+    PositionalFile(PositionalFile&& other) noexcept;
+    PositionalFile& operator=(PositionalFile&& other) noexcept;
+
+    // Closes whatever was open before. Returns false if the file couldn't be opened.
+    // If direct caching isn't supported there (by the filesystem, or the platform), file is opened with normal one
+    bool open(const std::filesystem::path& path, access mode, caching cache = caching::normal);
+    void close();
+    bool is_open() const;
+    bool direct() const;                            // whether file was opened with direct caching
+
+    // Reads up to size bytes at offset, returns number of bytes read (less than size only at the end of file, or on error)
+    uint64_t read_at(void* buffer, uint64_t size, uint64_t offset) const;
+
+    // Writes all size bytes at offset, returns false if it couldn't
+    bool write_at(const void* buffer, uint64_t size, uint64_t offset) const;
+
+    uint64_t size() const;
+    bool resize(uint64_t new_size) const;
+
+    // Copies length bytes at offset into destination, at destination_offset, without bringing them into user space.
+    // Filesystems which can share storage between files (reflinks) don't copy them at all.
+    // Returns false if it couldn't copy all of them
+    bool copy_to(const PositionalFile& destination, uint64_t offset, uint64_t length, uint64_t destination_offset) const;
+
+    // Fallback for files which can't skip page cache: write_back starts writing range to storage, without waiting,
+    // and drop_cache waits until range is in storage, then evicts it from page cache
+    void write_back(uint64_t offset, uint64_t length) const;
+    void drop_cache(uint64_t offset, uint64_t length) const;
+
+    // Descriptor for calls this class doesn't wrap, -1 if nothing is open
+    int descriptor() const;
+
+    // Position of a single reader or writer, moved by what it reads and writes
+    class Cursor {
+    public:
+        Cursor(const PositionalFile& file, uint64_t position = 0);
+
+        uint64_t read(void* buffer, uint64_t size);
+        bool write(const void* buffer, uint64_t size);
+
+        void seek(uint64_t new_position);
+        uint64_t tell() const;
+
+    private:
+        const PositionalFile* file;
+        uint64_t position;
+    };
+
+private:
+    int fd = -1;
+    bool direct_io = false;
+};
+
+#endif // POSITIONAL_FILE_H
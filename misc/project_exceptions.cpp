@@ -39,3 +39,13 @@ NothingLeftToReadException::NothingLeftToReadException(const char* error) {
 [[nodiscard]] const char* NothingLeftToReadException::what() const noexcept {
     return errorMessage.c_str();
 }
+
+
+CorruptedArchiveException::CorruptedArchiveException(const char* error) {
+    errorMessage = error;
+}
+
+
+[[nodiscard]] const char* CorruptedArchiveException::what() const noexcept {
+    return errorMessage.c_str();
+}
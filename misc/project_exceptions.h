@@ -44,4 +44,13 @@ private:
     std::string errorMessage;
 };
 
+class CorruptedArchiveException : public std::exception {
+public:
+    explicit CorruptedArchiveException(const char *error = "Archive's metadata points at something that isn't there. The archive is probably damaged.");
+    [[nodiscard]] const char * what() const noexcept;
+
+private:
+    std::string errorMessage;
+};
+
 #endif //EXPERIMENTAL_PROJECT_EXCEPTIONS_H
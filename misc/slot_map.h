@@ -0,0 +1,87 @@
+#ifndef SLOT_MAP_H
+#define SLOT_MAP_H
+
+#include <cstdint>
+#include <cassert>
+#include <vector>
+
+
+// Dense table of pointers, addressed by handles instead of keys.
+// Handle is [generation 31b][slot + 1 32b], so 0 is never a valid handle, and every handle is positive.
+// Slot's generation is bumped whenever its value is erased, so handles of erased values don't resolve anymore,
+// even after the slot is reused.
+template <typename T>
+class SlotMap
+{
+public:
+    typedef int64_t handle;
+
+    // Stores value in a free slot, and returns handle to it
+    handle insert(T* value) {
+        assert(value != nullptr);
+
+        uint32_t slot;
+        if (first_free != no_slot) {
+            slot = first_free;
+            first_free = slots[slot].next_free;
+        }
+        else {
+            assert(slots.size() < UINT32_MAX);
+            slot = slots.size();
+            slots.push_back({ nullptr, 0, no_slot });
+        }
+        slots[slot].value = value;
+        slots[slot].next_free = no_slot;
+        used++;
+
+        return ((handle)slots[slot].generation << 32) | (slot + 1u);
+    }
+
+    // Value the handle points at, or nullptr if it was erased (or was never valid)
+    T* get(handle h) const {
+        uint64_t slot = (uint64_t)(h & UINT32_MAX) - 1;
+        if (h <= 0 or slot >= slots.size()) return nullptr;
+        const Slot& s = slots[slot];
+        if (s.generation != (uint32_t)(h >> 32)) return nullptr;
+        return s.value;
+    }
+
+    // Resolves all handles in one pass, stale ones turn into nullptr
+    void get_many(const std::vector<handle>& handles, std::vector<T*>& values) const {
+        values.resize(handles.size());
+        for (uint64_t i=0; i < handles.size(); ++i) values[i] = get(handles[i]);
+    }
+
+    // Frees handle's slot, returns false if handle was already stale
+    bool erase(handle h) {
+        if (get(h) == nullptr) return false;
+
+        uint32_t slot = (h & UINT32_MAX) - 1;
+        slots[slot].value = nullptr;
+        slots[slot].generation = (slots[slot].generation + 1) & INT32_MAX;   // handles stay positive
+        slots[slot].next_free = first_free;
+        first_free = slot;
+        used--;
+        return true;
+    }
+
+    // Number of values stored
+    uint64_t size() const { return used; }
+
+    void clear() { *this = SlotMap(); }
+
+private:
+    static constexpr uint32_t no_slot = UINT32_MAX;
+
+    struct Slot {
+        T* value;
+        uint32_t generation;
+        uint32_t next_free;     // next slot on the free list, if this one is free
+    };
+
+    std::vector<Slot> slots;
+    uint32_t first_free = no_slot;
+    uint64_t used = 0;
+};
+
+#endif // SLOT_MAP_H
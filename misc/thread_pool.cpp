@@ -0,0 +1,60 @@
+#include "thread_pool.h"
+
+
+ThreadPool::ThreadPool(uint32_t thread_count) {
+    if (thread_count == 0) thread_count = std::thread::hardware_concurrency();
+    // "if value is not well defined or not computable, (std::thread::hardware_concurrency) returns 0" ~cppreference.com
+    if (thread_count == 0) thread_count = 2;
+
+    for (uint32_t i=0; i < thread_count; ++i) threads.emplace_back(&ThreadPool::work, this);
+}
+
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    task_available.notify_all();
+    for (auto& th : threads) th.join();
+}
+
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push(std::move(task));
+        unfinished++;
+    }
+    task_available.notify_one();
+}
+
+
+void ThreadPool::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    all_done.wait(lock, [this]() { return unfinished == 0; });
+}
+
+
+uint32_t ThreadPool::size() const {
+    return threads.size();
+}
+
+
+void ThreadPool::work() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            task_available.wait(lock, [this]() { return stopping or !tasks.empty(); });
+            if (tasks.empty()) return;  // stopping, and nothing's left
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+
+        task();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--unfinished == 0) all_done.notify_all();
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+
+// Fixed number of threads taking tasks from a shared queue, in the order they were submitted
+class ThreadPool
+{
+public:
+    // 0 threads means one per hardware thread
+    explicit ThreadPool(uint32_t thread_count = 0);
+
+    // Finishes every submitted task before returning
+    ~ThreadPool();
+
+    void submit(std::function<void()> task);
+
+    // Waits until every submitted task is finished
+    void wait();
+
+    uint32_t size() const;
+
+private:
+    std::vector<std::thread> threads;
+    std::queue<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable task_available;
+    std::condition_variable all_done;
+    uint64_t unfinished = 0;                        // queued or running
+    bool stopping = false;
+
+    void work();
+};
+
+#endif // THREAD_POOL_H
@@ -3,7 +3,12 @@
 #include <string>
 #include <cassert>
 #include <sstream>
+#include <chrono>
+#include <unordered_map>
+#include <malloc.h>
+#include <fcntl.h>
 #include "archive.h"
+#include "misc/async_io.h"
 
 static std::unique_ptr<Archive> archive = std::make_unique<Archive>();
 static IntegrityValidation iv;
@@ -214,6 +219,139 @@ namespace testing {
         assert(archive->archive_file.is_open());
         return output;
     }
+    std::string benchmarkNodeTableMemory() {
+        // 1M table of contents entries: 1000 folders with 1000 files in each, decoded into NodeTable, and into
+        // the map of HeaderRecords by location it replaced. Folder/File objects aren't counted, the model makes them
+        // only for what it loads (see Archive::load_subtree), whichever one holds the records
+        const uint64_t folder_count = 1000;
+        const uint64_t files_per_folder = 1000;
+        const uint64_t node_count = 1 + folder_count * (1 + files_per_folder);
+        auto location_of = [](uint64_t node) { return 1 + node * 64; };   // headers are never smaller than that
+        auto heap_in_use = []() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+            struct mallinfo2 info = mallinfo2();    // mallinfo is deprecated there (its counters are int)
+#else
+            struct mallinfo info = mallinfo();
+#endif
+            return (int64_t)info.uordblks + (int64_t)info.hblkhd;
+        };
+        auto for_each_record = [&](auto&& consume) {
+            HeaderRecord root;
+            root.type = HeaderRecord::kind::folder;
+            root.location = location_of(0);
+            root.name = "benchmark.tk2k";
+            root.child_dir_location = location_of(1);
+            consume(root);
+
+            for (uint64_t f=0; f < folder_count; ++f) {
+                uint64_t folder_node = 1 + f * (1 + files_per_folder);
+
+                HeaderRecord folder;
+                folder.type = HeaderRecord::kind::folder;
+                folder.location = location_of(folder_node);
+                folder.name = "folder " + std::to_string(f);
+                folder.parent_location = root.location;
+                folder.sibling_location = f+1 < folder_count ? location_of(folder_node + 1 + files_per_folder) : 0;
+                folder.child_file_location = location_of(folder_node + 1);
+                consume(folder);
+
+                for (uint64_t i=0; i < files_per_folder; ++i) {
+                    HeaderRecord file;
+                    file.type = HeaderRecord::kind::file;
+                    file.location = location_of(folder_node + 1 + i);
+                    file.name = "file " + std::to_string(f * files_per_folder + i) + ".txt";
+                    file.parent_location = folder.location;
+                    file.sibling_location = i+1 < files_per_folder ? location_of(folder_node + 2 + i) : 0;
+                    file.data_location = file.location + 64;
+                    consume(file);
+                }
+            }
+        };
+
+        int64_t heap_before = heap_in_use();
+        auto start = std::chrono::steady_clock::now();
+
+        NodeTable table;
+        table.reserve(node_count);
+        for_each_record([&table](const HeaderRecord& record) { table.add(record); });
+        bool linked = table.link();
+
+        auto table_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        int64_t table_heap = heap_in_use() - heap_before;
+
+        heap_before = heap_in_use();
+        start = std::chrono::steady_clock::now();
+        {
+            std::unordered_map<uint64_t, HeaderRecord> records;
+            records.reserve(node_count);
+            for_each_record([&records](const HeaderRecord& record) { records.emplace(record.location, record); });
+
+            auto map_time = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            int64_t map_heap = heap_in_use() - heap_before;
+
+            std::stringstream ss;
+            ss << "Table of contents entries: " << node_count << (linked ? "" : " (linking failed!)") << '\n';
+            ss << "NodeTable: " << table_heap / 1024 << " KiB on heap (" << table.memory_usage() / 1024 << " KiB counted), "
+               << table_heap / (int64_t)node_count << " B per entry, built in " << table_time.count() << " ms\n";
+            ss << "HeaderRecords by location: " << map_heap / 1024 << " KiB on heap, "
+               << map_heap / (int64_t)node_count << " B per entry, built in " << map_time.count() << " ms\n";
+
+            return ss.str();
+        }
+    }
+
+    std::string benchmarkColdBlockReads(const std::string& filePath = "/storage/emulated/0/Download/mozilla") {
+        // File is read block by block, with a bit of work done on every block, the way processing_foreman feeds
+        // its workers: once with blocking reads, then read ahead by each backend of AsyncIO.
+        // File's pages are dropped from page cache before every run, so all reads have to go to storage
+        const uint32_t block_size = 1u << 22;   // 4 MiB
+        PositionalFile file(filePath, PositionalFile::access::read);
+        if (!file.is_open()) return "Couldn't open " + filePath + "\n";
+
+        std::vector<ReadAhead::Range> ranges;
+        for (uint64_t offset=0; offset < file.size(); offset += block_size)
+            ranges.push_back({ offset, (uint32_t)std::min<uint64_t>(block_size, file.size() - offset) });
+
+        auto drop_cache = [&file]() { posix_fadvise(file.descriptor(), 0, 0, POSIX_FADV_DONTNEED); };
+        auto work = [](const uint8_t* data, uint32_t size) {
+            uint64_t hash = 0;
+            for (uint32_t i=0; i < size; ++i) hash = hash * 0x100000001B3ull ^ data[i];
+            return hash;
+        };
+
+        std::stringstream ss;
+        ss << "File: " << file.size() / 1024 << " KiB in " << ranges.size() << " blocks\n";
+        uint64_t expected = 0;
+
+        drop_cache();
+        auto start = std::chrono::steady_clock::now();
+        {
+            std::unique_ptr<uint8_t[]> block(new uint8_t[block_size]);
+            for (const auto& range : ranges) {
+                file.read_at(block.get(), range.size, range.offset);
+                expected ^= work(block.get(), range.size);
+            }
+        }
+        auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+        ss << "blocking reads: " << elapsed.count() << " ms\n";
+
+        for (auto backend : { AsyncIO::backend::thread, AsyncIO::backend::io_uring }) {
+            drop_cache();
+            start = std::chrono::steady_clock::now();
+            uint64_t result = 0;
+            ReadAhead read_ahead(file, ranges, ReadAhead::default_depth, backend);
+            const uint8_t* data;
+            uint32_t size;
+            while (read_ahead.next(data, size)) result ^= work(data, size);
+            elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+
+            ss << "read ahead (" << (read_ahead.kind() == AsyncIO::backend::io_uring ? "io_uring" : "thread")
+               << (read_ahead.kind() != backend ? ", io_uring unavailable" : "") << "): " << elapsed.count() << " ms"
+               << (result == expected ? "" : " (data differs!)") << "\n";
+        }
+        return ss.str();
+    }
+
     std::string autoArchiveTest() {
         std::filesystem::path archivePath = "/storage/emulated/0/Download/archive.tk2k";
 
@@ -233,6 +371,8 @@ Java_com_example_turbokompresor1999_ArchiveViewActivity_stringFromJNI(JNIEnv *en
     //return env->NewStringUTF(testing::testThings().c_str());
     //return env->NewStringUTF(testing::testComplex().c_str());
     //return env->NewStringUTF(testing::testJustFolder().c_str());
+    //return env->NewStringUTF(testing::benchmarkNodeTableMemory().c_str());
+    //return env->NewStringUTF(testing::benchmarkColdBlockReads().c_str());
     return env->NewStringUTF(testing::autoArchiveTest().c_str());
 }
 
@@ -277,12 +417,47 @@ jobject recursiveFillFileChildren(JNIEnv *env, File* file_ptr) {
     return fileInstance;
 }
 
+jobject fillFolderSiblingsWithoutChildren(JNIEnv *env, Folder* folder_ptr) {
+    if (!folder_ptr) return nullptr;
+    jclass folderClass = env->FindClass("com/example/turbokompresor1999/Folder");
+    jmethodID folderConstructorId = env->GetMethodID(folderClass, "<init>", "([BJ[BLcom/example/turbokompresor1999/Folder;Lcom/example/turbokompresor1999/Folder;Lcom/example/turbokompresor1999/File;)V");
+    jobject folderInstance = env->NewObject(folderClass, folderConstructorId,
+                                            stringToJniByteArray(env, folder_ptr->name),
+                                            (jlong) folder_ptr->lookup_id,
+                                            stringToJniByteArray(env, folder_ptr->path.c_str()),
+                                            nullptr,
+                                            fillFolderSiblingsWithoutChildren(env, folder_ptr->sibling_ptr.get()),
+                                            nullptr);
+    return folderInstance;
+}
+
 extern "C"
 JNIEXPORT jobject JNICALL
 Java_com_example_turbokompresor1999_Archive_pullWholeArchive(JNIEnv *env, jobject thiz) {
+    archive->load_subtree(archive->root_folder);
     return recursiveFillFolderChildren(env, archive->root_folder.get());
 }
 
+extern "C"
+JNIEXPORT jobject JNICALL
+Java_com_example_turbokompresor1999_Archive_pullFolder(JNIEnv *env, jobject thiz, jlong lookup_id) {
+    // folder with its direct children only, subfolders are pulled the same way once they're opened
+    auto folder = dynamic_cast<Folder*>(archive->jniLookup.get(lookup_id));
+    if (!folder) return nullptr;
+    archive->load_children(folder->shared_from_this());
+
+    jclass folderClass = env->FindClass("com/example/turbokompresor1999/Folder");
+    jmethodID folderConstructorId = env->GetMethodID(folderClass, "<init>", "([BJ[BLcom/example/turbokompresor1999/Folder;Lcom/example/turbokompresor1999/Folder;Lcom/example/turbokompresor1999/File;)V");
+    jobject folderInstance = env->NewObject(folderClass, folderConstructorId,
+                                            stringToJniByteArray(env, folder->name),
+                                            (jlong) folder->lookup_id,
+                                            stringToJniByteArray(env, folder->path.c_str()),
+                                            fillFolderSiblingsWithoutChildren(env, folder->child_dir_ptr.get()),
+                                            nullptr,
+                                            recursiveFillFileChildren(env, folder->child_file_ptr.get()));
+    return folderInstance;
+}
+
 void archiveOpPreparationCommon() {
     assert(archive->archive_file.is_open());
     abortingVariable = false;
@@ -297,9 +472,9 @@ Java_com_example_turbokompresor1999_ProcessingActivity_00024CompressionThread_co
 {
     archiveOpPreparationCommon();
 
-    std::shared_ptr<ArchiveStructure> parent_structure = archive->jniLookup[parent_lookup_id].lock();
-    std::shared_ptr<Folder> parent = std::dynamic_pointer_cast<Folder>(parent_structure);
-    assert(parent.get() != nullptr);
+    auto parent_folder = dynamic_cast<Folder*>(archive->jniLookup.get(parent_lookup_id));
+    assert(parent_folder != nullptr);
+    std::shared_ptr<Folder> parent = parent_folder->shared_from_this();
     bool success = false;
 
     const char* utf_path;
@@ -309,8 +484,7 @@ Java_com_example_turbokompresor1999_ProcessingActivity_00024CompressionThread_co
     env->ReleaseStringUTFChars(path_to_file, utf_path);
 
     auto file = archive->add_file_to_archive_model(parent, utf_path_string, (uint16_t) flags);
-    file->append_to_archive(archive->archive_file, abortingVariable, false, &partialProgress, &totalProgress);
-    success = true;
+    success = archive->append_files({ file }, abortingVariable, &partialProgress, &totalProgress);
 
     return success;
 }
@@ -334,35 +508,28 @@ Java_com_example_turbokompresor1999_ProcessingActivity_00024DecompressionThread_
     std::string utf_path_string(utf_path);
     env->ReleaseStringUTFChars(outputFolderPath, utf_path);
 
-    std::shared_ptr<ArchiveStructure> structure = archive->jniLookup[lookup_id].lock();
-    std::shared_ptr<Folder> folder = std::dynamic_pointer_cast<Folder>(structure);
-    std::shared_ptr<File> file = std::dynamic_pointer_cast<File>(structure);
+    ArchiveStructure* structure = archive->jniLookup.get(lookup_id);
+    auto folder = dynamic_cast<Folder*>(structure);
+    auto file = dynamic_cast<File*>(structure);
 
     bool success = false;
 
     if (folder != nullptr) {
-        //TODO: folder->unpack()
+        success = archive->unpack_folder(folder->shared_from_this(), utf_path_string, abortingVariable,
+                                         &partialProgress, &totalProgress);
     } else if (file != nullptr) {
-        file->unpack(utf_path,
-                     archive->archive_file,
-                     abortingVariable,
-                     false,
-                     true,
-                     &partialProgress,
-                     &totalProgress);
+        success = file->unpack(utf_path_string,
+                               archive->archive_file,
+                               abortingVariable,
+                               false,
+                               true,
+                               &partialProgress,
+                               &totalProgress);
     } else assert(false);
 
-    success = true;
-
     return success;
 }
 
-void reloadArchive() {
-    std::filesystem::path lastLoadPath = archive->load_path;
-    archive = std::make_unique<Archive>();
-    archive->load(lastLoadPath);
-}
-
 extern "C"
 JNIEXPORT jboolean JNICALL
 Java_com_example_turbokompresor1999_ProcessingActivity_00024DeletionThread_deleteStructure(
@@ -372,8 +539,8 @@ Java_com_example_turbokompresor1999_ProcessingActivity_00024DeletionThread_delet
 
     bool success = false;
 
+    // model is updated in place, so ids Java already has stay valid
     archive->removeArchiveStruct((int64_t) lookup_id);
-    reloadArchive();
     success = true;
 
     return success;
@@ -0,0 +1,160 @@
+#include "node_table.h"
+
+#include <algorithm>
+#include <cassert>
+
+#include "misc/project_exceptions.h"
+
+
+uint64_t NodeTable::size() const {
+    return location.size();
+}
+
+
+void NodeTable::clear() {
+    *this = NodeTable();
+}
+
+
+void NodeTable::reserve(uint64_t node_count) {
+    location.reserve(node_count);
+    type.reserve(node_count);
+    name_offset.reserve(node_count);
+    parent.reserve(node_count);
+    sibling.reserve(node_count);
+    child_dir.reserve(node_count);
+    child_file.reserve(node_count);
+    flags_value.reserve(node_count);
+    data_location.reserve(node_count);
+    compressed_size.reserve(node_count);
+    original_size.reserve(node_count);
+    extension_offset.reserve(node_count + 1);
+    unresolved_links.reserve(node_count * 4);
+    interned.reserve(node_count);
+}
+
+
+uint32_t NodeTable::intern(const std::string& node_name) {
+    assert(node_name.length() < 256);
+
+    size_t hash = std::hash<std::string_view>()(node_name);
+    auto [first, last] = interned.equal_range(hash);
+    for (auto it = first; it != last; ++it) {
+        uint32_t offset = it->second;
+        if (std::string_view(names.data() + offset + 1, (uint8_t)names[offset]) == node_name) return offset;
+    }
+
+    uint32_t offset = names.size();
+    names.push_back((char)node_name.length());
+    names += node_name;
+    interned.emplace(hash, offset);
+    return offset;
+}
+
+
+void NodeTable::add(const HeaderRecord& record) {
+    location.push_back(record.location);
+    type.push_back(record.type);
+    name_offset.push_back(intern(record.name));
+    parent.push_back(none);
+    sibling.push_back(none);
+    child_dir.push_back(none);
+    child_file.push_back(none);
+    flags_value.push_back(record.flags_value);
+    data_location.push_back(record.data_location);
+    compressed_size.push_back(record.compressed_size);
+    original_size.push_back(record.original_size);
+
+    if (extension_offset.empty()) extension_offset.push_back(0);
+    extensions += record.extension;
+    extension_offset.push_back(extensions.size());
+
+    unresolved_links.push_back(record.parent_location);
+    unresolved_links.push_back(record.sibling_location);
+    unresolved_links.push_back(record.child_dir_location);
+    unresolved_links.push_back(record.child_file_location);
+}
+
+
+bool NodeTable::link() {
+    by_location.resize(size());
+    for (index i=0; i < size(); ++i) by_location[i] = i;
+    std::sort(by_location.begin(), by_location.end(), [this](index a, index b) { return location[a] < location[b]; });
+
+    for (uint64_t i=1; i < by_location.size(); ++i)
+        if (location[by_location[i-1]] == location[by_location[i]]) return false;
+
+    std::vector<index>* links[4] = { &parent, &sibling, &child_dir, &child_file };
+    for (index node=0; node < size(); ++node) {
+        for (uint8_t link_type=0; link_type < 4; ++link_type) {
+            uint64_t linked_location = unresolved_links[node*4 + link_type];
+            if (linked_location == 0) continue;
+
+            index linked = find(linked_location);
+            if (linked == none) return false;
+            (*links[link_type])[node] = linked;
+        }
+    }
+
+    // everything below was needed only while filling the table
+    std::vector<uint64_t>().swap(unresolved_links);
+    decltype(interned)().swap(interned);
+    names.shrink_to_fit();
+    extensions.shrink_to_fit();
+    return true;
+}
+
+
+NodeTable::index NodeTable::find(uint64_t node_location) const {
+    auto it = std::lower_bound(by_location.begin(), by_location.end(), node_location,
+                               [this](index node, uint64_t wanted) { return location[node] < wanted; });
+    if (it == by_location.end() or location[*it] != node_location) return none;
+    return *it;
+}
+
+
+std::string_view NodeTable::name(index node) const {
+    uint32_t offset = name_offset[node];
+    return { names.data() + offset + 1, (uint8_t)names[offset] };
+}
+
+
+std::string_view NodeTable::extension(index node) const {
+    return std::string_view(extensions).substr(extension_offset[node], extension_offset[node+1] - extension_offset[node]);
+}
+
+
+void NodeTable::read(uint64_t node_location, HeaderRecord::kind node_type, HeaderRecord& record) {
+    index node = find(node_location);
+    if (node == none or type[node] != node_type) throw CorruptedArchiveException();
+
+    auto location_of = [this](index linked) { return linked == none ? 0 : location[linked]; };
+
+    record.type = node_type;
+    record.location = node_location;
+    record.name = name(node);
+    record.parent_location = location_of(parent[node]);
+    record.sibling_location = location_of(sibling[node]);
+    record.child_dir_location = location_of(child_dir[node]);
+    record.child_file_location = location_of(child_file[node]);
+    record.flags_value = flags_value[node];
+    record.data_location = data_location[node];
+    record.compressed_size = compressed_size[node];
+    record.original_size = original_size[node];
+    record.extension = extension(node);
+}
+
+
+uint64_t NodeTable::memory_usage() const {
+    return location.capacity() * sizeof(uint64_t)
+         + type.capacity() * sizeof(HeaderRecord::kind)
+         + name_offset.capacity() * sizeof(uint32_t)
+         + (parent.capacity() + sibling.capacity() + child_dir.capacity() + child_file.capacity()) * sizeof(index)
+         + flags_value.capacity() * sizeof(uint16_t)
+         + (data_location.capacity() + compressed_size.capacity() + original_size.capacity()) * sizeof(uint64_t)
+         + by_location.capacity() * sizeof(index)
+         + unresolved_links.capacity() * sizeof(uint64_t)
+         + extension_offset.capacity() * sizeof(uint64_t)
+         + names.capacity()
+         + extensions.capacity();
+}
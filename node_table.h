@@ -0,0 +1,69 @@
+#ifndef NODE_TABLE_H
+#define NODE_TABLE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+
+#include "header_record.h"
+
+
+// Compact store of the headers decoded from table of contents. Tree is kept as a struct of arrays linked by indices,
+// and every distinct name is stored only once, in a single string arena.
+// It isn't the model: Folder and File objects, which Archive works with, are parsed from it only for the nodes
+// someone actually looks at
+class NodeTable : public HeaderSource {
+public:
+    typedef uint32_t index;
+    static constexpr index none = UINT32_MAX;
+
+    // one element per node
+    std::vector<uint64_t> location;                 // location of node's header in archive
+    std::vector<HeaderRecord::kind> type;
+    std::vector<uint32_t> name_offset;              // start of node's name in names
+    std::vector<index> parent;
+    std::vector<index> sibling;
+    std::vector<index> child_dir;                   // folders only
+    std::vector<index> child_file;                  // folders only
+    std::vector<uint16_t> flags_value;              // files only
+    std::vector<uint64_t> data_location;            // files only
+    std::vector<uint64_t> compressed_size;          // files only
+    std::vector<uint64_t> original_size;            // files only
+
+    std::string names;                              // arena of distinct names, each stored as [length 1B][name]
+    std::string extensions;                         // extensions of records, one after another
+    std::vector<uint64_t> extension_offset;         // start of node's extension in extensions, plus the end of the last one
+
+    uint64_t size() const;
+    void clear();
+    void reserve(uint64_t node_count);
+
+    // Adds node described by record, links between nodes are resolved later by link()
+    void add(const HeaderRecord& record);
+
+    // Turns locations of linked nodes into indices, returns false if some of them point at nothing
+    bool link();
+
+    // Index of the node with header at given location, or none
+    index find(uint64_t node_location) const;
+
+    std::string_view name(index node) const;
+    std::string_view extension(index node) const;
+
+    void read(uint64_t node_location, HeaderRecord::kind node_type, HeaderRecord& record) override;
+
+    // Bytes of memory taken by the table
+    uint64_t memory_usage() const;
+
+private:
+    std::vector<index> by_location;                 // indices of nodes sorted by their location
+    std::vector<uint64_t> unresolved_links;         // parent, sibling, child_dir, child_file locations, until link()
+
+    // hashes of names already in the arena, with their offsets, used only while the table is being filled
+    std::unordered_multimap<size_t, uint32_t> interned;
+
+    uint32_t intern(const std::string& node_name);
+};
+
+#endif // NODE_TABLE_H
@@ -0,0 +1,264 @@
+#include "table_of_contents.h"
+
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+#include "archive_structures.h"
+#include "misc/mapped_file.h"
+#include "misc/multithreading.h"
+#include "misc/project_exceptions.h"
+
+
+namespace {
+    uint64_t location_of(const std::weak_ptr<Folder>& ptr) {
+        if (is_uninitialized(ptr)) return 0;
+        return ptr.lock()->location;
+    }
+
+    HeaderRecord record_of(const Folder& folder) {
+        HeaderRecord record;
+        record.type = HeaderRecord::kind::folder;
+        record.location = folder.location;
+        record.name = folder.name;
+        record.parent_location = location_of(folder.parent_ptr);
+        if (folder.sibling_ptr) record.sibling_location = folder.sibling_ptr->location;
+        if (!folder.children_loaded) {
+            record.child_dir_location = folder.child_dir_location;
+            record.child_file_location = folder.child_file_location;
+        }
+        else {
+            if (folder.child_dir_ptr) record.child_dir_location = folder.child_dir_ptr->location;
+            if (folder.child_file_ptr) record.child_file_location = folder.child_file_ptr->location;
+        }
+        return record;
+    }
+
+    HeaderRecord record_of(const File& file) {
+        HeaderRecord record;
+        record.type = HeaderRecord::kind::file;
+        record.location = file.location;
+        record.name = file.name;
+        record.parent_location = location_of(file.parent_ptr);
+        if (file.sibling_ptr) record.sibling_location = file.sibling_ptr->location;
+        record.flags_value = file.flags_value;
+        record.data_location = file.data_location;
+        record.compressed_size = file.compressed_size;
+        record.original_size = file.original_size;
+        if (!file.blocks.empty())
+            record_extension::append(record.extension, record_extension::tag::block_index, file.blocks.encode());
+        if (file.modification_time != 0) {
+            std::string payload;
+            little_endian::append(payload, file.modification_time, 8);
+            record_extension::append(record.extension, record_extension::tag::modification_time, payload);
+        }
+        return record;
+    }
+
+    void append_record(std::string& block, const HeaderRecord& record) {
+        block.push_back((char)record.type);
+        little_endian::append(block, record.location, 8);
+        record.encode(block);
+        little_endian::append(block, record.extension.size(), 4);
+        block += record.extension;
+    }
+}
+
+
+void TableOfContents::read(uint64_t record_location, HeaderRecord::kind type, HeaderRecord& record) {
+    nodes.read(record_location, type, record);
+}
+
+
+bool TableOfContents::load(std::fstream& archive_stream, const MappedFile* archive_map) {
+    nodes.clear();
+    free_space.clear();
+    location = 0;
+
+    archive_stream.clear();
+    archive_stream.seekg(0, std::ios_base::end);
+    uint64_t archive_size = archive_stream.tellg();
+    if (archive_size < 1 + footer_size) return false;
+
+    bool mapped = archive_map != nullptr and archive_map->size() == archive_size;
+
+    uint8_t footer_buffer[footer_size];
+    const uint8_t* footer = footer_buffer;
+    if (mapped) footer = archive_map->data() + archive_size - footer_size;
+    else {
+        archive_stream.seekg(archive_size - footer_size);
+        archive_stream.read((char*)footer_buffer, footer_size);
+        if (!archive_stream) {
+            archive_stream.clear();
+            return false;
+        }
+    }
+    if (std::memcmp(footer + footer_size - 8, magic, 8) != 0) return false;
+
+    uint64_t toc_location  = little_endian::load(footer, 8);
+    uint64_t stored_size   = little_endian::load(footer + 8, 8);
+    uint64_t original_size = little_endian::load(footer + 16, 8);
+    uint64_t record_count  = little_endian::load(footer + 24, 8);
+    uint16_t flags         = little_endian::load(footer + 32, 2);
+
+    // anything appended after the table of contents makes it stale, and it won't end right before the footer anymore
+    if (toc_location == 0 or toc_location + stored_size + footer_size != archive_size) return false;
+    if (flags == 0 and stored_size != original_size) return false;
+
+    bool aborting_var = false;
+    Compression comp(aborting_var);
+    if (mapped) comp.borrow_text(archive_map->data() + toc_location, stored_size);
+    else {
+        archive_stream.seekg(toc_location);
+        comp.load_text(archive_stream, stored_size);    // the whole table in a single read
+        if (!archive_stream) {
+            archive_stream.clear();
+            return false;
+        }
+    }
+
+    if (flags != 0) {
+        bool finished = false;
+        uint8_t* key = nullptr;
+        uint8_t* metadata = nullptr;
+        uint32_t metadata_size = 0;
+        multithreading::processing_worker(multithreading::mode::decompress, &comp, flags, aborting_var,
+                                          &finished, key, metadata, metadata_size);
+        if (comp.size != original_size) return false;
+    }
+
+    if (!decode_records(comp.text, comp.size, record_count)) {
+        nodes.clear();
+        return false;
+    }
+
+    // without the map, ranges freed before are only lost, archive is valid either way
+    NodeTable::index root = nodes.find(1);
+    if (root != NodeTable::none) {
+        std::string_view ranges = record_extension::find(nodes.extension(root), record_extension::tag::free_space);
+        if (!ranges.empty()) free_space.decode(ranges);
+    }
+
+    this->location = toc_location;
+    return true;
+}
+
+
+bool TableOfContents::decode_records(const uint8_t* block, uint64_t block_size, uint64_t record_count) {
+    // every record takes at least this much, so the count can't be trusted if it says otherwise
+    if (record_count > block_size / (1 + 8 + Folder::base_metadata_size + 4)) return false;
+    nodes.reserve(record_count);
+
+    uint64_t bi = 0;    // block index
+    for (uint64_t i=0; i < record_count; ++i) {
+        if (block_size - bi < 1 + 8) return false;
+
+        HeaderRecord record;
+        record.type = (HeaderRecord::kind)block[bi];
+        record.location = little_endian::load(block + bi + 1, 8);
+        bi += 1 + 8;
+
+        uint32_t header_size = record.decode(block + bi, block_size - bi);
+        if (header_size == 0) return false;
+        bi += header_size;
+
+        if (block_size - bi < 4) return false;
+        uint32_t extension_size = little_endian::load(block + bi, 4);
+        bi += 4;
+        if (block_size - bi < extension_size) return false;
+        record.extension.assign((const char*)block + bi, extension_size);
+        bi += extension_size;
+
+        nodes.add(record);
+    }
+    return nodes.link();
+}
+
+
+void TableOfContents::write(std::fstream& archive_stream, const Folder& root, HeaderSource* unloaded_source,
+                            uint16_t flags) {
+    assert(archive_stream.is_open());
+
+    std::string block;
+    uint64_t record_count = 0;
+
+    // (location of first subfolder, location of first file) of folders that exist only in unloaded_source
+    std::vector<std::pair<uint64_t, uint64_t>> unloaded_left;
+
+    std::vector<const Folder*> folders_left = { &root };
+    while (!folders_left.empty()) {
+        const Folder* folder = folders_left.back();
+        folders_left.pop_back();
+
+        HeaderRecord record = record_of(*folder);
+        if (folder == &root and !free_space.empty())
+            record_extension::append(record.extension, record_extension::tag::free_space, free_space.encode());
+        append_record(block, record);
+        record_count++;
+
+        if (!folder->children_loaded) {
+            unloaded_left.emplace_back(folder->child_dir_location, folder->child_file_location);
+            continue;
+        }
+
+        for (const File* file = folder->child_file_ptr.get(); file != nullptr; file = file->sibling_ptr.get()) {
+            append_record(block, record_of(*file));
+            record_count++;
+        }
+        for (const Folder* child = folder->child_dir_ptr.get(); child != nullptr; child = child->sibling_ptr.get())
+            folders_left.push_back(child);
+    }
+
+    while (!unloaded_left.empty()) {
+        assert(unloaded_source != nullptr);
+        auto [child_dir_location, child_file_location] = unloaded_left.back();
+        unloaded_left.pop_back();
+
+        HeaderRecord record;
+        for (uint64_t pos = child_file_location; pos != 0; pos = record.sibling_location) {
+            unloaded_source->read(pos, HeaderRecord::kind::file, record);
+            append_record(block, record);
+            record_count++;
+        }
+        for (uint64_t pos = child_dir_location; pos != 0; pos = record.sibling_location) {
+            unloaded_source->read(pos, HeaderRecord::kind::folder, record);
+            append_record(block, record);
+            record_count++;
+            unloaded_left.emplace_back(record.child_dir_location, record.child_file_location);
+        }
+    }
+
+    bool aborting_var = false;
+    Compression comp(aborting_var);
+    comp.load_text((const uint8_t*)block.data(), block.size());
+
+    if (flags != 0 and block.size() <= (1u << 24)) {  // not bigger than the default block size
+        bool finished = false;
+        uint8_t* key = nullptr;
+        uint8_t* metadata = nullptr;
+        uint32_t metadata_size = 0;
+        multithreading::processing_worker(multithreading::mode::compress, &comp, flags, aborting_var,
+                                          &finished, key, metadata, metadata_size);
+    }
+    if (flags == 0 or comp.size >= block.size() or block.size() > (1u << 24)) {
+        // compressing didn't help, so it's stored as it is
+        flags = 0;
+        comp.load_text((const uint8_t*)block.data(), block.size());
+    }
+
+    archive_stream.seekp(0, std::ios_base::end);
+    location = archive_stream.tellp();
+    archive_stream.write((char*)comp.text, comp.size);
+
+    std::string footer;
+    little_endian::append(footer, location, 8);
+    little_endian::append(footer, comp.size, 8);
+    little_endian::append(footer, block.size(), 8);
+    little_endian::append(footer, record_count, 8);
+    little_endian::append(footer, flags, 2);
+    footer.append(magic, 8);
+    assert(footer.length() == footer_size);
+
+    archive_stream.write(footer.data(), footer.length());
+    archive_stream.flush();
+}
@@ -0,0 +1,47 @@
+#ifndef TABLE_OF_CONTENTS_H
+#define TABLE_OF_CONTENTS_H
+
+#include <string>
+#include <fstream>
+
+#include "header_record.h"
+#include "node_table.h"
+#include "free_space_map.h"
+
+
+struct Folder;
+class MappedFile;
+
+// Copy of every header in the archive, kept in a single contiguous block at the end of it.
+// Block is followed by a fixed-size footer, which points at it:
+// [toc_location 8B][stored_size 8B][original_size 8B][record_count 8B][flags 2B][magic 8B]
+// Every record in the block is [type 1B][location 8B][header, as in archive][extension_size 4B][extension],
+// see record_extension for what extension holds. Root's record also holds archive's free space map
+class TableOfContents : public HeaderSource {
+public:
+    static const uint8_t footer_size = 42;
+    static const uint16_t default_flags = 0b0000000000100111;  // BWT, MTF, RLE, rANS
+
+    uint64_t location = 0;                          // location of the block in archive, 0 if there's none
+    NodeTable nodes;                                // every header from the block
+    FreeSpaceMap free_space;                        // unused ranges of archive, written along with the headers
+
+    void read(uint64_t location, HeaderRecord::kind type, HeaderRecord& record) override;
+
+    // Loads table of contents from the end of archive, returns false if archive doesn't end with a valid one.
+    // If archive_map covers the whole archive, table is decoded straight from it, instead of being read first
+    bool load(std::fstream& archive_stream, const MappedFile* archive_map = nullptr);
+
+    // Writes table of contents of the whole model at the current end of archive.
+    // Headers of folders which children weren't loaded yet are taken from unloaded_source
+    void write(std::fstream& archive_stream, const Folder& root, HeaderSource* unloaded_source,
+               uint16_t flags = default_flags);
+
+private:
+    static constexpr char magic[9] = "tk2k.toc";
+
+    // Fills nodes with records from the (decompressed) block
+    bool decode_records(const uint8_t* block, uint64_t block_size, uint64_t record_count);
+};
+
+#endif // TABLE_OF_CONTENTS_H